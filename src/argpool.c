@@ -25,92 +25,651 @@
  */
 
 #include <sys/param.h>
+#include <sys/event.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/procctl.h>
+#include <sys/procdesc.h>
 #include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
-#include <assert.h>
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fts.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "argpool.h"
+#include "descpool.h"
 #include "params.h"
+#include "prng.h"
+#include "respool.h"
 #include "rman.h"
 #include "util.h"
 
-static struct rman dirfds;
-static struct rman fds;
-static struct rman memblks;
+/*
+ * The memblk pool is split into shards, one per fuzzer thread, each with its
+ * own lock. A thread adds the blocks it maps to its own shard but picks blocks
+ * from any shard, so that threads operate on each other's mappings without all
+ * serializing on a single pool lock.
+ *
+ * With several threads, the pool can't always be kept exact: a block may be
+ * unmapped by one thread after another has picked it, and its address reused
+ * before the first thread's cleanup runs. Updates are therefore tolerant of
+ * ranges being partially present, and the pool may briefly hold stale blocks.
+ */
+struct memblk_shard {
+	pthread_mutex_t	ms_lock;
+	struct rman	ms_rman;
+} __aligned(CACHE_LINE_SIZE);
 
-static void	hier_init(const char *, int);
-static void	hier_extend(int, int);
-static int	memblk_init(struct rman *);
+static struct descpool dirfds;
+static struct descpool fds;
+static pthread_mutex_t fds_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct respool respools[AP_RES_NTYPES];
+static __thread u_int ap_thread; /* the calling fuzzer thread */
+static struct memblk_shard *memblk_shards;
+static u_int memblk_nshards;
+static bool memblk_exact = true; /* pool matches the address space */
+static u_int memblk_sporders[RMAN_MAXALIGN];
+static int memblk_nsporders;
 
-static int
-memblk_init(struct rman *rman __unused)
+/*
+ * Each pool has a generation, bumped whenever the pool loses a member, so that
+ * a caller holding arguments drawn earlier can tell whether they might be
+ * stale. The memblk pool has one per shard; past AP_GEN_MAX, shards share.
+ * ap_drawn is a mask of the generations of the pools the calling thread has
+ * drawn from since it last called ap_drawn().
+ */
+enum {
+	AP_GEN_FD = AP_RES_NTYPES,
+	AP_GEN_DIRFD,
+	AP_GEN_MEMBLK,
+	AP_GEN_MAX = 64,
+};
+static atomic_ulong ap_gens[AP_GEN_MAX];
+static __thread uint64_t ap_draws;
+
+/* The regions mapped by memblk_init(), so that the pool can be rebuilt. */
+static struct arg_memblk *memblk_regions;
+static u_int memblk_nregions, memblk_maxregions;
+
+/*
+ * Ways of constructing the memblk pool; see the memblk-init-policy parameter.
+ */
+enum memblk_policy {
+	MEMBLK_MAP,
+	MEMBLK_CARVE,
+};
+
+static const char * const memblk_policies[] = {
+	[MEMBLK_MAP] =		"map",
+	[MEMBLK_CARVE] =	"carve",
+};
+
+/*
+ * Ways of faulting in memblks up front; see the memblk-prefault parameter.
+ */
+enum memblk_prefault {
+	MEMBLK_PREFAULT_NONE,
+	MEMBLK_PREFAULT_TOUCH,
+	MEMBLK_PREFAULT_POPULATE,
+	MEMBLK_PREFAULT_WILLNEED,
+};
+
+static const char * const memblk_prefaults[] = {
+	[MEMBLK_PREFAULT_NONE] =	"none",
+	[MEMBLK_PREFAULT_TOUCH] =	"touch",
+	[MEMBLK_PREFAULT_POPULATE] =	"populate",
+	[MEMBLK_PREFAULT_WILLNEED] =	"willneed",
+};
+
+static enum memblk_policy memblk_policy;
+static enum memblk_prefault memblk_prefault_mode;
+
+/*
+ * Ways of giving contents to the files in the random file hierarchy; see the
+ * hier-fill-mode parameter.
+ */
+enum hier_fill {
+	HIER_FILL_SPARSE,
+	HIER_FILL_PREALLOC,
+	HIER_FILL_WRITE,
+};
+
+static const char * const hier_fill_modes[] = {
+	[HIER_FILL_SPARSE] =	"sparse",
+	[HIER_FILL_PREALLOC] =	"prealloc",
+	[HIER_FILL_WRITE] =	"write",
+};
+
+struct hier_file {
+	int	fd;
+	off_t	size;
+};
+
+/* Files awaiting contents. */
+static struct hier_file *hier_files;
+static u_int hier_nfiles, hier_maxfiles;
+
+/* Bump this whenever the hierarchy generator changes. */
+#define	HIER_VERSION	2
+
+/*
+ * A hierarchy's manifest. The fields up to HM_FILES determine the key and
+ * therefore the shape of the tree; the rest describe the tree that resulted.
+ */
+enum {
+	HM_VERSION,
+	HM_KEY,
+	HM_SEED,
+	HM_DEPTH,
+	HM_MAXFSIZE,
+	HM_MAXFILES,
+	HM_MAXSUBDIRS,
+	HM_FILES,
+	HM_DIRS,
+	HM_BYTES,
+	HM_NFIELDS,
+};
+
+static const char *hier_manifest_fields[HM_NFIELDS] = {
+	[HM_VERSION] =		"version",
+	[HM_KEY] =		"key",
+	[HM_SEED] =		"seed",
+	[HM_DEPTH] =		"hier-depth",
+	[HM_MAXFSIZE] =		"hier-max-fsize",
+	[HM_MAXFILES] =		"hier-max-files-per-dir",
+	[HM_MAXSUBDIRS] =	"hier-max-subdirs-per-dir",
+	[HM_FILES] =		"files",
+	[HM_DIRS] =		"dirs",
+	[HM_BYTES] =		"bytes",
+};
+
+struct hier_manifest {
+	uintmax_t	hm_vals[HM_NFIELDS];
+};
+
+/*
+ * The hierarchy in use, and where it and its manifest live. hier_lockfd holds
+ * a lock on the tree for as long as the run uses it; it is exclusive until the
+ * tree is ready and shared after that. A private tree is one that only this
+ * run uses, and that gets no manifest.
+ */
+static struct hier_manifest hier_manifest;
+static char hier_path[PATH_MAX];
+static char hier_mpath[PATH_MAX];
+static int hier_lockfd = -1;
+static bool hier_private;
+
+enum hier_op {
+	HIER_CREATE,
+	HIER_VERIFY,
+	HIER_OPEN,
+};
+
+struct hier_walk {
+	struct prng	hw_prng;	/* shape generator state */
+	enum hier_op	hw_op;
+	u_int		hw_files;
+	u_int		hw_dirs;
+	u_int		hw_resized;	/* files whose size has changed */
+	uintmax_t	hw_bytes;
+	bool		hw_restore;	/* HIER_OPEN restores file sizes */
+};
+
+static void	ap_gen_bump(u_int);
+static void	ap_gen_draw(u_int);
+static int	hier_cached_cmp(const void *, const void *);
+static void	hier_create(bool);
+static void	hier_file_add(int, off_t);
+static void	hier_fill(enum hier_fill, u_int);
+static void	hier_fill_file(const struct hier_file *, enum hier_fill);
+static bool	hier_init(const char *, u_long);
+static int	hier_lock(const char *, int);
+static void	hier_manifest_init(struct hier_manifest *, u_long);
+static bool	hier_manifest_read(const char *, struct hier_manifest *);
+static void	hier_manifest_write(void);
+static void	hier_prune(const char *, u_int);
+static void	hier_prune_private(const char *, const char *);
+static void	hier_remove(const char *);
+static bool	hier_reuse(int, bool);
+static bool	hier_walk(struct hier_walk *, int, int);
+static void	hier_walk_done(const struct hier_walk *);
+static void	hier_walk_init(struct hier_walk *, enum hier_op);
+static void	memblk_init(enum memblk_policy, enum memblk_prefault);
+static u_int	memblk_gen(u_int);
+static void	memblk_prefault(void *, size_t, enum memblk_prefault);
+static void	memblk_region_add(void *, size_t);
+static void	memblk_shard_add(u_int, void *, size_t);
+static void	memblk_shards_fini(void);
+static void	memblk_shards_init(u_int);
+static void	memblk_track_superpages(void);
+static void	res_child(void) __dead2;
+static void	res_fd_destroy(int);
+static bool	res_kqueue_fill(struct respool *);
+static void	res_pid_destroy(int);
+static bool	res_pid_fill(struct respool *);
+static bool	res_pipe_fill(struct respool *);
+static bool	res_procdesc_fill(struct respool *);
+static bool	res_socket_fill(struct respool *);
+
+/*
+ * Map memblk-page-count pages of anonymous memory and add them to the memblk
+ * pool. With the "map" policy, each block is a separate mapping of up to
+ * memblk-max-size pages, some of which are superpage-aligned; with "carve",
+ * a single region is mapped and the pool hands out pieces of it. Blocks are
+ * then optionally prefaulted according to memblk-prefault.
+ */
+static void
+memblk_init(enum memblk_policy policy, enum memblk_prefault prefault)
 {
-	void *addr;
-	size_t len;
+	void *addr, *base;
+	size_t len, resv, sps;
 	u_int pgcnt;
 
+	sps = superpagesize();
 	pgcnt = param_number("memblk-page-count");
-	while (pgcnt > 0) {
+
+	if (policy == MEMBLK_CARVE) {
+		if (pgcnt == 0)
+			return;
+		/*
+		 * Reserve room for the worst case of single-page blocks with a
+		 * guard page after each, so that neighbouring blocks in a shard
+		 * don't merge back into a single range. The guards take no
+		 * memory and don't count towards memblk-page-count, and the
+		 * unused end of the reservation is given back.
+		 */
+		resv = (2 * (size_t)pgcnt - 1) * getpagesize();
+		base = mmap(NULL, resv, PROT_READ | PROT_WRITE,
+		    MAP_ANON | (sps != 0 && resv >= sps ?
+		    MAP_ALIGNED_SUPER : 0), -1, 0);
+		if (base == MAP_FAILED)
+			err(1, "mmap");
+
+		/*
+		 * Prefault the region in block-sized pieces, dealing them out
+		 * to the shards.
+		 */
+		addr = base;
+		for (u_int i = 0; pgcnt > 0; i++) {
+			len = rnd_range(param_number("memblk-max-size")) + 1;
+			if (len > pgcnt)
+				len = pgcnt;
+			pgcnt -= len;
+			len *= getpagesize();
+			memblk_prefault(addr, len, prefault);
+			memblk_shard_add(i % memblk_nshards, addr, len);
+			addr = (char *)addr + len;
+			if (pgcnt == 0)
+				break;
+			if (mmap(addr, getpagesize(), PROT_NONE,
+			    MAP_GUARD | MAP_FIXED, -1, 0) == MAP_FAILED)
+				err(1, "mmap");
+			addr = (char *)addr + getpagesize();
+		}
+		len = (char *)addr - (char *)base;
+		if (len < resv && munmap(addr, resv - len) != 0)
+			err(1, "munmap");
+		memblk_region_add(base, len);
+		return;
+	}
+
+	for (u_int i = 0; pgcnt > 0; i++) {
 		/*
 		 * Allow up to memblk-max-size pages in a memory block, clamp to
 		 * pgcnt.
 		 */
-		len = (random() % param_number("memblk-max-size")) + 1;
+		len = rnd_range(param_number("memblk-max-size")) + 1;
 		if (len > pgcnt)
 			len = pgcnt;
 		pgcnt -= len;
 		len *= getpagesize();
 
-		addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0);
-		if (addr == NULL)
+		/* Let some large blocks be promoted to superpages. */
+		addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_ANON | (sps != 0 && len >= sps && rnd_range(2) == 0 ?
+		    MAP_ALIGNED_SUPER : 0), -1, 0);
+		if (addr == MAP_FAILED)
 			err(1, "mmap");
-		if (random() % 2 == 0)
-			memset(addr, 0, len);
+		memblk_prefault(addr, len, prefault);
+
+		memblk_region_add(addr, len);
+		memblk_shard_add(i % memblk_nshards, addr, len);
+	}
+}
+
+static void
+memblk_region_add(void *addr, size_t len)
+{
+
+	if (memblk_nregions == memblk_maxregions) {
+		memblk_maxregions = memblk_maxregions == 0 ? 64 :
+		    memblk_maxregions * 2;
+		memblk_regions = realloc(memblk_regions,
+		    memblk_maxregions * sizeof(*memblk_regions));
+		if (memblk_regions == NULL)
+			err(1, "realloc");
+	}
+	memblk_regions[memblk_nregions].addr = addr;
+	memblk_regions[memblk_nregions].len = len;
+	memblk_nregions++;
+}
+
+/*
+ * Replace the memblk pool with a freshly mapped one. A fuzzer bound to a NUMA
+ * domain does this before it starts, so that its blocks are backed by pages
+ * from the local domain rather than by those the parent faulted in before
+ * forking. This must be called before any call has modified the pool.
+ */
+void
+ap_memblk_rebuild(void)
+{
+
+	for (u_int i = 0; i < memblk_nregions; i++)
+		if (munmap(memblk_regions[i].addr, memblk_regions[i].len) != 0)
+			err(1, "munmap");
+	memblk_nregions = 0;
+	memblk_shards_fini();
+	memblk_shards_init(memblk_nshards);
+	memblk_init(memblk_policy, memblk_prefault_mode);
+}
+
+static void
+memblk_shards_init(u_int n)
+{
+	struct memblk_shard *ms;
+	int error;
+
+	error = posix_memalign((void **)&memblk_shards, CACHE_LINE_SIZE,
+	    n * sizeof(*memblk_shards));
+	if (error != 0)
+		errc(1, error, "posix_memalign");
+	memblk_nshards = n;
+	for (u_int i = 0; i < n; i++) {
+		ms = &memblk_shards[i];
+		error = pthread_mutex_init(&ms->ms_lock, NULL);
+		if (error != 0)
+			errc(1, error, "pthread_mutex_init");
+		(void)rman_init(&ms->ms_rman, getpagesize(), NULL);
+		rman_set_validate(&ms->ms_rman,
+		    param_number("rman-validate-interval"));
+	}
+	memblk_track_superpages();
+}
+
+static void
+memblk_shards_fini(void)
+{
 
-		ap_memblk_map(addr, len);
+	for (u_int i = 0; i < memblk_nshards; i++) {
+		rman_fini(&memblk_shards[i].ms_rman);
+		pthread_mutex_destroy(&memblk_shards[i].ms_lock);
 	}
-	return (0);
+	free(memblk_shards);
+	memblk_shards = NULL;
+}
+
+static void
+memblk_shard_add(u_int i, void *addr, size_t len)
+{
+	struct memblk_shard *ms;
+
+	ms = &memblk_shards[i];
+	pthread_mutex_lock(&ms->ms_lock);
+	rman_add(&ms->ms_rman, (uintptr_t)addr, len);
+	pthread_mutex_unlock(&ms->ms_lock);
 }
 
+/*
+ * Set the index of the calling fuzzer thread, which determines the memblk
+ * shard that its new mappings go to.
+ */
+void
+ap_thread_init(u_int idx)
+{
+
+	ap_thread = idx;
+}
+
+/*
+ * Prefault a memory block. "touch" writes to each page of about half of the
+ * blocks, so that the pool holds a mix of resident and non-resident pages;
+ * "populate" writes to each page of every block. MAP_PREFAULT_READ only
+ * applies to vnode mappings, so anonymous memory has to be touched.
+ */
+static void
+memblk_prefault(void *addr, size_t len, enum memblk_prefault prefault)
+{
+	size_t pagesz;
+
+	switch (prefault) {
+	case MEMBLK_PREFAULT_NONE:
+		break;
+	case MEMBLK_PREFAULT_TOUCH:
+	case MEMBLK_PREFAULT_POPULATE:
+		if (prefault == MEMBLK_PREFAULT_TOUCH && rnd_range(2) != 0)
+			break;
+		pagesz = getpagesize();
+		for (size_t off = 0; off < len; off += pagesz)
+			((volatile char *)addr)[off] = 0;
+		break;
+	case MEMBLK_PREFAULT_WILLNEED:
+		if (madvise(addr, len, MADV_WILLNEED) != 0)
+			err(1, "madvise");
+		break;
+	}
+}
+
+static u_int
+memblk_gen(u_int shard)
+{
+
+	return (AP_GEN_MEMBLK + shard % (AP_GEN_MAX - AP_GEN_MEMBLK));
+}
+
+static void
+ap_gen_bump(u_int gen)
+{
+
+	atomic_fetch_add_explicit(&ap_gens[gen], 1, memory_order_relaxed);
+}
+
+static void
+ap_gen_draw(u_int gen)
+{
+
+	ap_draws |= (uint64_t)1 << gen;
+}
+
+/*
+ * Add a new mapping to the calling thread's shard. Any other shard still
+ * holding a stale block at the same address forgets about it.
+ */
 void
 ap_memblk_map(void *addr, size_t len)
 {
+	struct memblk_shard *ms;
+	u_long released;
+	u_int own;
 
-	rman_add(&memblks, (uintptr_t)addr, len);
+	own = ap_thread % memblk_nshards;
+	for (u_int i = 0; i < memblk_nshards; i++) {
+		if (i == own)
+			continue;
+		ms = &memblk_shards[i];
+		pthread_mutex_lock(&ms->ms_lock);
+		released = rman_release_overlap(&ms->ms_rman, (uintptr_t)addr,
+		    len);
+		pthread_mutex_unlock(&ms->ms_lock);
+		if (released != 0)
+			ap_gen_bump(memblk_gen(i));
+	}
+	memblk_shard_add(own, addr, len);
 }
 
 /*
- * Randomly pick a memory block from the pool.
+ * Randomly pick a memory block from the pool, starting with a random shard and
+ * moving on if it's empty.
  */
 int
 ap_memblk_random(struct arg_memblk *memblk)
 {
+	struct memblk_shard *ms;
+	u_long start, len;
+	u_int i;
+	int error;
+
+	i = rnd_range(memblk_nshards);
+	for (u_int n = 0; n < memblk_nshards; n++) {
+		ms = &memblk_shards[i];
+		pthread_mutex_lock(&ms->ms_lock);
+		error = rman_select(&ms->ms_rman, &start, &len, 0);
+		pthread_mutex_unlock(&ms->ms_lock);
+		if (error == 0) {
+			ap_gen_draw(memblk_gen(i));
+			memblk->addr = (void *)(uintptr_t)start;
+			memblk->len = len;
+			return (0);
+		}
+		if (++i == memblk_nshards)
+			i = 0;
+	}
+	return (1);
+}
+
+/*
+ * Randomly pick a memory block whose address and length are multiples of a
+ * superpage size, for exercising superpage promotion and demotion. Blocks are
+ * at most memblk-max-size pages long unless that is smaller than a superpage.
+ * Returns non-zero if the system has no superpages or the pool holds no
+ * suitably aligned blocks.
+ */
+int
+ap_memblk_random_super(struct arg_memblk *memblk)
+{
+	struct memblk_shard *ms;
 	u_long start, len;
+	u_int i, maxchunks, order;
+	int error;
 
-	if (rman_select(&memblks, &start, &len, 0))
+	if (memblk_nsporders == 0)
 		return (1);
-	memblk->addr = (void *)(uintptr_t)start;
-	memblk->len = len;
-	return (0);
+	order = memblk_sporders[rnd_range(memblk_nsporders)];
+	maxchunks = max(param_number("memblk-max-size") >> order, 1);
+	i = rnd_range(memblk_nshards);
+	for (u_int n = 0; n < memblk_nshards; n++) {
+		ms = &memblk_shards[i];
+		pthread_mutex_lock(&ms->ms_lock);
+		error = rman_select_aligned(&ms->ms_rman, order, &start, &len,
+		    maxchunks);
+		pthread_mutex_unlock(&ms->ms_lock);
+		if (error == 0) {
+			ap_gen_draw(memblk_gen(i));
+			memblk->addr = (void *)(uintptr_t)start;
+			memblk->len = len;
+			return (0);
+		}
+		if (++i == memblk_nshards)
+			i = 0;
+	}
+	return (1);
+}
+
+/*
+ * Stop relying on the memblk pool matching the address space. A replayed or
+ * minimized call sequence may unmap ranges that the replay never mapped, for
+ * instance because the mmap(2) call that created them was left out.
+ */
+void
+ap_memblk_inexact(void)
+{
+
+	memblk_exact = false;
 }
 
+/*
+ * Remove an unmapped range from the pool. With a single shard the pool is
+ * exact, so the range must be present, unless ap_memblk_inexact() was called;
+ * otherwise whatever parts of it are still present in any shard are removed.
+ */
 void
 ap_memblk_unmap(void *addr, size_t len)
 {
+	struct memblk_shard *ms;
+	u_long released;
 
-	rman_release(&memblks, (u_long)(uintptr_t)addr, len);
+	for (u_int i = 0; i < memblk_nshards; i++) {
+		ms = &memblk_shards[i];
+		pthread_mutex_lock(&ms->ms_lock);
+		if (memblk_nshards == 1 && memblk_exact) {
+			rman_release(&ms->ms_rman, (uintptr_t)addr, len);
+			released = len;
+		} else
+			released = rman_release_overlap(&ms->ms_rman,
+			    (uintptr_t)addr, len);
+		pthread_mutex_unlock(&ms->ms_lock);
+		if (released != 0)
+			ap_gen_bump(memblk_gen(i));
+	}
+}
+
+/*
+ * Have the memblk shards keep track of the chunks aligned to each superpage
+ * size, so that ap_memblk_random_super() can find them quickly. The shards are
+ * all empty, so tracking succeeds for all of them or for none.
+ */
+static void
+memblk_track_superpages(void)
+{
+	size_t sizes[MAXPAGESIZES];
+	u_int order;
+	int n;
+
+	memblk_nsporders = 0;
+	n = getpagesizes(sizes, nitems(sizes));
+	for (int i = 1; i < n && memblk_nsporders < RMAN_MAXALIGN; i++) {
+		order = ffsl(sizes[i] / sizes[0]) - 1;
+		if (rman_track_align(&memblk_shards[0].ms_rman, order) != 0)
+			continue;
+		for (u_int j = 1; j < memblk_nshards; j++)
+			(void)rman_track_align(&memblk_shards[j].ms_rman,
+			    order);
+		memblk_sporders[memblk_nsporders++] = order;
+	}
 }
 
 /*
- * Create a random file hierarchy rooted at the specified path.
+ * Create a random file hierarchy under the directory root, or reuse the one
+ * left there by an earlier run. Returns true if an existing hierarchy was
+ * reused, in which case its files already have their contents.
+ *
+ * The shape of the hierarchy (names, file sizes and fan-out) is generated from
+ * a private PRNG state keyed by the seed and the hier-* parameters, so the
+ * same key always produces the same tree. The tree is created in root/<key>,
+ * and once its files have been filled, a manifest recording the key inputs and
+ * the tree's size is written to root/<key>.manifest. A later run with the same
+ * key finds the manifest, regenerates the shape in memory and checks that every
+ * file and directory is still present before opening them; otherwise the tree
+ * is discarded and rebuilt. Each run holds a shared flock(2) on the tree it
+ * uses, and a tree is only removed, or has its files' sizes restored, under an
+ * exclusive one, so that neither a rebuild nor hier_prune() changes a tree
+ * out from under another run.
  *
  * The size of the resulting file hierarchy is bounded by four parameters:
  * hier-depth, hier-max-fsize, hier-max-files-per-dir, and
@@ -127,149 +686,990 @@ ap_memblk_unmap(void *addr, size_t len)
  *
  * XXX we need to have some symlinks and hard links.
  */
-static void
-hier_init(const char *path, int depth)
+static bool
+hier_init(const char *root, u_long seed)
 {
 	struct stat sb;
 	int fd;
 
-	if (stat(path, &sb) == 0) {
+	if (stat(root, &sb) == 0) {
 		if (!S_ISDIR(sb.st_mode))
-			errx(1, "path '%s' exists and isn't a directory", path);
-	} else if (mkdir(path, 0777) != 0)
-		err(1, "couldn't create '%s'", path);
+			errx(1, "path '%s' exists and isn't a directory", root);
+	} else if (mkdir(root, 0777) != 0)
+		err(1, "couldn't create '%s'", root);
+
+	hier_manifest_init(&hier_manifest, seed);
+	(void)snprintf(hier_path, sizeof(hier_path), "%s/%016jx", root,
+	    hier_manifest.hm_vals[HM_KEY]);
+	(void)snprintf(hier_mpath, sizeof(hier_mpath), "%s.manifest",
+	    hier_path);
+
+	/*
+	 * Take the cached tree for ourselves if no other run is using it.
+	 * Otherwise share it, which also waits for a run that is still
+	 * filling it in.
+	 */
+	fd = hier_lock(hier_path, LOCK_EX | LOCK_NB);
+	if (fd >= 0) {
+		if (hier_reuse(fd, true))
+			return (true);
+	} else if ((fd = hier_lock(hier_path, LOCK_SH)) >= 0) {
+		if (hier_reuse(fd, false))
+			return (true);
+		(void)close(fd);
+		warnx("cached hierarchy '%s' is unusable and in use by another "
+		    "run, creating a private one", hier_path);
+		hier_create(true);
+		return (false);
+	}
+
+	/*
+	 * Nothing usable is cached, so start over. The manifest goes first so
+	 * that it never describes a partial tree.
+	 */
+	if (unlink(hier_mpath) != 0 && errno != ENOENT)
+		err(1, "unlink(%s)", hier_mpath);
+	if (fd >= 0) {
+		hier_remove(hier_path);
+		(void)close(fd);
+	} else if (lstat(hier_path, &sb) == 0 && !S_ISDIR(sb.st_mode) &&
+	    unlink(hier_path) != 0)
+		err(1, "unlink(%s)", hier_path);
+	hier_create(false);
+	return (false);
+}
+
+/*
+ * Create the tree under a temporary name, holding an exclusive lock on it, and
+ * then rename it into place, so that other runs never see a partial tree. The
+ * lock is held until hier_manifest_write() has recorded the filled tree. If
+ * private is set, or if another run got its tree into place first, the tree
+ * keeps its temporary name and is used by this run alone; hier_prune() removes
+ * it once the run has exited.
+ */
+static void
+hier_create(bool private)
+{
+	char tmp[PATH_MAX];
+	struct hier_walk hw;
+	struct stat sb;
+	int fd;
+
+	(void)snprintf(tmp, sizeof(tmp), "%s.%d", hier_path, getpid());
+	if (lstat(tmp, &sb) == 0)
+		hier_remove(tmp);
+	if (mkdir(tmp, 0777) != 0)
+		err(1, "couldn't create '%s'", tmp);
+	fd = hier_lock(tmp, LOCK_EX);
+	if (fd < 0)
+		err(1, "opening '%s'", tmp);
+	hier_walk_init(&hw, HIER_CREATE);
+	(void)hier_walk(&hw, fd, hier_manifest.hm_vals[HM_DEPTH]);
+	hier_lockfd = fd;
+	hier_walk_done(&hw);
+
+	if (!private && rename(tmp, hier_path) == 0)
+		return;
+	if (!private) {
+		if (errno != EEXIST && errno != ENOTEMPTY)
+			err(1, "rename(%s, %s)", tmp, hier_path);
+		warnx("another run created '%s' first, using '%s'", hier_path,
+		    tmp);
+	}
+	hier_private = true;
+	(void)snprintf(hier_path, sizeof(hier_path), "%s", tmp);
+}
+
+/*
+ * Use the tree that fd has locked if it matches its manifest. Files whose size
+ * an earlier run changed are only restored if the lock is exclusive, i.e., no
+ * other run is using the tree; the lock is then downgraded so that later runs
+ * can share the tree.
+ */
+static bool
+hier_reuse(int fd, bool excl)
+{
+	struct hier_manifest hm;
+	struct hier_walk hw;
+
+	if (!hier_manifest_read(hier_mpath, &hm) ||
+	    memcmp(hm.hm_vals, hier_manifest.hm_vals,
+	    HM_FILES * sizeof(hm.hm_vals[0])) != 0)
+		return (false);
+	hier_walk_init(&hw, HIER_VERIFY);
+	if (!hier_walk(&hw, fd, hier_manifest.hm_vals[HM_DEPTH]) ||
+	    hw.hw_files != hm.hm_vals[HM_FILES] ||
+	    hw.hw_dirs != hm.hm_vals[HM_DIRS]) {
+		warnx("cached hierarchy '%s' doesn't match its manifest",
+		    hier_path);
+		return (false);
+	}
+	if (hw.hw_resized > 0 && excl)
+		warnx("restoring the sizes of %u files in '%s'",
+		    hw.hw_resized, hier_path);
+	else if (hw.hw_resized > 0)
+		warnx("%u files in '%s' have changed size, leaving them as "
+		    "another run is using it", hw.hw_resized, hier_path);
+	hier_walk_init(&hw, HIER_OPEN);
+	hw.hw_restore = excl;
+	(void)hier_walk(&hw, fd, hier_manifest.hm_vals[HM_DEPTH]);
+	hier_walk_done(&hw);
+	if (excl && flock(fd, LOCK_SH) != 0)
+		err(1, "flock(%s)", hier_path);
+	hier_lockfd = fd;
+
+	/* Mark the tree as recently used for hier_prune(). */
+	if (utimes(hier_mpath, NULL) != 0)
+		warn("utimes(%s)", hier_mpath);
+	return (true);
+}
+
+/*
+ * Open the tree at path and flock(2) it. Returns -1 if the tree doesn't exist,
+ * if it went away while waiting for the lock, or if LOCK_NB was given and
+ * another run holds a conflicting lock.
+ */
+static int
+hier_lock(const char *path, int how)
+{
+	struct stat fsb, psb;
+	int fd;
 
 	fd = open(path, O_DIRECTORY | O_RDONLY);
 	if (fd < 0)
-		err(1, "opening '%s'", path);
-	hier_extend(fd, depth);
-	(void)close(fd);
+		return (-1);
+	if (flock(fd, how) != 0) {
+		if (errno != EWOULDBLOCK)
+			err(1, "flock(%s)", path);
+		(void)close(fd);
+		return (-1);
+	}
+	if (fstat(fd, &fsb) != 0 || stat(path, &psb) != 0 ||
+	    fsb.st_dev != psb.st_dev || fsb.st_ino != psb.st_ino) {
+		(void)close(fd);
+		return (-1);
+	}
+	return (fd);
 }
 
 static void
-hier_extend(int dirfd, int depth)
+hier_walk_init(struct hier_walk *hw, enum hier_op op)
 {
-	char buf[16384], file[NAME_MAX];
-	ssize_t nbytes;
-	u_int fsize;
-	int fd, numfiles;
 
-	memset(buf, 0, sizeof(buf));
+	prng_seed(&hw->hw_prng, hier_manifest.hm_vals[HM_KEY]);
+	hw->hw_op = op;
+	hw->hw_files = hw->hw_dirs = hw->hw_resized = 0;
+	hw->hw_bytes = 0;
+	hw->hw_restore = false;
+}
+
+static void
+hier_walk_done(const struct hier_walk *hw)
+{
+
+	hier_manifest.hm_vals[HM_FILES] = hw->hw_files;
+	hier_manifest.hm_vals[HM_DIRS] = hw->hw_dirs;
+	hier_manifest.hm_vals[HM_BYTES] = hw->hw_bytes;
+}
+
+/*
+ * Generate one level of the hierarchy. Every operation draws the same sequence
+ * of names and sizes from the walk's state, so the three of them visit the same
+ * tree:
+ *
+ * - HIER_CREATE creates the files and directories and adds them to the argument
+ *   pools. Files are created empty; their contents are filled in later by
+ *   hier_fill().
+ * - HIER_VERIFY checks that each file and directory exists and has the right
+ *   type, returning false at the first one that doesn't, and counts the files
+ *   whose size an earlier run changed.
+ * - HIER_OPEN opens an existing tree and adds it to the argument pools. If
+ *   hw_restore is set, files whose size was changed by an earlier run are
+ *   truncated back to the expected size.
+ */
+static bool
+hier_walk(struct hier_walk *hw, int dirfd, int depth)
+{
+	char file[NAME_MAX];
+	struct stat sb;
+	off_t fsize;
+	int fd, numfiles;
 
-	numfiles = (random() % param_number("hier-max-files-per-dir")) + 1;
+	numfiles = prng_range(&hw->hw_prng,
+	    param_number("hier-max-files-per-dir")) + 1;
 
-	/* Create files. */
 	for (int i = 0; i < numfiles; i++) {
-		randfile(file);
-		fd = openat(dirfd, file, O_CREAT | O_RDWR, 0666);
-		if (fd < 0)
-			err(1, "opening '%s'", file);
+		randfile(file, &hw->hw_prng);
+		fsize = prng_range(&hw->hw_prng,
+		    param_number("hier-max-fsize"));
+		hw->hw_files++;
+		hw->hw_bytes += fsize;
 
-		fsize = random() % param_number("hier-max-fsize");
-		while (fsize > 0) {
-			nbytes = write(fd, buf,
-			    fsize > sizeof(buf) ? sizeof(buf) : fsize);
-			if (nbytes < 0)
-				err(1, "writing to '%s'", file);
-			fsize -= nbytes;
+		switch (hw->hw_op) {
+		case HIER_CREATE:
+			fd = openat(dirfd, file, O_CREAT | O_RDWR, 0666);
+			if (fd < 0)
+				err(1, "opening '%s'", file);
+			hier_file_add(fd, fsize);
+			ap_fd_add(fd);
+			break;
+		case HIER_VERIFY:
+			if (fstatat(dirfd, file, &sb,
+			    AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(sb.st_mode))
+				return (false);
+			if (sb.st_size != fsize)
+				hw->hw_resized++;
+			break;
+		case HIER_OPEN:
+			fd = openat(dirfd, file, O_RDWR);
+			if (fd < 0)
+				err(1, "opening '%s'", file);
+			if (fstat(fd, &sb) != 0)
+				err(1, "fstat");
+			if (hw->hw_restore && sb.st_size != fsize &&
+			    ftruncate(fd, fsize) != 0)
+				err(1, "ftruncate");
+			ap_fd_add(fd);
+			break;
 		}
-		ap_fd_add(fd);
 	}
 
 	if (depth <= 1)
-		return;
+		return (true);
 
-	numfiles = (random() % param_number("hier-max-subdirs-per-dir")) + 1;
+	numfiles = prng_range(&hw->hw_prng,
+	    param_number("hier-max-subdirs-per-dir")) + 1;
 
-	/* Create subdirs. */
 	for (int i = 0; i < numfiles; i++) {
-		randfile(file);
-		if (mkdirat(dirfd, file, 0777) != 0)
+		randfile(file, &hw->hw_prng);
+		hw->hw_dirs++;
+
+		if (hw->hw_op == HIER_CREATE && mkdirat(dirfd, file, 0777) != 0)
 			err(1, "creating directory '%s'", file);
-		fd = openat(dirfd, file, O_DIRECTORY | O_RDONLY);
-		if (fd < 0)
+		fd = openat(dirfd, file, O_DIRECTORY | O_RDONLY | O_NOFOLLOW);
+		if (fd < 0) {
+			if (hw->hw_op == HIER_VERIFY)
+				return (false);
 			err(1, "opening directory '%s'", file);
-		hier_extend(fd, depth - 1);
-		ap_dirfd_add(fd);
+		}
+		if (!hier_walk(hw, fd, depth - 1)) {
+			(void)close(fd);
+			return (false);
+		}
+		if (hw->hw_op == HIER_VERIFY)
+			(void)close(fd);
+		else
+			ap_dirfd_add(fd);
 	}
+	return (true);
 }
 
+/*
+ * Queue a newly created file to be given its contents by hier_fill().
+ */
 static void
-descpool_add(struct rman *rman, int fd)
+hier_file_add(int fd, off_t size)
 {
 
-	rman_add(rman, fd, 1);
+	if (hier_nfiles == hier_maxfiles) {
+		hier_maxfiles = hier_maxfiles == 0 ? 64 : hier_maxfiles * 2;
+		hier_files = realloc(hier_files,
+		    hier_maxfiles * sizeof(*hier_files));
+		if (hier_files == NULL)
+			err(1, "realloc");
+	}
+	hier_files[hier_nfiles].fd = fd;
+	hier_files[hier_nfiles].size = size;
+	hier_nfiles++;
 }
 
+/*
+ * Fill in the manifest fields that make up the key, and compute the key itself
+ * as an FNV-1a hash of them.
+ */
 static void
-descpool_release(struct rman *rman, int fd)
+hier_manifest_init(struct hier_manifest *hm, u_long seed)
 {
+	uint64_t key;
 
-	rman_release(rman, fd, 1);
+	memset(hm, 0, sizeof(*hm));
+	hm->hm_vals[HM_VERSION] = HIER_VERSION;
+	hm->hm_vals[HM_SEED] = seed;
+	hm->hm_vals[HM_DEPTH] = param_number("hier-depth");
+	hm->hm_vals[HM_MAXFSIZE] = param_number("hier-max-fsize");
+	hm->hm_vals[HM_MAXFILES] = param_number("hier-max-files-per-dir");
+	hm->hm_vals[HM_MAXSUBDIRS] = param_number("hier-max-subdirs-per-dir");
+
+	key = 0xcbf29ce484222325ull;
+	for (int i = 0; i < HM_FILES; i++) {
+		if (i == HM_KEY)
+			continue;
+		for (int j = 0; j < 64; j += 8) {
+			key ^= (hm->hm_vals[i] >> j) & 0xff;
+			key *= 0x100000001b3ull;
+		}
+	}
+	hm->hm_vals[HM_KEY] = key;
+}
+
+/*
+ * Read a manifest. Returns false if it doesn't exist or is incomplete.
+ */
+static bool
+hier_manifest_read(const char *path, struct hier_manifest *hm)
+{
+	char name[32];
+	FILE *f;
+	uintmax_t val;
+	u_int i, seen;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return (false);
+	seen = 0;
+	while (fscanf(f, "%31s %ju", name, &val) == 2) {
+		for (i = 0; i < HM_NFIELDS; i++)
+			if (strcmp(name, hier_manifest_fields[i]) == 0)
+				break;
+		if (i == HM_NFIELDS)
+			continue;
+		hm->hm_vals[i] = val;
+		seen |= 1u << i;
+	}
+	(void)fclose(f);
+	return (seen == (1u << HM_NFIELDS) - 1);
 }
 
+/*
+ * Write out the manifest for a freshly created hierarchy. This happens only
+ * once its files have their contents, and the rename makes it atomic, so a run
+ * that dies part way through never leaves a manifest for a partial tree. Other
+ * runs may then share the tree. A private tree gets no manifest and stays
+ * exclusively locked.
+ */
+static void
+hier_manifest_write(void)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	if (hier_private)
+		return;
+	(void)snprintf(tmp, sizeof(tmp), "%s.tmp", hier_mpath);
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		err(1, "fopen(%s)", tmp);
+	for (int i = 0; i < HM_NFIELDS; i++)
+		fprintf(f, "%s %ju\n", hier_manifest_fields[i],
+		    hier_manifest.hm_vals[i]);
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		err(1, "writing '%s'", tmp);
+	(void)fclose(f);
+	if (rename(tmp, hier_mpath) != 0)
+		err(1, "rename(%s, %s)", tmp, hier_mpath);
+	if (flock(hier_lockfd, LOCK_SH) != 0)
+		err(1, "flock(%s)", hier_path);
+}
+
+/*
+ * Recursively remove a cached hierarchy.
+ */
+static void
+hier_remove(const char *path)
+{
+	char *paths[2];
+	FTS *fts;
+	FTSENT *ent;
+
+	paths[0] = xstrdup(path);
+	paths[1] = NULL;
+	fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+	if (fts == NULL)
+		err(1, "fts_open(%s)", path);
+	while ((ent = fts_read(fts)) != NULL) {
+		switch (ent->fts_info) {
+		case FTS_D:
+			break;
+		case FTS_DP:
+			if (rmdir(ent->fts_accpath) != 0)
+				warn("rmdir(%s)", ent->fts_path);
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			warnc(ent->fts_errno, "%s", ent->fts_path);
+			break;
+		default:
+			if (unlink(ent->fts_accpath) != 0)
+				warn("unlink(%s)", ent->fts_path);
+			break;
+		}
+	}
+	(void)fts_close(fts);
+	free(paths[0]);
+}
+
+struct hier_cached {
+	char		name[32];
+	struct timespec	mtime;
+};
+
 static int
-descpool_select(struct rman *rman)
+hier_cached_cmp(const void *a, const void *b)
 {
-	u_long start, len;
+	const struct hier_cached *ca, *cb;
 
-	rman_select(rman, &start, &len, 1);
-	assert(len == 1);
-	return ((int)start);
+	ca = a;
+	cb = b;
+	if (ca->mtime.tv_sec != cb->mtime.tv_sec)
+		return (ca->mtime.tv_sec > cb->mtime.tv_sec ? -1 : 1);
+	if (ca->mtime.tv_nsec != cb->mtime.tv_nsec)
+		return (ca->mtime.tv_nsec > cb->mtime.tv_nsec ? -1 : 1);
+	return (strcmp(ca->name, cb->name));
+}
+
+/*
+ * Remove a tree that a run created under its temporary name, root/<key>.<pid>,
+ * and never put into place, once that run has exited.
+ */
+static void
+hier_prune_private(const char *root, const char *name)
+{
+	char path[PATH_MAX];
+	pid_t pid;
+	int fd;
+
+	pid = (pid_t)strtol(strchr(name, '.') + 1, NULL, 10);
+	if (pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH)
+		return;
+	(void)snprintf(path, sizeof(path), "%s/%s", root, name);
+	fd = hier_lock(path, LOCK_EX | LOCK_NB);
+	if (fd < 0)
+		return;
+	hier_remove(path);
+	(void)close(fd);
+}
+
+/*
+ * Keep only the "keep" most recently used hierarchies under root. The one in
+ * use is never removed and counts as one of them, and neither is any that
+ * another run has locked. Private trees of runs that have exited go as well.
+ */
+static void
+hier_prune(const char *root, u_int keep)
+{
+	char path[PATH_MAX];
+	struct hier_cached *cached;
+	struct dirent *dp;
+	struct stat sb;
+	DIR *dir;
+	size_t len;
+	u_int cnt, maxcnt;
+	int fd;
+
+	dir = opendir(root);
+	if (dir == NULL)
+		err(1, "opendir(%s)", root);
+	cached = NULL;
+	cnt = maxcnt = 0;
+	while ((dp = readdir(dir)) != NULL) {
+		len = strlen(dp->d_name);
+		if (len > 17 && strspn(dp->d_name, "0123456789abcdef") == 16 &&
+		    dp->d_name[16] == '.' &&
+		    strspn(dp->d_name + 17, "0123456789") == len - 17) {
+			hier_prune_private(root, dp->d_name);
+			continue;
+		}
+		if (len != 16 + strlen(".manifest") ||
+		    strspn(dp->d_name, "0123456789abcdef") != 16 ||
+		    strcmp(dp->d_name + 16, ".manifest") != 0)
+			continue;
+		if (strncmp(dp->d_name, strrchr(hier_path, '/') + 1, 16) == 0 ||
+		    fstatat(dirfd(dir), dp->d_name, &sb, 0) != 0)
+			continue;
+		if (cnt == maxcnt) {
+			maxcnt = maxcnt == 0 ? 16 : maxcnt * 2;
+			cached = realloc(cached, maxcnt * sizeof(*cached));
+			if (cached == NULL)
+				err(1, "realloc");
+		}
+		memcpy(cached[cnt].name, dp->d_name, 16);
+		cached[cnt].name[16] = '\0';
+		cached[cnt].mtime = sb.st_mtim;
+		cnt++;
+	}
+	(void)closedir(dir);
+
+	qsort(cached, cnt, sizeof(*cached), hier_cached_cmp);
+	for (u_int i = keep > 0 ? keep - 1 : 0; i < cnt; i++) {
+		(void)snprintf(path, sizeof(path), "%s/%s", root,
+		    cached[i].name);
+		/* Skip trees in use; a manifest without a tree just goes. */
+		fd = hier_lock(path, LOCK_EX | LOCK_NB);
+		if (fd < 0 && lstat(path, &sb) == 0)
+			continue;
+		/* Remove the manifest first so the tree is never trusted. */
+		(void)snprintf(path, sizeof(path), "%s/%s.manifest", root,
+		    cached[i].name);
+		if (unlink(path) != 0)
+			warn("unlink(%s)", path);
+		if (fd < 0)
+			continue;
+		(void)snprintf(path, sizeof(path), "%s/%s", root,
+		    cached[i].name);
+		hier_remove(path);
+		(void)close(fd);
+	}
+	free(cached);
+}
+
+/*
+ * Give a file its contents according to hier-fill-mode.
+ */
+static void
+hier_fill_file(const struct hier_file *hf, enum hier_fill mode)
+{
+	static const char zeroes[16384];
+	ssize_t nbytes;
+	off_t resid;
+	int error;
+
+	switch (mode) {
+	case HIER_FILL_SPARSE:
+		if (ftruncate(hf->fd, hf->size) != 0)
+			err(1, "ftruncate");
+		break;
+	case HIER_FILL_PREALLOC:
+		if (hf->size == 0)
+			break;
+		error = posix_fallocate(hf->fd, 0, hf->size);
+		if (error == 0)
+			break;
+		if (error != EINVAL && error != EOPNOTSUPP &&
+		    error != ENODEV) {
+			errno = error;
+			err(1, "posix_fallocate");
+		}
+		/* The filesystem can't preallocate, so leave a hole. */
+		if (ftruncate(hf->fd, hf->size) != 0)
+			err(1, "ftruncate");
+		break;
+	case HIER_FILL_WRITE:
+		for (resid = hf->size; resid > 0; resid -= nbytes) {
+			nbytes = write(hf->fd, zeroes,
+			    min(resid, (off_t)sizeof(zeroes)));
+			if (nbytes < 0)
+				err(1, "write");
+		}
+		break;
+	}
+}
+
+struct hier_fill_ctx {
+	pthread_mutex_t	lock;
+	enum hier_fill	mode;
+	u_int		next;	/* next file to fill */
+};
+
+static void *
+hier_fill_worker(void *arg)
+{
+	struct hier_fill_ctx *ctx;
+	u_int i;
+
+	ctx = arg;
+	for (;;) {
+		pthread_mutex_lock(&ctx->lock);
+		i = ctx->next++;
+		pthread_mutex_unlock(&ctx->lock);
+		if (i >= hier_nfiles)
+			break;
+		hier_fill_file(&hier_files[i], ctx->mode);
+	}
+	return (NULL);
+}
+
+/*
+ * Fill in the contents of all files created by hier_walk(), spreading the
+ * work across hier-fill-threads threads.
+ */
+static void
+hier_fill(enum hier_fill mode, u_int nthreads)
+{
+	struct hier_fill_ctx ctx;
+	pthread_t *threads;
+	int error;
+
+	nthreads = max(min(nthreads, hier_nfiles), 1);
+	threads = xmalloc(nthreads * sizeof(*threads));
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	ctx.mode = mode;
+	ctx.next = 0;
+	for (u_int i = 0; i < nthreads; i++) {
+		error = pthread_create(&threads[i], NULL, hier_fill_worker,
+		    &ctx);
+		if (error != 0)
+			errc(1, error, "pthread_create");
+	}
+	for (u_int i = 0; i < nthreads; i++)
+		(void)pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&ctx.lock);
+
+	free(threads);
+	free(hier_files);
+	hier_files = NULL;
+	hier_maxfiles = 0;
 }
 
 void
 ap_fd_add(int fd)
 {
 
+	pthread_mutex_lock(&fds_lock);
 	descpool_add(&fds, fd);
+	pthread_mutex_unlock(&fds_lock);
 }
 
 void
 ap_fd_close(int fd)
 {
 
-	descpool_release(&fds, fd);
+	pthread_mutex_lock(&fds_lock);
+	descpool_remove(&fds, fd);
+	pthread_mutex_unlock(&fds_lock);
+	ap_gen_bump(AP_GEN_FD);
 }
 
 int
 ap_fd_random(void)
 {
+	int fd;
 
-	return (descpool_select(&fds));
+	pthread_mutex_lock(&fds_lock);
+	fd = descpool_select(&fds);
+	pthread_mutex_unlock(&fds_lock);
+	if (fd >= 0)
+		ap_gen_draw(AP_GEN_FD);
+	return (fd);
 }
 
 void
 ap_dirfd_add(int fd)
 {
 
+	pthread_mutex_lock(&fds_lock);
 	descpool_add(&dirfds, fd);
+	pthread_mutex_unlock(&fds_lock);
 }
 
 void
 ap_dirfd_close(int fd)
 {
 
-	descpool_release(&dirfds, fd);
+	pthread_mutex_lock(&fds_lock);
+	descpool_remove(&dirfds, fd);
+	pthread_mutex_unlock(&fds_lock);
+	ap_gen_bump(AP_GEN_DIRFD);
 }
 
 int
 ap_dirfd_random(void)
+{
+	int fd;
+
+	pthread_mutex_lock(&fds_lock);
+	fd = descpool_select(&dirfds);
+	pthread_mutex_unlock(&fds_lock);
+	if (fd >= 0)
+		ap_gen_draw(AP_GEN_DIRFD);
+	return (fd);
+}
+
+static void
+res_fd_destroy(int fd)
+{
+
+	(void)close(fd);
+}
+
+static bool
+res_socket_fill(struct respool *rp)
+{
+	static const int domains[] = { AF_UNIX, AF_INET, AF_INET6 };
+	static const int types[] = { SOCK_STREAM, SOCK_DGRAM };
+	static u_int next;
+	int s;
+
+	/* Cycle through the combinations rather than consuming randomness. */
+	s = socket(domains[next % nitems(domains)],
+	    types[(next / nitems(domains)) % nitems(types)], 0);
+	next++;
+	if (s < 0)
+		return (false);
+	if (!respool_put(rp, s))
+		(void)close(s);
+	return (true);
+}
+
+static bool
+res_pipe_fill(struct respool *rp)
+{
+	int fds[2];
+
+	if (pipe(fds) != 0)
+		return (false);
+	for (int i = 0; i < 2; i++)
+		if (!respool_put(rp, fds[i]))
+			(void)close(fds[i]);
+	return (true);
+}
+
+static bool
+res_kqueue_fill(struct respool *rp)
+{
+	int kq;
+
+	kq = kqueue();
+	if (kq < 0)
+		return (false);
+	if (!respool_put(rp, kq))
+		(void)close(kq);
+	return (true);
+}
+
+/*
+ * The body of a pooled child process: wait to be killed, making sure that we
+ * don't outlive the fuzzer.
+ */
+static void
+res_child(void)
+{
+#ifdef PROC_PDEATHSIG_CTL
+	int sig;
+
+	sig = SIGKILL;
+	(void)procctl(P_PID, 0, PROC_PDEATHSIG_CTL, &sig);
+#endif
+	for (;;)
+		(void)pause();
+}
+
+static bool
+res_pid_fill(struct respool *rp)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return (false);
+	if (pid == 0)
+		res_child();
+	if (!respool_put(rp, pid))
+		res_pid_destroy(pid);
+	return (true);
+}
+
+static void
+res_pid_destroy(int pid)
+{
+
+	(void)kill(pid, SIGKILL);
+	(void)waitpid(pid, NULL, 0);
+}
+
+static bool
+res_procdesc_fill(struct respool *rp)
+{
+	pid_t pid;
+	int fd;
+
+	pid = pdfork(&fd, 0);
+	if (pid < 0)
+		return (false);
+	if (pid == 0)
+		res_child();
+	/* Closing the last reference to the descriptor kills the child. */
+	if (!respool_put(rp, fd))
+		(void)close(fd);
+	return (true);
+}
+
+static const char * const ap_res_names[AP_RES_NTYPES] = {
+	[AP_RES_SOCKET] =	"socket",
+	[AP_RES_PIPE] =		"pipe",
+	[AP_RES_KQUEUE] =	"kqueue",
+	[AP_RES_PID] =		"pid",
+	[AP_RES_PROCDESC] =	"procdesc",
+};
+
+const char *
+ap_res_name(enum ap_restype type)
+{
+
+	return (ap_res_names[type]);
+}
+
+/*
+ * Set up this fuzzer's pools of sockets, pipes, kqueues and child processes.
+ * These can't be shared with other fuzzers, so each one creates its own after
+ * forking. The pools are filled by a background thread. If stats isn't NULL,
+ * it holds AP_RES_NTYPES sets of counters for the pools' hits and misses.
+ */
+void
+ap_res_start(struct respool_stats *stats)
+{
+	static bool (* const fill[AP_RES_NTYPES])(struct respool *) = {
+		[AP_RES_SOCKET] =	res_socket_fill,
+		[AP_RES_PIPE] =		res_pipe_fill,
+		[AP_RES_KQUEUE] =	res_kqueue_fill,
+		[AP_RES_PID] =		res_pid_fill,
+		[AP_RES_PROCDESC] =	res_procdesc_fill,
+	};
+	u_int size;
+
+	size = param_number("respool-size");
+	for (int i = 0; i < AP_RES_NTYPES; i++)
+		respool_init(&respools[i], ap_res_names[i], size, fill[i],
+		    i == AP_RES_PID ? res_pid_destroy : res_fd_destroy,
+		    stats != NULL ? &stats[i] : NULL);
+	respool_start();
+}
+
+/* Tear down this fuzzer's resource pools. */
+void
+ap_res_stop(void)
+{
+
+	respool_stop();
+	for (int i = 0; i < AP_RES_NTYPES; i++)
+		respool_fini(&respools[i]);
+}
+
+/*
+ * Pick a resource of the given type, or return -1 if its pool is empty.
+ */
+int
+ap_res_random(enum ap_restype type)
+{
+	int fd;
+
+	fd = respool_select(&respools[type]);
+	if (fd >= 0)
+		ap_gen_draw(type);
+	return (fd);
+}
+
+/*
+ * Forget about a pooled descriptor that has been closed, so that the refill
+ * thread replaces it.
+ */
+void
+ap_res_close(int fd)
+{
+
+	for (int i = 0; i < AP_RES_NTYPES; i++) {
+		if (i != AP_RES_PID && respool_release(&respools[i], fd)) {
+			ap_gen_bump(i);
+			break;
+		}
+	}
+}
+
+/*
+ * Return the set of pools the calling thread has drawn arguments from since
+ * the last call, for passing to ap_generation().
+ */
+uint64_t
+ap_drawn(void)
+{
+	uint64_t pools;
+
+	pools = ap_draws;
+	ap_draws = 0;
+	return (pools);
+}
+
+/*
+ * Return a counter that changes whenever something is removed from one of the
+ * given pools.
+ */
+u_long
+ap_generation(uint64_t pools)
+{
+	u_long gen;
+
+	gen = 0;
+	for (u_int i = 0; pools != 0; i++, pools >>= 1)
+		if ((pools & 1) != 0)
+			gen += atomic_load_explicit(&ap_gens[i],
+			    memory_order_relaxed);
+	return (gen);
+}
+
+static void
+ap_validate_handler(int sig __unused)
 {
 
-	return (descpool_select(&dirfds));
+	rman_validate_request();
 }
 
 /*
- * Initialize the argument pool.
+ * Initialize the argument pool, and report how long each step took.
  */
 void
-ap_init(void)
+ap_init(u_long seed)
 {
+	struct rusage ru;
+	enum hier_fill mode;
+	uint64_t start, tmemblk, thier, tfill;
+	long rss;
+	u_int nthreads;
+	bool cached;
 
-	(void)rman_init(&memblks, getpagesize(), memblk_init);
+	mode = param_choice("hier-fill-mode", hier_fill_modes,
+	    nitems(hier_fill_modes));
+	memblk_policy = param_choice("memblk-init-policy", memblk_policies,
+	    nitems(memblk_policies));
+	memblk_prefault_mode = param_choice("memblk-prefault",
+	    memblk_prefaults, nitems(memblk_prefaults));
+	nthreads = param_number("hier-fill-threads");
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		err(1, "getrusage");
+	rss = ru.ru_maxrss;
+	start = nsecs();
+	memblk_shards_init(max(param_number("threads-per-fuzzer"), 1));
+	memblk_init(memblk_policy, memblk_prefault_mode);
+	if (signal(SIGUSR1, ap_validate_handler) == SIG_ERR)
+		err(1, "signal");
+	tmemblk = nsecs();
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		err(1, "getrusage");
+	rss = ru.ru_maxrss - rss;
+
+	descpool_init(&dirfds);
+	descpool_init(&fds);
+	cached = hier_init(param_string("hier-root"), seed);
+	thier = nsecs();
+	if (!cached) {
+		hier_fill(mode, nthreads);
+		hier_manifest_write();
+	}
+	tfill = nsecs();
+	hier_prune(param_string("hier-root"), param_number("hier-cache-size"));
 
-	(void)rman_init(&dirfds, 1, NULL);
-	(void)rman_init(&fds, 1, NULL);
-	hier_init(param_string("hier-root"), param_number("hier-depth"));
+	printf("%s: argument pools ready in %.3fs: memblks %.3fs (%s, "
+	    "prefault %s, +%ldMB RSS), hierarchy %.3fs (%ju files, %ju dirs, "
+	    "%s), ", getprogname(), (tfill - start) / 1e9,
+	    (tmemblk - start) / 1e9, memblk_policies[memblk_policy],
+	    memblk_prefaults[memblk_prefault_mode], rss / 1024,
+	    (thier - tmemblk) / 1e9, hier_manifest.hm_vals[HM_FILES],
+	    hier_manifest.hm_vals[HM_DIRS], cached ? "cached" : "created");
+	if (cached)
+		printf("contents cached\n");
+	else
+		printf("contents %.3fs (%s, %u threads)\n",
+		    (tfill - thier) / 1e9, hier_fill_modes[mode],
+		    max(min(nthreads, hier_nfiles), 1));
 }
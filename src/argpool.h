@@ -29,12 +29,24 @@
 
 #include <sys/types.h>
 
+struct respool_stats;
+
 struct arg_memblk {
 	void	*addr;
 	size_t	len;
 };
 
-void	ap_init(void);
+/* Types of resources kept in lazily refilled pools. */
+enum ap_restype {
+	AP_RES_SOCKET,
+	AP_RES_PIPE,
+	AP_RES_KQUEUE,
+	AP_RES_PID,
+	AP_RES_PROCDESC,
+	AP_RES_NTYPES,
+};
+
+void	ap_init(u_long);
 
 void	ap_dirfd_add(int);
 void	ap_dirfd_close(int);
@@ -42,8 +54,19 @@ int	ap_dirfd_random(void);
 void	ap_fd_add(int);
 void	ap_fd_close(int);
 int	ap_fd_random(void);
+uint64_t ap_drawn(void);
+u_long	ap_generation(uint64_t);
+void	ap_memblk_inexact(void);
 void	ap_memblk_map(void *, size_t);
 int	ap_memblk_random(struct arg_memblk *);
+int	ap_memblk_random_super(struct arg_memblk *);
+void	ap_memblk_rebuild(void);
 void	ap_memblk_unmap(void *, size_t);
+void	ap_res_close(int);
+const char *ap_res_name(enum ap_restype);
+int	ap_res_random(enum ap_restype);
+void	ap_res_start(struct respool_stats *);
+void	ap_res_stop(void);
+void	ap_thread_init(u_int);
 
 #endif /* _ARGPOOL_H_ */
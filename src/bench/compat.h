@@ -0,0 +1,27 @@
+/*
+ * Definitions needed to build the rman code outside of a FreeBSD tree. This is
+ * force-included by the bench Makefile and is a no-op on FreeBSD.
+ */
+
+#ifndef _BENCH_COMPAT_H_
+#define	_BENCH_COMPAT_H_
+
+#include <sys/param.h>
+
+#ifndef __unused
+#define	__unused	__attribute__((__unused__))
+#endif
+#ifndef __bitcount
+#define	__bitcount(x)	__builtin_popcount(x)
+#endif
+#ifndef rounddown2
+#define	rounddown2(x, y) ((x) & (~((y) - 1)))
+#endif
+#ifndef roundup2
+#define	roundup2(x, y)	(((x) + ((y) - 1)) & (~((y) - 1)))
+#endif
+#ifndef nitems
+#define	nitems(x)	(sizeof((x)) / sizeof((x)[0]))
+#endif
+
+#endif /* _BENCH_COMPAT_H_ */
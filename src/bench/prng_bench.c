@@ -0,0 +1,208 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A microbenchmark comparing sysfuzz's PRNG with the libc random(3) idioms it
+ * replaced: raw draws, bounded draws and filling buffers.
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "prng.h"
+
+/* A bound that is neither small nor a power of two. */
+#define	BOUND		1000003
+
+static volatile uint64_t sink;
+
+static uint64_t
+nsecs(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+bench_random(u_long n)
+{
+	uint64_t acc;
+
+	acc = 0;
+	for (u_long i = 0; i < n; i++)
+		acc += random();
+	sink = acc;
+}
+
+static void
+bench_random_mod(u_long n)
+{
+	uint64_t acc;
+
+	acc = 0;
+	for (u_long i = 0; i < n; i++)
+		acc += random() % BOUND;
+	sink = acc;
+}
+
+/* The two-draw idiom rman used for ranges wider than RAND_MAX. */
+static void
+bench_random_wide(u_long n)
+{
+	uint64_t acc;
+
+	acc = 0;
+	for (u_long i = 0; i < n; i++)
+		acc += (((u_long)random() << 31) | random()) % BOUND;
+	sink = acc;
+}
+
+static void
+bench_random_fill(u_long n)
+{
+	char buf[256];
+
+	for (u_long i = 0; i < n; i += sizeof(buf)) {
+		for (size_t j = 0; j < sizeof(buf); j++)
+			buf[j] = random() & 0xff;
+		sink = buf[i % sizeof(buf)];
+	}
+}
+
+static void
+bench_prng_next(u_long n)
+{
+	uint64_t acc;
+
+	acc = 0;
+	for (u_long i = 0; i < n; i++)
+		acc += rnd();
+	sink = acc;
+}
+
+static void
+bench_prng_range(u_long n)
+{
+	uint64_t acc;
+
+	acc = 0;
+	for (u_long i = 0; i < n; i++)
+		acc += rnd_range(BOUND);
+	sink = acc;
+}
+
+static void
+bench_prng_fill(u_long n)
+{
+	char buf[256];
+
+	for (u_long i = 0; i < n; i += sizeof(buf)) {
+		prng_fill(&prng_thr, buf, sizeof(buf));
+		sink = buf[i % sizeof(buf)];
+	}
+}
+
+static const struct {
+	const char	*name;
+	const char	*unit;
+	void		(*run)(u_long);
+} benches[] = {
+	{ "random()", "draw", bench_random },
+	{ "random() % n", "draw", bench_random_mod },
+	{ "2x random() % n", "draw", bench_random_wide },
+	{ "random() bytes", "byte", bench_random_fill },
+	{ "rnd()", "draw", bench_prng_next },
+	{ "rnd_range(n)", "draw", bench_prng_range },
+	{ "prng_fill()", "byte", bench_prng_fill },
+};
+
+static u_long
+parse_num(const char *str, char opt)
+{
+	char *end;
+	u_long val;
+
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if (str[0] == '\0' || *end != '\0' || errno != 0 || val == 0)
+		errx(1, "invalid parameter '%s' for -%c", str, opt);
+	return (val);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "Usage:\tprng_bench [-n ops] [-s seed]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t start, elapsed;
+	u_long nops, seed;
+	int ch;
+
+	nops = 100000000;
+	seed = 1;
+	while ((ch = getopt(argc, argv, "n:s:")) != -1)
+		switch (ch) {
+		case 'n':
+			nops = parse_num(optarg, 'n');
+			break;
+		case 's':
+			seed = parse_num(optarg, 's');
+			break;
+		default:
+			usage();
+		}
+	if (argc != optind)
+		usage();
+
+	srandom(seed);
+	prng_seed(&prng_thr, seed);
+	printf("%-18s %12s %10s\n", "generator", "Mops/s", "ns/op");
+	for (size_t i = 0; i < nitems(benches); i++) {
+		start = nsecs();
+		benches[i].run(nops);
+		elapsed = nsecs() - start;
+		printf("%-18s %12.1f %10.2f  (per %s)\n", benches[i].name,
+		    nops / (elapsed / 1e3), (double)elapsed / nops,
+		    benches[i].unit);
+	}
+	return (0);
+}
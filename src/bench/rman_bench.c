@@ -0,0 +1,457 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A microbenchmark for the resource manager used by sysfuzz's argument pools.
+ * It drives rman_add(), rman_select() and rman_release() with synthetic
+ * workloads modelled on the way the fuzzer uses them and reports throughput,
+ * per-operation latency percentiles and node usage. The bitmap descriptor
+ * pool is measured alongside for comparison with the rman fd workload.
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "descpool.h"
+#include "prng.h"
+#include "rman.h"
+
+#define	PAGE_SIZE_BENCH	4096ul
+#define	ADDR_BASE	(1ul << 32)
+
+enum benchop {
+	OP_ADD,
+	OP_SELECT,
+	OP_RELEASE,
+	OP_COUNT,
+};
+
+static const char *opnames[OP_COUNT] = {
+	[OP_ADD] =	"add",
+	[OP_SELECT] =	"select",
+	[OP_RELEASE] =	"release",
+};
+
+struct oplat {
+	uint32_t	*lat;	/* per-operation latencies in ns */
+	size_t		cnt;
+	size_t		max;
+};
+
+struct bench {
+	struct rman	rman;
+	struct descpool	dp;
+	struct oplat	ops[OP_COUNT];
+	u_long		poolsz;		/* target pool size in blocks */
+	u_int		maxblks;	/* maximum blocks per add */
+	u_long		span;		/* size of the address space used */
+};
+
+typedef void	(*workload_fn)(struct bench *, u_long);
+
+struct workload {
+	const char	*name;
+	const char	*descr;
+	u_int		blksz;		/* 0 for the bitmap descriptor pool */
+	workload_fn	run;
+};
+
+static void	wl_bitmap(struct bench *, u_long);
+static void	wl_fd(struct bench *, u_long);
+static void	wl_frag(struct bench *, u_long);
+static void	wl_mmap(struct bench *, u_long);
+
+static const struct workload workloads[] = {
+	{
+		.name = "mmap",
+		.descr = "page-granular map/unmap churn, as with the memblk "
+		    "pool",
+		.blksz = PAGE_SIZE_BENCH,
+		.run = wl_mmap,
+	},
+	{
+		.name = "fd",
+		.descr = "single-block descriptor add/close churn",
+		.blksz = 1,
+		.run = wl_fd,
+	},
+	{
+		.name = "bitmap",
+		.descr = "the fd workload run against a bitmap descriptor pool",
+		.blksz = 0,
+		.run = wl_bitmap,
+	},
+	{
+		.name = "frag",
+		.descr = "maximally fragmented pool with single-block churn",
+		.blksz = PAGE_SIZE_BENCH,
+		.run = wl_frag,
+	},
+};
+
+static uint64_t
+nsecs(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+oplat_record(struct bench *b, enum benchop op, uint64_t start)
+{
+	struct oplat *ol;
+	uint64_t delta;
+
+	delta = nsecs() - start;
+	ol = &b->ops[op];
+	if (ol->cnt == ol->max) {
+		ol->max = ol->max == 0 ? 1024 : ol->max * 2;
+		ol->lat = realloc(ol->lat, ol->max * sizeof(*ol->lat));
+		if (ol->lat == NULL)
+			err(1, "realloc");
+	}
+	ol->lat[ol->cnt++] = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+}
+
+static void
+bench_add(struct bench *b, u_long start, u_long len)
+{
+	uint64_t t;
+
+	t = nsecs();
+	rman_add(&b->rman, start, len);
+	oplat_record(b, OP_ADD, t);
+}
+
+static int
+bench_select(struct bench *b, u_long *start, u_long *len, u_int maxblks)
+{
+	uint64_t t;
+	int ret;
+
+	t = nsecs();
+	ret = rman_select(&b->rman, start, len, maxblks);
+	oplat_record(b, OP_SELECT, t);
+	return (ret);
+}
+
+static void
+bench_release(struct bench *b, u_long start, u_long len)
+{
+	uint64_t t;
+
+	t = nsecs();
+	rman_release(&b->rman, start, len);
+	oplat_record(b, OP_RELEASE, t);
+}
+
+static u_long
+pool_length(struct bench *b)
+{
+	struct rman_stats stats;
+
+	rman_stats(&b->rman, &stats);
+	return (stats.rs_length);
+}
+
+/*
+ * Map and unmap randomly sized page ranges at random addresses, keeping the
+ * pool near its target size. Unmapped ranges are chosen with rman_select(),
+ * as munmap_cleanup() does.
+ */
+static void
+wl_mmap(struct bench *b, u_long nops)
+{
+	u_long len, start, target;
+
+	target = b->poolsz * PAGE_SIZE_BENCH;
+	for (u_long i = 0; i < nops; i++) {
+		if (pool_length(b) < target || rnd_range(2) == 0) {
+			len = (rnd_range(b->maxblks) + 1) * PAGE_SIZE_BENCH;
+			start = ADDR_BASE +
+			    rnd_range(b->span / PAGE_SIZE_BENCH) *
+			    PAGE_SIZE_BENCH;
+			bench_add(b, start, len);
+		} else if (bench_select(b, &start, &len, 0) == 0)
+			bench_release(b, start, len);
+	}
+}
+
+/*
+ * Add and close single descriptors, the way the fd and dirfd pools use an rman
+ * with a block size of 1.
+ */
+static void
+wl_fd(struct bench *b, u_long nops)
+{
+	u_long len, start;
+
+	for (u_long i = 0; i < nops; i++) {
+		if (pool_length(b) < b->poolsz || rnd_range(2) == 0)
+			bench_add(b, rnd_range(b->span), 1);
+		else if (bench_select(b, &start, &len, 1) == 0)
+			bench_release(b, start, len);
+	}
+}
+
+static void
+wl_bitmap(struct bench *b, u_long nops)
+{
+	uint64_t t;
+	int fd;
+
+	for (u_long i = 0; i < nops; i++) {
+		if (b->dp.dp_count < b->poolsz || rnd_range(2) == 0) {
+			t = nsecs();
+			descpool_add(&b->dp, rnd_range(b->span));
+			oplat_record(b, OP_ADD, t);
+		} else {
+			t = nsecs();
+			fd = descpool_select(&b->dp);
+			oplat_record(b, OP_SELECT, t);
+			if (fd < 0)
+				continue;
+			t = nsecs();
+			descpool_remove(&b->dp, fd);
+			oplat_record(b, OP_RELEASE, t);
+		}
+	}
+}
+
+/*
+ * Keep the pool at its target size using only even-numbered pages, which gives
+ * the largest possible number of ranges for the pool size since ranges can
+ * never coalesce. Each round removes a random page and then adds random even
+ * pages from an area twice the size of the pool until one of them is new.
+ */
+static void
+wl_frag(struct bench *b, u_long nops)
+{
+	u_long len, start;
+
+	for (u_long i = 0; i < b->poolsz; i++)
+		rman_add(&b->rman, ADDR_BASE + 2 * i * PAGE_SIZE_BENCH,
+		    PAGE_SIZE_BENCH);
+	for (u_long i = 0; i < nops; i++) {
+		if (bench_select(b, &start, &len, 1) == 0)
+			bench_release(b, start, len);
+		while ((u_long)b->rman.rm_entries < b->poolsz)
+			bench_add(b, ADDR_BASE + 2 * rnd_range(2 * b->poolsz) *
+			    PAGE_SIZE_BENCH, PAGE_SIZE_BENCH);
+	}
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static uint32_t
+percentile(const struct oplat *ol, double pct)
+{
+	size_t idx;
+
+	idx = (size_t)(pct / 100.0 * (double)(ol->cnt - 1) + 0.5);
+	return (ol->lat[idx]);
+}
+
+static void
+report(struct bench *b, const struct workload *wl, uint64_t elapsed)
+{
+	struct rman_stats stats;
+	struct oplat *ol;
+	size_t total;
+
+	total = 0;
+	for (int i = 0; i < OP_COUNT; i++)
+		total += b->ops[i].cnt;
+
+	printf("%s: pool %lu blocks, %zu ops in %.3fs, %.0f ops/s\n",
+	    wl->name, b->poolsz, total, (double)elapsed / 1e9,
+	    (double)total / ((double)elapsed / 1e9));
+	if (wl->blksz != 0) {
+		rman_stats(&b->rman, &stats);
+		printf("  ranges %d, nodes %u (max %u), slabs %u (%zu KB)\n",
+		    stats.rs_entries, stats.rs_nodes, stats.rs_nodes_hwm,
+		    stats.rs_slabs, stats.rs_slabmem / 1024);
+	} else
+		printf("  descriptors %u, map %zu KB\n", b->dp.dp_count,
+		    b->dp.dp_nwords * sizeof(uint64_t) / 1024);
+	printf("  %-8s %10s %8s %8s %8s %8s %8s   (ns)\n", "op", "count",
+	    "p50", "p90", "p99", "p99.9", "max");
+	for (int i = 0; i < OP_COUNT; i++) {
+		ol = &b->ops[i];
+		if (ol->cnt == 0)
+			continue;
+		qsort(ol->lat, ol->cnt, sizeof(*ol->lat), cmp_u32);
+		printf("  %-8s %10zu %8u %8u %8u %8u %8u\n", opnames[i],
+		    ol->cnt, percentile(ol, 50), percentile(ol, 90),
+		    percentile(ol, 99), percentile(ol, 99.9),
+		    ol->lat[ol->cnt - 1]);
+	}
+}
+
+static u_int vinterval;
+
+static void
+run(const struct workload *wl, u_long poolsz, u_long nops, u_int maxblks)
+{
+	struct bench b;
+	uint64_t start;
+
+	memset(&b, 0, sizeof(b));
+	if (wl->blksz != 0 && rman_init(&b.rman, wl->blksz, NULL) != 0)
+		errx(1, "rman_init failed");
+	rman_set_validate(&b.rman, vinterval);
+	descpool_init(&b.dp);
+	b.poolsz = poolsz;
+	b.maxblks = maxblks;
+	/* Leave room for as many holes as there are allocated blocks. */
+	b.span = 2 * poolsz * (wl->blksz <= 1 ? 1 : PAGE_SIZE_BENCH);
+
+	start = nsecs();
+	wl->run(&b, nops);
+	report(&b, wl, nsecs() - start);
+
+	if (wl->blksz != 0)
+		rman_fini(&b.rman);
+	descpool_fini(&b.dp);
+	for (int i = 0; i < OP_COUNT; i++)
+		free(b.ops[i].lat);
+}
+
+static u_long
+parse_num(const char *str, char opt)
+{
+	char *end;
+	u_long val;
+
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if (str[0] == '\0' || *end != '\0' || errno != 0 || val == 0)
+		errx(1, "invalid parameter '%s' for -%c", str, opt);
+	return (val);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr,
+	    "Usage:\trman_bench [-m maxblks] [-n ops] [-p size[,size[,...]]]\n"
+	    "\t    [-s seed] [-v interval] [-w workload[,workload[,...]]]\n");
+	fprintf(stderr, "Workloads:\n");
+	for (size_t i = 0; i < nitems(workloads); i++)
+		fprintf(stderr, "\t%-8s%s\n", workloads[i].name,
+		    workloads[i].descr);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct workload *wl;
+	char *end, *list, *pools, *sizes, *wls, *name;
+	u_long nops, seed;
+	u_int maxblks;
+	int ch;
+
+	maxblks = 16;
+	nops = 1000000;
+	pools = strdup("1000,10000,100000");
+	wls = NULL;
+	seed = 1;
+	vinterval = 1;
+	while ((ch = getopt(argc, argv, "m:n:p:s:v:w:")) != -1)
+		switch (ch) {
+		case 'm':
+			maxblks = parse_num(optarg, 'm');
+			break;
+		case 'n':
+			nops = parse_num(optarg, 'n');
+			break;
+		case 'p':
+			free(pools);
+			pools = strdup(optarg);
+			break;
+		case 's':
+			seed = parse_num(optarg, 's');
+			break;
+		case 'v':
+			errno = 0;
+			vinterval = strtoul(optarg, &end, 10);
+			if (optarg[0] == '\0' || *end != '\0' || errno != 0)
+				errx(1, "invalid parameter '%s' for -v",
+				    optarg);
+			break;
+		case 'w':
+			wls = strdup(optarg);
+			break;
+		default:
+			usage();
+		}
+	if (argc != optind || pools == NULL)
+		usage();
+
+	for (size_t i = 0; i < nitems(workloads); i++) {
+		wl = &workloads[i];
+		if (wls != NULL) {
+			list = strdup(wls);
+			sizes = list;
+			while ((name = strsep(&sizes, ",")) != NULL)
+				if (strcmp(name, wl->name) == 0)
+					break;
+			free(list);
+			if (name == NULL)
+				continue;
+		}
+
+		list = strdup(pools);
+		sizes = list;
+		while ((name = strsep(&sizes, ",")) != NULL) {
+			prng_seed(&prng_thr, seed);
+			run(wl, parse_num(name, 'p'), nops, maxblks);
+		}
+		free(list);
+	}
+	free(pools);
+	free(wls);
+
+	return (0);
+}
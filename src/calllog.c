@@ -0,0 +1,390 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A compact binary log of the system calls issued by a fuzzer thread, for
+ * replaying them later. Records are appended through a window of the file
+ * mapped into the fuzzer, so logging a call costs a few stores; the kernel
+ * writes the pages back on its own, and they survive the fuzzer being killed.
+ *
+ * The log starts with a header and the packed run-time parameters of the run.
+ * Each record that follows consists of unsigned LEB128 varints:
+ *
+ *	<syscall number + 1> <arg>... <return value> [<errno>]
+ *
+ * Each argument and the return value are encoded as the zigzag-encoded
+ * difference from the same value in the previous call of that system call, so
+ * that addresses and descriptors from the pools usually take a byte or two.
+ * The errno is only present if the call returned -1. A record is written before
+ * the call is issued and completed afterwards, so the call a fuzzer died in is
+ * logged, perhaps without its return value. Unused space past the last record
+ * is zero-filled, and a zero byte where a record should start ends the log.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "calllog.h"
+#include "params.h"
+#include "syscall.h"
+#include "util.h"
+
+#define	CALLLOG_MAGIC	"SFZCLOG"
+#define	CALLLOG_VERSION	1
+
+/* The size of the window of the file mapped while writing. */
+#define	CALLLOG_WINDOW	(1024 * 1024)
+
+/* The longest possible record: a varint is at most 10 bytes long. */
+#define	CALLLOG_MAXREC	((SYSCALL_MAXARGS + 3) * 10)
+
+struct calllog_hdr {
+	char		ch_magic[8];
+	uint32_t	ch_version;
+	uint32_t	ch_paramlen;	/* length of the packed parameters */
+	uint64_t	ch_seed;	/* seed of the argument pools */
+	uint32_t	ch_fuzzer;
+	uint32_t	ch_thread;
+};
+
+struct calllog {
+	int		cl_fd;
+	bool		cl_writing;
+	char		*cl_win;	/* mapped window of the file */
+	size_t		cl_len;		/* length of the window */
+	off_t		cl_winoff;	/* file offset of the window */
+	size_t		cl_pos;		/* offset of the next record */
+	size_t		cl_start;	/* offset of the first record */
+	u_long		cl_calls;
+	u_long		cl_sync;	/* calls between synchronous flushes */
+	void		*cl_params;	/* packed parameters, when replaying */
+	/* Previous arguments and return value of each system call. */
+	u_long		(*cl_prev)[SYSCALL_MAXARGS + 1];
+};
+
+static struct calllog *calllog_alloc(int, bool);
+static void	calllog_map(struct calllog *);
+static void	calllog_remap(struct calllog *);
+
+static inline uint64_t
+zigzag(u_long val, u_long prev)
+{
+	int64_t d;
+
+	d = (int64_t)(val - prev);
+	return (((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+}
+
+static inline u_long
+unzigzag(uint64_t z, u_long prev)
+{
+
+	return (prev + (u_long)((z >> 1) ^ -(z & 1)));
+}
+
+static inline void
+calllog_put(struct calllog *log, uint64_t val)
+{
+	uint8_t *p;
+
+	p = (uint8_t *)log->cl_win + log->cl_pos;
+	while (val >= 0x80) {
+		*p++ = (uint8_t)val | 0x80;
+		val >>= 7;
+	}
+	*p++ = (uint8_t)val;
+	log->cl_pos = p - (uint8_t *)log->cl_win;
+}
+
+/* Read a varint, treating anything past the end of the log as zeroes. */
+static inline uint64_t
+calllog_get(struct calllog *log)
+{
+	const uint8_t *end, *p;
+	uint64_t val;
+
+	p = (const uint8_t *)log->cl_win + log->cl_pos;
+	end = (const uint8_t *)log->cl_win + log->cl_len;
+	val = 0;
+	for (u_int shift = 0; p < end && shift < 64; shift += 7) {
+		val |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0)
+			break;
+	}
+	log->cl_pos = p - (const uint8_t *)log->cl_win;
+	return (val);
+}
+
+static struct calllog *
+calllog_alloc(int fd, bool writing)
+{
+	struct calllog *log;
+	size_t sz;
+
+	log = xmalloc(sizeof(*log));
+	memset(log, 0, sizeof(*log));
+	log->cl_fd = fd;
+	log->cl_writing = writing;
+	sz = SYS_MAXSYSCALL * sizeof(*log->cl_prev);
+	log->cl_prev = xmalloc(sz);
+	memset(log->cl_prev, 0, sz);
+	return (log);
+}
+
+/*
+ * Move the window so that it starts at the page holding the next record,
+ * extending the file to cover it.
+ */
+static void
+calllog_remap(struct calllog *log)
+{
+	off_t off;
+
+	off = log->cl_winoff + log->cl_pos;
+	if (log->cl_win != NULL) {
+		(void)msync(log->cl_win, log->cl_pos, MS_ASYNC);
+		if (munmap(log->cl_win, log->cl_len) != 0)
+			err(1, "munmap");
+	}
+	log->cl_winoff = rounddown2(off, getpagesize());
+	log->cl_pos = off - log->cl_winoff;
+	log->cl_len = CALLLOG_WINDOW;
+	if (ftruncate(log->cl_fd, log->cl_winoff + log->cl_len) != 0)
+		err(1, "ftruncate");
+	log->cl_win = mmap(NULL, log->cl_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_NOCORE, log->cl_fd, log->cl_winoff);
+	if (log->cl_win == MAP_FAILED)
+		err(1, "mmap");
+}
+
+/*
+ * Create a call log for thread thread of fuzzer fuzzer, whose argument pools
+ * were set up with the given seed.
+ */
+struct calllog *
+calllog_create(const char *path, u_long seed, u_int fuzzer, u_int thread)
+{
+	struct calllog_hdr hdr;
+	struct calllog *log;
+	void *params;
+	size_t len;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		err(1, "opening %s", path);
+
+	params = params_pack(&len);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.ch_magic, CALLLOG_MAGIC, sizeof(hdr.ch_magic));
+	hdr.ch_version = CALLLOG_VERSION;
+	hdr.ch_paramlen = len;
+	hdr.ch_seed = seed;
+	hdr.ch_fuzzer = fuzzer;
+	hdr.ch_thread = thread;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, params, len) != (ssize_t)len)
+		err(1, "writing %s", path);
+	free(params);
+
+	log = calllog_alloc(fd, true);
+	log->cl_sync = param_number("call-log-sync");
+	log->cl_pos = sizeof(hdr) + len;
+	calllog_remap(log);
+	return (log);
+}
+
+/* Log a call about to be issued. */
+void
+calllog_call(struct calllog *log, const struct scdesc *sd, const u_long *args)
+{
+	u_long *prev;
+
+	if (log->cl_pos + CALLLOG_MAXREC > log->cl_len)
+		calllog_remap(log);
+	prev = log->cl_prev[sd->sd_num];
+	calllog_put(log, sd->sd_num + 1);
+	for (int i = 0; i < sd->sd_nargs; i++) {
+		calllog_put(log, zigzag(args[i], prev[i]));
+		prev[i] = args[i];
+	}
+}
+
+/* Complete the record of the call last passed to calllog_call(). */
+void
+calllog_ret(struct calllog *log, const struct scdesc *sd, u_long ret,
+    int error)
+{
+	u_long *prev;
+
+	prev = &log->cl_prev[sd->sd_num][SYSCALL_MAXARGS];
+	calllog_put(log, zigzag(ret, *prev));
+	*prev = ret;
+	if (ret == (u_long)-1)
+		calllog_put(log, error);
+	if (log->cl_sync != 0 && ++log->cl_calls % log->cl_sync == 0)
+		(void)msync(log->cl_win, log->cl_pos, MS_SYNC);
+}
+
+/*
+ * Open a call log for replay. The seed of the logged run's argument pools and
+ * its packed parameters are returned; the latter remain valid until the log is
+ * closed. The log is only read into memory by the first calllog_next(), so that
+ * the argument pools can be set up first, with the address space laid out as it
+ * was in the logged run.
+ */
+struct calllog *
+calllog_open(const char *path, u_long *seedp, const void **paramsp,
+    size_t *lenp)
+{
+	struct calllog_hdr hdr;
+	struct calllog *log;
+	struct stat sb;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		err(1, "opening %s", path);
+	if (fstat(fd, &sb) != 0)
+		err(1, "stat %s", path);
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.ch_magic, CALLLOG_MAGIC, sizeof(hdr.ch_magic)) != 0)
+		errx(1, "%s is not a call log", path);
+	if (hdr.ch_version != CALLLOG_VERSION)
+		errx(1, "%s: unsupported call log version %u", path,
+		    hdr.ch_version);
+	if (hdr.ch_paramlen > sb.st_size - sizeof(hdr))
+		errx(1, "%s: truncated call log", path);
+
+	log = calllog_alloc(fd, false);
+	log->cl_len = sb.st_size;
+	log->cl_params = xmalloc(max(hdr.ch_paramlen, 1));
+	if (pread(fd, log->cl_params, hdr.ch_paramlen, sizeof(hdr)) !=
+	    (ssize_t)hdr.ch_paramlen)
+		err(1, "reading %s", path);
+
+	log->cl_start = log->cl_pos = sizeof(hdr) + hdr.ch_paramlen;
+	*seedp = hdr.ch_seed;
+	*paramsp = log->cl_params;
+	*lenp = hdr.ch_paramlen;
+	return (log);
+}
+
+/* Map a log opened with calllog_open(). */
+static void
+calllog_map(struct calllog *log)
+{
+
+	log->cl_win = mmap(NULL, log->cl_len, PROT_READ, MAP_SHARED,
+	    log->cl_fd, 0);
+	if (log->cl_win == MAP_FAILED)
+		err(1, "mmap");
+}
+
+/*
+ * Read the next call from a log opened with calllog_open(), returning its
+ * descriptor, or NULL at the end of the log. The arguments are stored in args,
+ * which must have room for SYSCALL_MAXARGS values.
+ */
+struct scdesc *
+calllog_next(struct calllog *log, u_long *args, u_long *retp, int *errorp)
+{
+	struct scdesc *sd;
+	uint64_t num;
+	u_long *prev;
+
+	if (log->cl_win == NULL)
+		calllog_map(log);
+	num = calllog_get(log);
+	if (num == 0)
+		return (NULL);
+	sd = num <= SYS_MAXSYSCALL ? sc_desc(num - 1) : NULL;
+	if (sd == NULL)
+		errx(1, "unknown system call %ju in call log",
+		    (uintmax_t)num - 1);
+
+	prev = log->cl_prev[sd->sd_num];
+	memset(args, 0, SYSCALL_MAXARGS * sizeof(*args));
+	for (int i = 0; i < sd->sd_nargs; i++)
+		args[i] = prev[i] = unzigzag(calllog_get(log), prev[i]);
+	*retp = prev[SYSCALL_MAXARGS] =
+	    unzigzag(calllog_get(log), prev[SYSCALL_MAXARGS]);
+	*errorp = *retp == (u_long)-1 ? (int)calllog_get(log) : 0;
+	return (sd);
+}
+
+/* Go back to the first call of a log opened with calllog_open(). */
+void
+calllog_rewind(struct calllog *log)
+{
+
+	log->cl_pos = log->cl_start;
+	memset(log->cl_prev, 0, SYS_MAXSYSCALL * sizeof(*log->cl_prev));
+}
+
+/*
+ * Issue a call read from a log. Fixups are not rerun, since the arguments they
+ * produced were logged, except for calls flagged SD_REPLAY_FIXUP. The cleanup
+ * hook runs as usual, so that the argument pools keep track of what the call
+ * created or destroyed.
+ */
+u_long
+calllog_replay(const struct scdesc *sd, u_long *args, int *errorp)
+{
+	u_long ret;
+
+	if ((sd->sd_flags & SD_REPLAY_FIXUP) != 0)
+		(sd->sd_fixup)(args);
+	ret = __syscall(sd->sd_num, args[0], args[1], args[2], args[3],
+	    args[4], args[5], args[6], args[7]);
+	*errorp = errno;
+	if (sd->sd_cleanup != NULL)
+		(sd->sd_cleanup)(args, ret);
+	return (ret);
+}
+
+void
+calllog_close(struct calllog *log)
+{
+
+	if (log->cl_win != NULL && munmap(log->cl_win, log->cl_len) != 0)
+		err(1, "munmap");
+	if (log->cl_writing &&
+	    ftruncate(log->cl_fd, log->cl_winoff + log->cl_pos) != 0)
+		err(1, "ftruncate");
+	(void)close(log->cl_fd);
+	free(log->cl_params);
+	free(log->cl_prev);
+	free(log);
+}
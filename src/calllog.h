@@ -0,0 +1,49 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _CALLLOG_H_
+#define	_CALLLOG_H_
+
+#include <sys/types.h>
+
+struct calllog;
+struct scdesc;
+
+struct calllog	*calllog_create(const char *, u_long, u_int, u_int);
+void		calllog_call(struct calllog *, const struct scdesc *,
+		    const u_long *);
+void		calllog_ret(struct calllog *, const struct scdesc *, u_long,
+		    int);
+
+struct calllog	*calllog_open(const char *, u_long *, const void **,
+		    size_t *);
+struct scdesc	*calllog_next(struct calllog *, u_long *, u_long *, int *);
+void		calllog_rewind(struct calllog *);
+u_long		calllog_replay(const struct scdesc *, u_long *, int *);
+
+void		calllog_close(struct calllog *);
+
+#endif /* _CALLLOG_H_ */
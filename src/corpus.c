@@ -0,0 +1,621 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A persistent corpus of short call sequences that did something new: reached
+ * new coverage, failed with an error not seen before, or took longer than any
+ * earlier call of the same system call. A run started with the same corpus
+ * directory replays the entries before fuzzing, so that it starts from what
+ * earlier runs found rather than from nothing.
+ *
+ * Entries are appended to <corpus>/entries. It starts with a header, and each
+ * entry consists of unsigned LEB128 varints:
+ *
+ *	<length> (<syscall number> <nargs> <arg>...)...
+ *
+ * where the length counts the bytes that follow it. Only arguments that mean
+ * the same thing in any fuzzer are kept, such as commands and flags; the others
+ * are zeroed and regenerated from the argument pools when the entry is
+ * replayed. Entries are never rewritten, so a run can map the file and find
+ * each entry with a single pass over the lengths.
+ *
+ * <corpus>/index is an open-addressing hash table of the entries' hashes,
+ * mapped by every fuzzer, so that a sequence already in the corpus is rejected
+ * without taking a lock. Writers hold an flock(2) on the entries file while
+ * adding to both files. The index records the length of the entries file it
+ * covers, and is rebuilt from the entries if the two disagree, for instance
+ * after a fuzzer was killed in the middle of adding an entry.
+ *
+ * <corpus>/outcomes records, for each system call, which outcomes (success, or
+ * failure with each errno) and what longest latency any run using the corpus
+ * has seen. Whether a call did something new is judged against it, rather than
+ * against what one thread has seen in one run, so that the corpus stops
+ * growing once runs stop finding new behaviour. It is updated without a lock,
+ * since losing an update only costs an extra entry.
+ */
+
+#include <sys/param.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "corpus.h"
+#include "params.h"
+#include "syscall.h"
+#include "util.h"
+
+#define	CORPUS_MAGIC	"SFZCORP"
+#define	CORPUS_VERSION	1
+
+/* The index has 2^CORPUS_IDXBITS slots, and is kept at most 3/4 full. */
+#define	CORPUS_IDXBITS	21
+#define	CORPUS_IDXSLOTS	(1ul << CORPUS_IDXBITS)
+#define	CORPUS_MAXCOUNT	(CORPUS_IDXSLOTS / 4 * 3)
+
+/*
+ * Outcomes are kept for system call numbers below CORPUS_MAXSC. Bit 0 of an
+ * outcome set stands for success and bit e for errno e, with errnos past the
+ * end sharing the last bit.
+ */
+#define	CORPUS_MAXSC	1024
+#define	CORPUS_NOUTCOMES 128
+
+/* The longest possible entry, length included. */
+#define	CORPUS_MAXREC	((CORPUS_SEQLEN * (SYSCALL_MAXARGS + 2) + 1) * 10)
+
+struct corpus_hdr {
+	char		ch_magic[8];
+	uint32_t	ch_version;
+	uint32_t	ch_pad;
+};
+
+struct corpus_idx {
+	char		ci_magic[8];
+	uint32_t	ci_version;
+	uint32_t	ci_bits;
+	uint64_t	ci_datalen;	/* length of the entries file covered */
+	uint64_t	ci_count;	/* entries in the index */
+	_Atomic uint64_t ci_slots[];	/* entry hashes; 0 if free */
+};
+
+struct corpus_outcomes {
+	char		co_magic[8];
+	uint32_t	co_version;
+	uint32_t	co_maxsc;
+	struct {
+		_Atomic uint64_t cs_seen[CORPUS_NOUTCOMES / 64];
+		_Atomic uint64_t cs_latmax;	/* nanoseconds */
+	} co_sc[CORPUS_MAXSC];
+};
+
+/* A fuzzer thread's recent calls, and its own descriptor for locking. */
+struct corpusthread {
+	int		ct_fd;
+	u_int		ct_next;	/* slot for the next call */
+	u_int		ct_len;		/* calls in the history */
+	bool		ct_warned;	/* reported a full corpus */
+	struct corpuscall ct_hist[CORPUS_SEQLEN];
+};
+
+static bool	corpus_getv(const uint8_t **, const uint8_t *, uint64_t *);
+static uint64_t	corpus_hash(const uint8_t *, size_t);
+static bool	corpus_insert(struct corpus_idx *, uint64_t);
+static bool	corpus_lookup(const struct corpus_idx *, uint64_t);
+static struct corpus_outcomes *corpus_outcomes_init(const char *);
+static uint8_t	*corpus_putv(uint8_t *, uint64_t);
+static struct corpus_idx *corpus_rebuild(const char *, size_t);
+static size_t	corpus_scan(size_t, struct corpus_idx *);
+
+static char *corpus_path;		/* the entries file */
+static struct corpus_idx *corpus_idx;
+static struct corpus_outcomes *corpus_out;
+static const uint8_t *corpus_data;	/* the entries, as of corpus_init() */
+static uint64_t *corpus_offs;		/* offset of each entry */
+static u_int corpus_n, corpus_loaded;
+
+static uint8_t *
+corpus_putv(uint8_t *p, uint64_t val)
+{
+
+	while (val >= 0x80) {
+		*p++ = (uint8_t)val | 0x80;
+		val >>= 7;
+	}
+	*p++ = (uint8_t)val;
+	return (p);
+}
+
+/* Read a varint, failing if it runs past end. */
+static bool
+corpus_getv(const uint8_t **pp, const uint8_t *end, uint64_t *val)
+{
+	const uint8_t *p;
+
+	*val = 0;
+	for (p = *pp; p < end && p - *pp < 10; p++) {
+		*val |= (uint64_t)(*p & 0x7f) << (7 * (p - *pp));
+		if ((*p & 0x80) == 0) {
+			*pp = p + 1;
+			return (true);
+		}
+	}
+	return (false);
+}
+
+/* FNV-1a, never returning 0, which marks a free index slot. */
+static uint64_t
+corpus_hash(const uint8_t *p, size_t len)
+{
+	uint64_t h;
+
+	h = 0xcbf29ce484222325ul;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ul;
+	return (h != 0 ? h : 1);
+}
+
+static bool
+corpus_lookup(const struct corpus_idx *idx, uint64_t h)
+{
+	uint64_t slot, v;
+
+	for (slot = h;; slot++) {
+		v = atomic_load_explicit(&idx->ci_slots[slot &
+		    (CORPUS_IDXSLOTS - 1)], memory_order_relaxed);
+		if (v == h)
+			return (true);
+		if (v == 0)
+			return (false);
+	}
+}
+
+/*
+ * Add a hash to the index, returning false if it is already there. The caller
+ * holds the lock, so only lock-free readers race with the store.
+ */
+static bool
+corpus_insert(struct corpus_idx *idx, uint64_t h)
+{
+	uint64_t slot, v;
+
+	for (slot = h;; slot++) {
+		v = atomic_load_explicit(&idx->ci_slots[slot &
+		    (CORPUS_IDXSLOTS - 1)], memory_order_relaxed);
+		if (v == h)
+			return (false);
+		if (v == 0)
+			break;
+	}
+	atomic_store_explicit(&idx->ci_slots[slot & (CORPUS_IDXSLOTS - 1)], h,
+	    memory_order_relaxed);
+	idx->ci_count++;
+	return (true);
+}
+
+/*
+ * Find the entries in the first len bytes of the entries file, adding them to
+ * idx if it isn't NULL. Returns the length of the complete entries.
+ */
+static size_t
+corpus_scan(size_t len, struct corpus_idx *idx)
+{
+	const uint8_t *end, *p, *rec;
+	uint64_t reclen;
+	u_int cap;
+
+	cap = 1024;
+	corpus_offs = xmalloc(cap * sizeof(*corpus_offs));
+	end = corpus_data + len;
+	p = corpus_data + sizeof(struct corpus_hdr);
+	for (;;) {
+		rec = p;
+		if (!corpus_getv(&p, end, &reclen) || reclen == 0 ||
+		    reclen > (uint64_t)(end - p))
+			break;
+		if (corpus_n == cap) {
+			cap *= 2;
+			corpus_offs = realloc(corpus_offs,
+			    cap * sizeof(*corpus_offs));
+			if (corpus_offs == NULL)
+				err(1, "realloc");
+		}
+		corpus_offs[corpus_n++] = rec - corpus_data;
+		if (idx != NULL && idx->ci_count < CORPUS_MAXCOUNT)
+			(void)corpus_insert(idx, corpus_hash(p, reclen));
+		p += reclen;
+	}
+	return (rec - corpus_data);
+}
+
+/*
+ * Create an empty index next to the current one, to be filled and then renamed
+ * over it. A run still using the old index keeps it.
+ */
+static struct corpus_idx *
+corpus_rebuild(const char *path, size_t len)
+{
+	struct corpus_idx *idx;
+	char *tmp;
+	int fd;
+
+	if (asprintf(&tmp, "%s.%d", path, getpid()) < 0)
+		err(1, "asprintf");
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		err(1, "open(%s)", tmp);
+	if (ftruncate(fd, len) != 0)
+		err(1, "ftruncate");
+	idx = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NOCORE,
+	    fd, 0);
+	if (idx == MAP_FAILED)
+		err(1, "mmap");
+	memcpy(idx->ci_magic, CORPUS_MAGIC, sizeof(idx->ci_magic));
+	idx->ci_version = CORPUS_VERSION;
+	idx->ci_bits = CORPUS_IDXBITS;
+	if (rename(tmp, path) != 0)
+		err(1, "rename(%s)", tmp);
+	(void)close(fd);
+	free(tmp);
+	return (idx);
+}
+
+/*
+ * Map the outcomes file, starting afresh if it is missing or doesn't match this
+ * version. The caller holds the lock.
+ */
+static struct corpus_outcomes *
+corpus_outcomes_init(const char *path)
+{
+	struct corpus_outcomes *co;
+	struct stat sb;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		err(1, "open(%s)", path);
+	if (fstat(fd, &sb) != 0)
+		err(1, "fstat(%s)", path);
+	if ((size_t)sb.st_size != sizeof(*co) && (ftruncate(fd, 0) != 0 ||
+	    ftruncate(fd, sizeof(*co)) != 0))
+		err(1, "ftruncate(%s)", path);
+	co = mmap(NULL, sizeof(*co), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_NOCORE, fd, 0);
+	if (co == MAP_FAILED)
+		err(1, "mmap(%s)", path);
+	if (memcmp(co->co_magic, CORPUS_MAGIC, sizeof(co->co_magic)) != 0 ||
+	    co->co_version != CORPUS_VERSION ||
+	    co->co_maxsc != CORPUS_MAXSC) {
+		memset(co, 0, sizeof(*co));
+		memcpy(co->co_magic, CORPUS_MAGIC, sizeof(co->co_magic));
+		co->co_version = CORPUS_VERSION;
+		co->co_maxsc = CORPUS_MAXSC;
+	}
+	(void)close(fd);
+	return (co);
+}
+
+/*
+ * Open the corpus directory named by the corpus parameter, creating it if
+ * needed, and load its entries. This must happen before the fuzzers are forked.
+ * Returns false if there is no corpus.
+ */
+bool
+corpus_init(void)
+{
+	struct corpus_hdr hdr;
+	struct corpus_idx ihdr;
+	struct stat sb;
+	const char *dir;
+	char *ipath, *opath;
+	size_t datalen, end, idxlen;
+	ssize_t n;
+	int fd, ifd;
+
+	dir = param_string("corpus");
+	if (*dir == '\0')
+		return (false);
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		err(1, "mkdir(%s)", dir);
+	if (asprintf(&corpus_path, "%s/entries", dir) < 0 ||
+	    asprintf(&ipath, "%s/index", dir) < 0 ||
+	    asprintf(&opath, "%s/outcomes", dir) < 0)
+		err(1, "asprintf");
+
+	fd = open(corpus_path, O_RDWR | O_APPEND | O_CREAT, 0644);
+	if (fd < 0)
+		err(1, "open(%s)", corpus_path);
+	if (flock(fd, LOCK_EX) != 0)
+		err(1, "flock(%s)", corpus_path);
+	if (fstat(fd, &sb) != 0)
+		err(1, "fstat(%s)", corpus_path);
+	if (sb.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.ch_magic, CORPUS_MAGIC, sizeof(hdr.ch_magic));
+		hdr.ch_version = CORPUS_VERSION;
+		if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+			err(1, "write(%s)", corpus_path);
+		datalen = sizeof(hdr);
+	} else if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.ch_magic, CORPUS_MAGIC, sizeof(hdr.ch_magic)) != 0)
+		errx(1, "%s is not a corpus", corpus_path);
+	else if (hdr.ch_version != CORPUS_VERSION)
+		errx(1, "%s has unsupported version %u", corpus_path,
+		    hdr.ch_version);
+	else
+		datalen = sb.st_size;
+	corpus_data = mmap(NULL, datalen, PROT_READ, MAP_SHARED | MAP_NOCORE,
+	    fd, 0);
+	if (corpus_data == MAP_FAILED)
+		err(1, "mmap(%s)", corpus_path);
+
+	/* Use the index if it covers exactly the entries we have. */
+	idxlen = sizeof(*corpus_idx) + CORPUS_IDXSLOTS * sizeof(uint64_t);
+	ifd = open(ipath, O_RDWR);
+	n = ifd >= 0 ? pread(ifd, &ihdr, sizeof(ihdr), 0) : -1;
+	if (n == sizeof(ihdr) && fstat(ifd, &sb) == 0 &&
+	    (size_t)sb.st_size == idxlen &&
+	    memcmp(ihdr.ci_magic, CORPUS_MAGIC, sizeof(ihdr.ci_magic)) == 0 &&
+	    ihdr.ci_version == CORPUS_VERSION &&
+	    ihdr.ci_bits == CORPUS_IDXBITS &&
+	    ihdr.ci_datalen == datalen) {
+		corpus_idx = mmap(NULL, idxlen, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_NOCORE, ifd, 0);
+		if (corpus_idx == MAP_FAILED)
+			err(1, "mmap(%s)", ipath);
+		end = corpus_scan(datalen, NULL);
+	} else {
+		corpus_idx = corpus_rebuild(ipath, idxlen);
+		end = corpus_scan(datalen, corpus_idx);
+		if (end != datalen) {
+			warnx("%s: discarding %zu bytes of a partial entry",
+			    corpus_path, datalen - end);
+			if (ftruncate(fd, end) != 0)
+				err(1, "ftruncate(%s)", corpus_path);
+		}
+	}
+	corpus_idx->ci_datalen = end;
+	corpus_loaded = corpus_n;
+	corpus_out = corpus_outcomes_init(opath);
+	if (ifd >= 0)
+		(void)close(ifd);
+	/* The mapping of the entries keeps the file, and its lock, open. */
+	if (flock(fd, LOCK_UN) != 0)
+		err(1, "flock(%s)", corpus_path);
+	(void)close(fd);
+	free(ipath);
+	free(opath);
+	return (true);
+}
+
+bool
+corpus_enabled(void)
+{
+
+	return (corpus_idx != NULL);
+}
+
+/* The number of entries loaded by corpus_init(). */
+u_int
+corpus_count(void)
+{
+
+	return (corpus_n);
+}
+
+/*
+ * Decode entry i into calls, which must have room for CORPUS_SEQLEN calls.
+ * Returns the number of calls.
+ */
+u_int
+corpus_get(u_int i, struct corpuscall *calls)
+{
+	const uint8_t *end, *p;
+	uint64_t len, nargs, num;
+	u_int ncalls;
+
+	p = corpus_data + corpus_offs[i];
+	(void)corpus_getv(&p, p + 10, &len);
+	end = p + len;
+	for (ncalls = 0; ncalls < CORPUS_SEQLEN; ncalls++) {
+		if (!corpus_getv(&p, end, &num) ||
+		    !corpus_getv(&p, end, &nargs) || nargs > SYSCALL_MAXARGS)
+			break;
+		calls[ncalls].cc_num = num;
+		calls[ncalls].cc_nargs = nargs;
+		memset(calls[ncalls].cc_args, 0, sizeof(calls[ncalls].cc_args));
+		for (u_int a = 0; a < nargs; a++)
+			if (!corpus_getv(&p, end, &calls[ncalls].cc_args[a]))
+				return (ncalls);
+	}
+	return (ncalls);
+}
+
+void
+corpus_report(void)
+{
+
+	printf("%s: corpus has %ju entries, %ju new\n", getprogname(),
+	    (uintmax_t)corpus_idx->ci_count,
+	    (uintmax_t)(corpus_idx->ci_count - corpus_loaded));
+}
+
+/*
+ * Note the outcome of a call of system call num, returning true if no call of
+ * it that the corpus knows of has had that outcome before. __syscall(2)
+ * returns -1 and sets errno on failure.
+ */
+bool
+corpus_result(int num, u_long ret, int error)
+{
+	_Atomic uint64_t *word;
+	uint64_t bit;
+	int i;
+
+	if (num < 0 || num >= CORPUS_MAXSC)
+		return (false);
+	if (ret != (u_long)-1)
+		i = 0;
+	else
+		i = error > 0 && error < CORPUS_NOUTCOMES ? error :
+		    CORPUS_NOUTCOMES - 1;
+	word = &corpus_out->co_sc[num].cs_seen[i / 64];
+	bit = (uint64_t)1 << (i % 64);
+	if ((atomic_load_explicit(word, memory_order_relaxed) & bit) != 0)
+		return (false);
+	return ((atomic_fetch_or_explicit(word, bit,
+	    memory_order_relaxed) & bit) == 0);
+}
+
+/*
+ * Note that a call of system call num took ns nanoseconds, returning true if
+ * that is longer than any call of it that the corpus knows of.
+ */
+bool
+corpus_latency(int num, uint64_t ns)
+{
+	_Atomic uint64_t *latmax;
+	uint64_t old;
+
+	if (num < 0 || num >= CORPUS_MAXSC)
+		return (false);
+	latmax = &corpus_out->co_sc[num].cs_latmax;
+	old = atomic_load_explicit(latmax, memory_order_relaxed);
+	while (ns > old)
+		if (atomic_compare_exchange_weak_explicit(latmax, &old, ns,
+		    memory_order_relaxed, memory_order_relaxed))
+			return (true);
+	return (false);
+}
+
+/*
+ * Set up a fuzzer thread for adding to the corpus. Each thread opens the
+ * entries file itself, since flock(2) doesn't exclude holders of the same
+ * descriptor.
+ */
+struct corpusthread *
+corpus_thread_init(void)
+{
+	struct corpusthread *ct;
+
+	ct = xmalloc(sizeof(*ct));
+	memset(ct, 0, sizeof(*ct));
+	ct->ct_fd = open(corpus_path, O_WRONLY | O_APPEND);
+	if (ct->ct_fd < 0)
+		err(1, "open(%s)", corpus_path);
+	return (ct);
+}
+
+void
+corpus_thread_fini(struct corpusthread *ct)
+{
+
+	(void)close(ct->ct_fd);
+	free(ct);
+}
+
+/*
+ * Note a call that is about to be issued. args should hold only the arguments
+ * worth keeping, with the others zeroed.
+ */
+void
+corpus_call(struct corpusthread *ct, const struct scdesc *sd,
+    const u_long *args)
+{
+	struct corpuscall *cc;
+
+	cc = &ct->ct_hist[ct->ct_next];
+	ct->ct_next = (ct->ct_next + 1) % CORPUS_SEQLEN;
+	if (ct->ct_len < CORPUS_SEQLEN)
+		ct->ct_len++;
+	cc->cc_num = sd->sd_num;
+	cc->cc_nargs = sd->sd_nargs;
+	memcpy(cc->cc_args, args, sizeof(cc->cc_args));
+}
+
+/*
+ * Add the thread's last few calls to the corpus, unless they are already in it.
+ * Returns true if they were added.
+ */
+bool
+corpus_save(struct corpusthread *ct)
+{
+	uint8_t payload[CORPUS_MAXREC], rec[CORPUS_MAXREC], *p;
+	const struct corpuscall *cc;
+	size_t len, plen;
+	uint64_t h;
+	bool added;
+
+	p = payload;
+	for (u_int i = 0; i < ct->ct_len; i++) {
+		cc = &ct->ct_hist[(ct->ct_next + CORPUS_SEQLEN - ct->ct_len +
+		    i) % CORPUS_SEQLEN];
+		p = corpus_putv(p, cc->cc_num);
+		p = corpus_putv(p, cc->cc_nargs);
+		for (int a = 0; a < cc->cc_nargs; a++)
+			p = corpus_putv(p, cc->cc_args[a]);
+	}
+	plen = p - payload;
+	h = corpus_hash(payload, plen);
+	if (plen == 0 || corpus_lookup(corpus_idx, h))
+		return (false);
+
+	p = corpus_putv(rec, plen);
+	memcpy(p, payload, plen);
+	len = p + plen - rec;
+
+	added = false;
+	if (flock(ct->ct_fd, LOCK_EX) != 0)
+		err(1, "flock(%s)", corpus_path);
+	if (corpus_idx->ci_count >= CORPUS_MAXCOUNT) {
+		if (!ct->ct_warned)
+			warnx("corpus is full, not adding to it");
+		ct->ct_warned = true;
+	} else if (!corpus_lookup(corpus_idx, h)) {
+		/*
+		 * Write the entry before indexing it, so that a writer dying
+		 * in between leaves an entry the index doesn't cover, which
+		 * the next run notices, rather than an indexed hash with no
+		 * entry.
+		 */
+		if (write(ct->ct_fd, rec, len) != (ssize_t)len)
+			err(1, "write(%s)", corpus_path);
+		(void)corpus_insert(corpus_idx, h);
+		corpus_idx->ci_datalen += len;
+		added = true;
+	}
+	if (flock(ct->ct_fd, LOCK_UN) != 0)
+		err(1, "flock(%s)", corpus_path);
+	return (added);
+}
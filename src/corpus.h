@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _CORPUS_H_
+#define	_CORPUS_H_
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+
+#include "syscall.h"
+
+/* The longest call sequence kept in the corpus. */
+#define	CORPUS_SEQLEN	4
+
+/* A call of a corpus entry. Only arguments that can be reused are kept. */
+struct corpuscall {
+	int		cc_num;		/* system call number */
+	int		cc_nargs;
+	u_long		cc_args[SYSCALL_MAXARGS];
+};
+
+struct corpusthread;
+
+bool	corpus_init(void);
+bool	corpus_enabled(void);
+u_int	corpus_count(void);
+u_int	corpus_get(u_int, struct corpuscall *);
+void	corpus_report(void);
+struct corpusthread *corpus_thread_init(void);
+void	corpus_thread_fini(struct corpusthread *);
+void	corpus_call(struct corpusthread *, const struct scdesc *,
+	    const u_long *);
+bool	corpus_latency(int, uint64_t);
+bool	corpus_result(int, u_long, int);
+bool	corpus_save(struct corpusthread *);
+
+#endif /* _CORPUS_H_ */
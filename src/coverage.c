@@ -0,0 +1,335 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel coverage, selected with the coverage parameter. A coverage source
+ * reports the program counters a fuzzer thread's call went through; consecutive
+ * pairs of them are hashed into edges, which are looked up in a bitmap shared
+ * by all fuzzers, so that an edge counts as new only the first time any fuzzer
+ * reaches it.
+ *
+ * The kcov source uses kcov(4), which must be compiled into the kernel. The
+ * synthetic source needs no kernel support: it derives pseudo-PCs from the
+ * system call, its command and flag arguments and its outcome, so that the same
+ * call always yields the same edges. It exists to exercise coverage guidance,
+ * including with the null executor.
+ */
+
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/kcov.h>
+#include <sys/mman.h>
+#include <machine/atomic.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "coverage.h"
+#include "params.h"
+#include "syscall.h"
+#include "util.h"
+
+/* The edge bitmap has 2^COV_MAPBITS bits. */
+#define	COV_MAPBITS		24
+
+/* The number of PCs kcov can record for a single call. */
+#define	COV_KCOV_ENTRIES	(256 * 1024)
+
+/* The most pseudo-PCs the synthetic source produces for a call. */
+#define	COV_SYNTH_MAXPCS	(SYSCALL_MAXARGS * 64 + 2)
+
+struct covsource {
+	const char	*cs_name;
+	void		*(*cs_open)(void);
+	void		(*cs_start)(void *);
+	u_int		(*cs_collect)(void *, const struct scdesc *,
+			    const u_long *, u_long, int, const uint64_t **);
+	void		(*cs_close)(void *);
+};
+
+struct covthread {
+	const struct covsource *ct_src;
+	void		*ct_ctx;
+};
+
+struct cov_kcov {
+	int		ck_fd;
+	uint64_t	*ck_buf;	/* entry count, then PCs */
+};
+
+static void	*cov_kcov_open(void);
+static void	cov_kcov_start(void *);
+static u_int	cov_kcov_collect(void *, const struct scdesc *,
+		    const u_long *, u_long, int, const uint64_t **);
+static void	cov_kcov_close(void *);
+static void	*cov_synth_open(void);
+static void	cov_synth_start(void *);
+static u_int	cov_synth_collect(void *, const struct scdesc *,
+		    const u_long *, u_long, int, const uint64_t **);
+static void	cov_synth_close(void *);
+
+static const struct covsource cov_sources[] = {
+	{
+		.cs_name = "none",
+	},
+	{
+		.cs_name = "kcov",
+		.cs_open = cov_kcov_open,
+		.cs_start = cov_kcov_start,
+		.cs_collect = cov_kcov_collect,
+		.cs_close = cov_kcov_close,
+	},
+	{
+		.cs_name = "synthetic",
+		.cs_open = cov_synth_open,
+		.cs_start = cov_synth_start,
+		.cs_collect = cov_synth_collect,
+		.cs_close = cov_synth_close,
+	},
+};
+
+static const struct covsource *cov_src = &cov_sources[0];
+static _Atomic uint64_t *cov_map;
+
+static void *
+cov_kcov_open(void)
+{
+	struct cov_kcov *ck;
+
+	ck = xmalloc(sizeof(*ck));
+	ck->ck_fd = open("/dev/kcov", O_RDWR | O_CLOEXEC);
+	if (ck->ck_fd < 0)
+		err(1, "opening /dev/kcov");
+	if (ioctl(ck->ck_fd, KIOSETBUFSIZE, COV_KCOV_ENTRIES) != 0)
+		err(1, "ioctl(KIOSETBUFSIZE)");
+	ck->ck_buf = mmap(NULL, COV_KCOV_ENTRIES * KCOV_ENTRY_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, ck->ck_fd, 0);
+	if (ck->ck_buf == MAP_FAILED)
+		err(1, "mmap");
+	if (ioctl(ck->ck_fd, KIOENABLE, KCOV_MODE_TRACE_PC) != 0)
+		err(1, "ioctl(KIOENABLE)");
+	return (ck);
+}
+
+static void
+cov_kcov_start(void *ctx)
+{
+	struct cov_kcov *ck;
+
+	ck = ctx;
+	atomic_store_64(&ck->ck_buf[0], 0);
+}
+
+static u_int
+cov_kcov_collect(void *ctx, const struct scdesc *sd __unused,
+    const u_long *args __unused, u_long ret __unused, int error __unused,
+    const uint64_t **pcsp)
+{
+	struct cov_kcov *ck;
+
+	ck = ctx;
+	*pcsp = &ck->ck_buf[1];
+	return (min(atomic_load_64(&ck->ck_buf[0]), COV_KCOV_ENTRIES - 1));
+}
+
+static void
+cov_kcov_close(void *ctx)
+{
+	struct cov_kcov *ck;
+
+	ck = ctx;
+	(void)ioctl(ck->ck_fd, KIODISABLE, 0);
+	(void)munmap(ck->ck_buf, COV_KCOV_ENTRIES * KCOV_ENTRY_SIZE);
+	(void)close(ck->ck_fd);
+	free(ck);
+}
+
+static inline uint64_t
+cov_synth_pc(int num, int slot, u_long val)
+{
+	uint64_t h;
+
+	h = ((uint64_t)num << 32 | (uint32_t)slot) ^ val;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return (h);
+}
+
+static void *
+cov_synth_open(void)
+{
+
+	return (xmalloc(COV_SYNTH_MAXPCS * sizeof(uint64_t)));
+}
+
+static void
+cov_synth_start(void *ctx __unused)
+{
+}
+
+/*
+ * Produce a pseudo-PC for the call itself, one for each command argument and
+ * each flag set in a flag argument, and one for the outcome.
+ */
+static u_int
+cov_synth_collect(void *ctx, const struct scdesc *sd, const u_long *args,
+    u_long ret, int error, const uint64_t **pcsp)
+{
+	uint64_t *pcs;
+	u_long flags;
+	u_int n;
+
+	pcs = ctx;
+	n = 0;
+	pcs[n++] = cov_synth_pc(sd->sd_num, 0, 0);
+	for (int i = 0; i < sd->sd_nargs; i++) {
+		switch (sd->sd_args[i].sa_type) {
+		case ARG_CMD:
+			pcs[n++] = cov_synth_pc(sd->sd_num, i + 1, args[i]);
+			break;
+		case ARG_IFLAGMASK:
+		case ARG_LFLAGMASK:
+			for (flags = args[i]; flags != 0; flags &= flags - 1)
+				pcs[n++] = cov_synth_pc(sd->sd_num, i + 1,
+				    flags & -flags);
+			break;
+		default:
+			break;
+		}
+	}
+	pcs[n++] = cov_synth_pc(sd->sd_num, SYSCALL_MAXARGS + 1,
+	    ret == (u_long)-1 ? error : 0);
+	*pcsp = pcs;
+	return (n);
+}
+
+static void
+cov_synth_close(void *ctx)
+{
+
+	free(ctx);
+}
+
+/*
+ * Select the coverage source and map the edge bitmap. This must happen before
+ * the fuzzers are forked. Returns false if coverage is disabled.
+ */
+bool
+cov_init(void)
+{
+	const char *names[nitems(cov_sources)];
+
+	for (u_int i = 0; i < nitems(cov_sources); i++)
+		names[i] = cov_sources[i].cs_name;
+	cov_src = &cov_sources[param_choice("coverage", names,
+	    nitems(cov_sources))];
+	if (!cov_enabled())
+		return (false);
+
+	cov_map = mmap(NULL, (1ul << COV_MAPBITS) / NBBY, PROT_READ |
+	    PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	if (cov_map == MAP_FAILED)
+		err(1, "mmap");
+	return (true);
+}
+
+bool
+cov_enabled(void)
+{
+
+	return (cov_src != &cov_sources[0]);
+}
+
+/*
+ * Start collecting coverage for the calling thread, or return NULL if coverage
+ * is disabled.
+ */
+struct covthread *
+cov_thread_init(void)
+{
+	struct covthread *ct;
+
+	if (!cov_enabled())
+		return (NULL);
+	ct = xmalloc(sizeof(*ct));
+	ct->ct_src = cov_src;
+	ct->ct_ctx = (cov_src->cs_open)();
+	return (ct);
+}
+
+void
+cov_thread_fini(struct covthread *ct)
+{
+
+	(ct->ct_src->cs_close)(ct->ct_ctx);
+	free(ct);
+}
+
+/* Begin collecting the coverage of a call. */
+void
+cov_start(struct covthread *ct)
+{
+
+	(ct->ct_src->cs_start)(ct->ct_ctx);
+}
+
+/*
+ * Add the coverage collected since cov_start() to the bitmap, and return the
+ * number of edges no fuzzer had reached before. Most edges have been seen, so
+ * bits are tested before being set.
+ */
+u_int
+cov_collect(struct covthread *ct, const struct scdesc *sd, const u_long *args,
+    u_long ret, int error)
+{
+	const uint64_t *pcs;
+	uint64_t bit, edge, prev;
+	u_int n, new;
+
+	n = (ct->ct_src->cs_collect)(ct->ct_ctx, sd, args, ret, error, &pcs);
+	new = 0;
+	prev = 0;
+	for (u_int i = 0; i < n; i++) {
+		edge = ((pcs[i] ^ (prev << 1)) * 0x9e3779b97f4a7c15ull) >>
+		    (64 - COV_MAPBITS);
+		prev = pcs[i];
+		bit = 1ull << (edge & 63);
+		if ((atomic_load_explicit(&cov_map[edge >> 6],
+		    memory_order_relaxed) & bit) != 0)
+			continue;
+		if ((atomic_fetch_or_explicit(&cov_map[edge >> 6], bit,
+		    memory_order_relaxed) & bit) == 0)
+			new++;
+	}
+	return (new);
+}
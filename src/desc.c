@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+
+#include "argpool.h"
+#include "prng.h"
+#include "syscall.h"
+
+/*
+ * System call definitions for descriptor management.
+ */
+
+void	close_fixup(u_long *);
+void	close_cleanup(u_long *, u_long);
+u_long	close_fake(u_long *, int *);
+
+static struct scdesc close_desc = {
+	.sd_num = SYS_close,
+	.sd_name = "close",
+	.sd_nargs = 1,
+	.sd_groups = SC_GROUP_FILEIO,
+	.sd_fixup = close_fixup,
+	.sd_cleanup = close_cleanup,
+	.sd_fake = close_fake,
+	.sd_args = {
+		{
+			.sa_type = ARG_UNSPEC,
+			.sa_name = "fd",
+		},
+	},
+};
+SYSCALL_ADD(close_desc);
+
+/*
+ * Only close descriptors from the lazily refilled pools; the files and
+ * directories of the random file hierarchy are never replaced.
+ */
+void
+close_fixup(u_long *args)
+{
+	static const enum ap_restype types[] = {
+		AP_RES_SOCKET,
+		AP_RES_PIPE,
+		AP_RES_KQUEUE,
+		AP_RES_PROCDESC,
+	};
+
+	args[0] = ap_res_random(types[rnd_range(nitems(types))]);
+}
+
+void
+close_cleanup(u_long *args, u_long ret)
+{
+
+	if (ret == 0)
+		ap_res_close(args[0]);
+}
+
+/*
+ * Under the null executor, the descriptor stays open, so it mustn't be dropped
+ * from its pool; fail as if another thread had closed it first.
+ */
+u_long
+close_fake(u_long *args __unused, int *errorp)
+{
+
+	*errorp = EBADF;
+	return ((u_long)-1);
+}
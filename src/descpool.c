@@ -0,0 +1,174 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+#include "descpool.h"
+#include "prng.h"
+#include "util.h"
+
+#define	DP_WORDBITS	64
+#define	DP_SBBITS	(DP_SBWORDS * DP_WORDBITS)
+
+static void	descpool_grow(struct descpool *, u_int);
+static u_int	word_select(uint64_t, u_int);
+
+void
+descpool_init(struct descpool *dp)
+{
+
+	dp->dp_map = NULL;
+	dp->dp_sbcnt = NULL;
+	dp->dp_nwords = 0;
+	dp->dp_count = 0;
+}
+
+void
+descpool_fini(struct descpool *dp)
+{
+
+	free(dp->dp_map);
+	free(dp->dp_sbcnt);
+	descpool_init(dp);
+}
+
+/*
+ * Make room for descriptors up to and including fd. The map always covers a
+ * whole number of superblocks.
+ */
+static void
+descpool_grow(struct descpool *dp, u_int fd)
+{
+	u_int nsb, nwords, osb;
+
+	nwords = max(dp->dp_nwords * 2, roundup2(fd / DP_WORDBITS + 1,
+	    DP_SBWORDS));
+	nsb = nwords / DP_SBWORDS;
+	osb = dp->dp_nwords / DP_SBWORDS;
+
+	dp->dp_map = realloc(dp->dp_map, nwords * sizeof(*dp->dp_map));
+	dp->dp_sbcnt = realloc(dp->dp_sbcnt, nsb * sizeof(*dp->dp_sbcnt));
+	if (dp->dp_map == NULL || dp->dp_sbcnt == NULL)
+		err(1, "realloc");
+	memset(&dp->dp_map[dp->dp_nwords], 0,
+	    (nwords - dp->dp_nwords) * sizeof(*dp->dp_map));
+	memset(&dp->dp_sbcnt[osb], 0, (nsb - osb) * sizeof(*dp->dp_sbcnt));
+	dp->dp_nwords = nwords;
+}
+
+/*
+ * Add a descriptor to the pool. Adding a descriptor that is already present
+ * has no effect.
+ */
+void
+descpool_add(struct descpool *dp, int fd)
+{
+	uint64_t bit;
+	u_int word;
+
+	assert(fd >= 0);
+
+	word = (u_int)fd / DP_WORDBITS;
+	if (word >= dp->dp_nwords)
+		descpool_grow(dp, fd);
+	bit = (uint64_t)1 << ((u_int)fd % DP_WORDBITS);
+	if ((dp->dp_map[word] & bit) != 0)
+		return;
+	dp->dp_map[word] |= bit;
+	dp->dp_sbcnt[word / DP_SBWORDS]++;
+	dp->dp_count++;
+}
+
+/*
+ * Remove a descriptor from the pool. The descriptor must be present.
+ */
+void
+descpool_remove(struct descpool *dp, int fd)
+{
+	uint64_t bit;
+	u_int word;
+
+	assert(fd >= 0);
+
+	word = (u_int)fd / DP_WORDBITS;
+	bit = (uint64_t)1 << ((u_int)fd % DP_WORDBITS);
+	assert(word < dp->dp_nwords && (dp->dp_map[word] & bit) != 0);
+	dp->dp_map[word] &= ~bit;
+	dp->dp_sbcnt[word / DP_SBWORDS]--;
+	dp->dp_count--;
+}
+
+/*
+ * Return the index of the (rank+1)th set bit in w.
+ */
+static u_int
+word_select(uint64_t w, u_int rank)
+{
+
+	assert(rank < (u_int)__builtin_popcountll(w));
+#ifdef __BMI2__
+	return (__builtin_ctzll(_pdep_u64((uint64_t)1 << rank, w)));
+#else
+	for (; rank > 0; rank--)
+		w &= w - 1;
+	return (__builtin_ctzll(w));
+#endif
+}
+
+/*
+ * Return a descriptor chosen uniformly from the pool, or -1 if the pool is
+ * empty.
+ */
+int
+descpool_select(struct descpool *dp)
+{
+	u_int rank, sb, word;
+	int cnt;
+
+	if (dp->dp_count == 0)
+		return (-1);
+
+	rank = rnd_range(dp->dp_count);
+	for (sb = 0; rank >= dp->dp_sbcnt[sb]; sb++)
+		rank -= dp->dp_sbcnt[sb];
+	for (word = sb * DP_SBWORDS;; word++) {
+		cnt = __builtin_popcountll(dp->dp_map[word]);
+		if (rank < (u_int)cnt)
+			break;
+		rank -= cnt;
+	}
+	return ((int)(word * DP_WORDBITS + word_select(dp->dp_map[word],
+	    rank)));
+}
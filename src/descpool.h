@@ -0,0 +1,54 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _DESCPOOL_H_
+#define	_DESCPOOL_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * A set of file descriptors represented as a bitmap. Each group of
+ * DP_SBWORDS words forms a superblock whose population count is cached, so a
+ * descriptor can be picked uniformly by rank without visiting every word.
+ */
+#define	DP_SBWORDS	64
+
+struct descpool {
+	uint64_t	*dp_map;	/* one bit per descriptor */
+	u_int		*dp_sbcnt;	/* number of set bits per superblock */
+	u_int		dp_nwords;	/* size of dp_map in words */
+	u_int		dp_count;	/* number of descriptors in the pool */
+};
+
+void	descpool_init(struct descpool *);
+void	descpool_fini(struct descpool *);
+void	descpool_add(struct descpool *, int);
+void	descpool_remove(struct descpool *, int);
+int	descpool_select(struct descpool *);
+
+#endif /* _DESCPOOL_H_ */
@@ -0,0 +1,139 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Executors, selected with the executor parameter. The kernel executor issues
+ * system calls. The null executor doesn't, and instead returns a plausible
+ * result, given by a call's sd_fake hook, or success; this lets the cost of
+ * generating calls and maintaining the argument pools be measured and profiled
+ * on its own. The record executor behaves like the null one, and exists to
+ * produce call logs cheaply, for replay against the kernel later.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "exec.h"
+#include "params.h"
+#include "syscall.h"
+#include "util.h"
+
+/* The size of the address space reserved for fake mappings. */
+#define	EXEC_FAKE_VA	(1ul << 30)
+
+static u_long	exec_kernel(const struct scdesc *, u_long *, int *);
+static u_long	exec_null(const struct scdesc *, u_long *, int *);
+
+static const struct executor executors[] = {
+	{
+		.ex_name = "kernel",
+		.ex_call = exec_kernel,
+	},
+	{
+		.ex_name = "null",
+		.ex_call = exec_null,
+	},
+	{
+		.ex_name = "record",
+		.ex_call = exec_null,
+	},
+};
+
+const struct executor *executor = &executors[0];
+
+static char *exec_fake_base;
+static atomic_ulong exec_fake_next;
+
+static u_long
+exec_kernel(const struct scdesc *sd, u_long *args, int *errorp)
+{
+	u_long ret;
+
+	ret = __syscall(sd->sd_num, args[0], args[1], args[2], args[3],
+	    args[4], args[5], args[6], args[7]);
+	*errorp = errno;
+	return (ret);
+}
+
+static u_long
+exec_null(const struct scdesc *sd, u_long *args, int *errorp)
+{
+
+	*errorp = 0;
+	if (sd->sd_fake != NULL)
+		return ((sd->sd_fake)(args, errorp));
+	return (0);
+}
+
+void
+exec_init(void)
+{
+	const char *names[nitems(executors)];
+
+	for (u_int i = 0; i < nitems(executors); i++)
+		names[i] = executors[i].ex_name;
+	executor = &executors[param_choice("executor", names,
+	    nitems(executors))];
+	if (executor == &executors[2] && *param_string("call-log") == '\0')
+		errx(1, "executor=record requires call-log to be set");
+	if (executor == &executors[0])
+		return;
+
+	/*
+	 * Reserve address space to hand out fake mappings from, so that they
+	 * can't overlap the real ones in the memblk pool.
+	 */
+	exec_fake_base = mmap(NULL, EXEC_FAKE_VA, PROT_NONE, MAP_GUARD, -1, 0);
+	if (exec_fake_base == MAP_FAILED)
+		err(1, "mmap");
+}
+
+/*
+ * Pick an address for a fake mapping of len bytes with the given alignment, or
+ * page-aligned if align is 0. Addresses are handed out in order and wrap
+ * around, so a fake mapping may overlap an earlier one, as if the latter had
+ * been unmapped in the meantime, but always lies within the reservation.
+ * Returns NULL if the mapping can't fit in the reservation at all.
+ */
+void *
+exec_fake_addr(size_t len, size_t align)
+{
+	u_long off;
+
+	align = max(align, (size_t)getpagesize());
+	len = roundup2(len, align);
+	if (len == 0 || len > EXEC_FAKE_VA - align)
+		return (NULL);
+	off = atomic_fetch_add_explicit(&exec_fake_next, len + align,
+	    memory_order_relaxed);
+	return ((void *)roundup2((uintptr_t)exec_fake_base +
+	    off % (EXEC_FAKE_VA - align - len + 1), align));
+}
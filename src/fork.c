@@ -28,6 +28,7 @@
 #include <sys/wait.h>
 
 #include <err.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "syscall.h"
@@ -38,6 +39,7 @@
 
 void rfork_fixup(u_long *args);
 void fork_cleanup(u_long *args, u_long ret);
+u_long fork_fake(u_long *args, int *errorp);
 
 static struct scdesc fork_desc = {
 	.sd_num = SYS_fork,
@@ -45,6 +47,7 @@ static struct scdesc fork_desc = {
 	.sd_nargs = 0,
 	.sd_groups = SC_GROUP_FORK,
 	.sd_cleanup = fork_cleanup,
+	.sd_fake = fork_fake,
 };
 SYSCALL_ADD(fork_desc);
 
@@ -67,6 +70,7 @@ static struct scdesc rfork_desc = {
 	.sd_groups = SC_GROUP_FORK,
 	.sd_fixup = rfork_fixup,
 	.sd_cleanup = fork_cleanup,
+	.sd_fake = fork_fake,
 	.sd_args = {
 		{
 			.sa_type = ARG_IFLAGMASK,
@@ -105,9 +109,22 @@ fork_cleanup(u_long *args __unused, u_long ret)
 	if (ret == 0)
 		_exit(0);
 	else if ((pid_t)ret > 0) {
-		if (wait(&status) == -1)
-			err(1, "wait");
+		/* Don't reap children belonging to the argument pools. */
+		if (waitpid((pid_t)ret, &status, 0) == -1)
+			err(1, "waitpid");
 		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
 			errx(1, "unexpected exit status %d\n", status);
 	}
 }
+
+/*
+ * The null executor can't create a process, and succeeding without one would
+ * send the fuzzer down the child's path, so pretend we're at the process limit.
+ */
+u_long
+fork_fake(u_long *args __unused, int *errorp)
+{
+
+	*errorp = EAGAIN;
+	return ((u_long)-1);
+}
@@ -0,0 +1,463 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Minimize a logged call sequence that makes the fuzzer fail, using delta
+ * debugging (Zeller and Hildebrandt's ddmin). The current sequence is split
+ * into n chunks, and each chunk, then each chunk's complement, is tried as a
+ * candidate; the first candidate that still fails the same way replaces the
+ * current sequence. If none does, the chunks are split further until they are
+ * single calls.
+ *
+ * Each candidate is replayed by a worker process forked from a parent whose
+ * argument pools were set up like those of the logged run, so every worker
+ * starts from the same state; cleanup hooks run as during fuzzing, so the pools
+ * follow what the replayed calls do. A candidate may keep an munmap(2) call
+ * but drop the mmap(2) call whose mapping it removes, so the pools tolerate
+ * unmapping ranges they don't hold. Up to minimize-workers candidates are
+ * tried at once. As soon as one fails, workers trying later candidates are
+ * killed, since an earlier failing candidate would be preferred over them
+ * anyway; this keeps the result independent of the number of workers.
+ */
+
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "argpool.h"
+#include "calllog.h"
+#include "minimize.h"
+#include "params.h"
+#include "syscall.h"
+#include "util.h"
+
+/* Exit status of a worker whose check command failed. */
+#define	MIN_EXIT_CHECK	125
+
+/* How a replay ended. */
+enum min_kind {
+	MIN_PASS,
+	MIN_CRASH,	/* killed by a signal */
+	MIN_HANG,	/* ran for longer than minimize-timeout */
+	MIN_CHECK,	/* the check command failed */
+	MIN_EXIT,	/* exited with a non-zero status */
+};
+
+struct min_outcome {
+	enum min_kind	mo_kind;
+	int		mo_code;	/* signal or exit status */
+};
+
+/* A candidate: a range of the current sequence, or all but that range. */
+struct min_cand {
+	u_int		mc_lo;
+	u_int		mc_hi;
+	bool		mc_compl;
+};
+
+struct min_worker {
+	pid_t		mw_pid;		/* -1 if idle */
+	u_int		mw_cand;
+	uint64_t	mw_start;
+	bool		mw_hung;	/* killed for running too long */
+	bool		mw_cancelled;	/* killed as no longer needed */
+};
+
+struct min_state {
+	struct calllog	*ms_log;
+	u_int		*ms_cur;	/* indices of the calls kept so far */
+	u_int		ms_ncur;
+	struct min_worker *ms_workers;
+	u_int		ms_nworkers;
+	uint64_t	ms_timeout;	/* nanoseconds */
+	const char	*ms_check;
+	struct min_outcome ms_ref;	/* how the whole sequence fails */
+};
+
+static void	min_cancel(struct min_state *, u_int);
+static void	min_describe(const struct min_outcome *, char *, size_t);
+static struct min_outcome min_outcome(int, bool);
+static int	min_round(struct min_state *, const struct min_cand *, u_int,
+		    struct min_outcome *);
+static void	min_spawn(struct min_state *, struct min_worker *,
+		    const struct min_cand *, u_int);
+static void __dead2 min_worker(struct min_state *, const struct min_cand *);
+static void	min_write(struct min_state *, const char *, u_long);
+
+static volatile sig_atomic_t min_sigalrm;
+
+static void
+min_handler(int sig __unused)
+{
+
+	min_sigalrm = 1;
+}
+
+/*
+ * The body of a worker: replay a candidate, then run the check command, if
+ * any. A failure shows up in the way the worker exits.
+ */
+static void __dead2
+min_worker(struct min_state *ms, const struct min_cand *mc)
+{
+	struct scdesc *sd;
+	u_long args[SYSCALL_MAXARGS], ret;
+	u_int i, k;
+	int error, status;
+	bool in;
+
+	(void)signal(SIGALRM, SIG_DFL);
+	ap_res_start(NULL);
+	calllog_rewind(ms->ms_log);
+	for (i = k = 0; k < ms->ms_ncur; i++) {
+		if (!mc->mc_compl && k >= mc->mc_hi)
+			break;
+		if ((sd = calllog_next(ms->ms_log, args, &ret, &error)) ==
+		    NULL)
+			break;
+		if (i != ms->ms_cur[k])
+			continue;
+		in = k >= mc->mc_lo && k < mc->mc_hi;
+		k++;
+		if (in != mc->mc_compl)
+			(void)calllog_replay(sd, args, &error);
+	}
+
+	if (*ms->ms_check != '\0') {
+		status = system(ms->ms_check);
+		if (status == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0)
+			_exit(MIN_EXIT_CHECK);
+	}
+	_exit(0);
+}
+
+static void
+min_spawn(struct min_state *ms, struct min_worker *mw,
+    const struct min_cand *mc, u_int idx)
+{
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1)
+		err(1, "fork");
+	else if (pid == 0)
+		min_worker(ms, mc);
+	mw->mw_pid = pid;
+	mw->mw_cand = idx;
+	mw->mw_start = nsecs();
+	mw->mw_hung = mw->mw_cancelled = false;
+}
+
+static struct min_outcome
+min_outcome(int status, bool hung)
+{
+	struct min_outcome mo;
+
+	mo.mo_code = 0;
+	if (hung)
+		mo.mo_kind = MIN_HANG;
+	else if (WIFSIGNALED(status)) {
+		mo.mo_kind = MIN_CRASH;
+		mo.mo_code = WTERMSIG(status);
+	} else if (WEXITSTATUS(status) == MIN_EXIT_CHECK)
+		mo.mo_kind = MIN_CHECK;
+	else if (WEXITSTATUS(status) != 0) {
+		mo.mo_kind = MIN_EXIT;
+		mo.mo_code = WEXITSTATUS(status);
+	} else
+		mo.mo_kind = MIN_PASS;
+	return (mo);
+}
+
+static void
+min_describe(const struct min_outcome *mo, char *buf, size_t len)
+{
+
+	switch (mo->mo_kind) {
+	case MIN_PASS:
+		snprintf(buf, len, "no failure");
+		break;
+	case MIN_CRASH:
+		snprintf(buf, len, "signal %d (%s)", mo->mo_code,
+		    strsignal(mo->mo_code));
+		break;
+	case MIN_HANG:
+		snprintf(buf, len, "a hang");
+		break;
+	case MIN_CHECK:
+		snprintf(buf, len, "a failed check");
+		break;
+	case MIN_EXIT:
+		snprintf(buf, len, "exit status %d", mo->mo_code);
+		break;
+	}
+}
+
+/* Kill the workers trying candidates after the given one. */
+static void
+min_cancel(struct min_state *ms, u_int idx)
+{
+	struct min_worker *mw;
+
+	for (u_int i = 0; i < ms->ms_nworkers; i++) {
+		mw = &ms->ms_workers[i];
+		if (mw->mw_pid != -1 && mw->mw_cand > idx &&
+		    !mw->mw_cancelled) {
+			(void)kill(mw->mw_pid, SIGKILL);
+			mw->mw_cancelled = true;
+		}
+	}
+}
+
+/*
+ * Try a list of candidates, and return the index of the first that fails like
+ * the whole sequence did, or -1 if none does. If ref is non-NULL, the outcome
+ * of the first candidate is stored there instead, and any outcome counts.
+ */
+static int
+min_round(struct min_state *ms, const struct min_cand *cands, u_int ncands,
+    struct min_outcome *ref)
+{
+	struct min_outcome mo;
+	struct min_worker *mw;
+	uint64_t now;
+	u_int best, next, nrunning;
+	pid_t pid;
+	int status;
+
+	best = ncands;
+	next = nrunning = 0;
+	while (nrunning > 0 || next < best) {
+		for (u_int i = 0; i < ms->ms_nworkers && next < best; i++) {
+			mw = &ms->ms_workers[i];
+			if (mw->mw_pid != -1)
+				continue;
+			min_spawn(ms, mw, &cands[next], next);
+			next++;
+			nrunning++;
+		}
+
+		if ((pid = wait(&status)) == -1) {
+			if (errno != EINTR)
+				err(1, "wait");
+			if (!min_sigalrm || ms->ms_timeout == 0)
+				continue;
+			min_sigalrm = 0;
+			now = nsecs();
+			for (u_int i = 0; i < ms->ms_nworkers; i++) {
+				mw = &ms->ms_workers[i];
+				if (mw->mw_pid == -1 || mw->mw_hung ||
+				    mw->mw_cancelled ||
+				    now - mw->mw_start < ms->ms_timeout)
+					continue;
+				(void)kill(mw->mw_pid, SIGKILL);
+				mw->mw_hung = true;
+			}
+			continue;
+		}
+
+		mw = NULL;
+		for (u_int i = 0; i < ms->ms_nworkers; i++)
+			if (ms->ms_workers[i].mw_pid == pid)
+				mw = &ms->ms_workers[i];
+		if (mw == NULL)
+			continue;
+		mw->mw_pid = -1;
+		nrunning--;
+		if (mw->mw_cancelled)
+			continue;
+		mo = min_outcome(status, mw->mw_hung);
+		if (ref != NULL) {
+			*ref = mo;
+			return (0);
+		}
+		if (mo.mo_kind == ms->ms_ref.mo_kind &&
+		    mo.mo_code == ms->ms_ref.mo_code && mw->mw_cand < best) {
+			best = mw->mw_cand;
+			min_cancel(ms, best);
+		}
+	}
+	return (best < ncands ? (int)best : -1);
+}
+
+/* Write the calls kept to a new log, and print them. */
+static void
+min_write(struct min_state *ms, const char *path, u_long seed)
+{
+	struct calllog *out;
+	struct scdesc *sd;
+	u_long args[SYSCALL_MAXARGS], ret;
+	u_int i, k;
+	int error;
+
+	out = calllog_create(path, seed, 0, 0);
+	calllog_rewind(ms->ms_log);
+	for (i = k = 0; k < ms->ms_ncur; i++) {
+		if ((sd = calllog_next(ms->ms_log, args, &ret, &error)) ==
+		    NULL)
+			break;
+		if (i != ms->ms_cur[k])
+			continue;
+		k++;
+		calllog_call(out, sd, args);
+		calllog_ret(out, sd, ret, error);
+
+		printf("\t%u: %s(", i, sd->sd_name);
+		for (int j = 0; j < sd->sd_nargs; j++)
+			printf("%s%#lx", j == 0 ? "" : ", ", args[j]);
+		if (ret == (u_long)-1)
+			printf(") = -1 (%s)\n", strerror(error));
+		else
+			printf(") = %#lx\n", ret);
+	}
+	calllog_close(out);
+}
+
+/*
+ * Minimize the first ncalls calls of a log, or all of them if ncalls is 0, and
+ * write the result to <path>.min. The argument pools must have been set up as
+ * for the logged run.
+ */
+void
+minimize(struct calllog *log, const char *path, u_long seed, u_long ncalls)
+{
+	struct min_cand *cands;
+	struct itimerval it;
+	struct sigaction sa;
+	struct min_state ms;
+	char desc[64], *out;
+	u_long args[SYSCALL_MAXARGS], ret;
+	u_int gran, n, ncands;
+	int best, error;
+
+	memset(&ms, 0, sizeof(ms));
+	ms.ms_log = log;
+	ms.ms_nworkers = max(param_number("minimize-workers"), 1);
+	ms.ms_timeout = param_number("minimize-timeout") * 1000000000;
+	ms.ms_check = param_string("minimize-check");
+	ms.ms_workers = xmalloc(ms.ms_nworkers * sizeof(*ms.ms_workers));
+	for (u_int i = 0; i < ms.ms_nworkers; i++)
+		ms.ms_workers[i].mw_pid = -1;
+	ap_memblk_inexact();
+
+	for (n = 0; ncalls == 0 || n < ncalls; n++)
+		if (calllog_next(log, args, &ret, &error) == NULL)
+			break;
+	if (n == 0)
+		errx(1, "%s: no calls to minimize", path);
+	ms.ms_ncur = n;
+	ms.ms_cur = xmalloc(n * sizeof(*ms.ms_cur));
+	for (u_int i = 0; i < n; i++)
+		ms.ms_cur[i] = i;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = min_handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGALRM, &sa, NULL) != 0)
+		err(1, "sigaction");
+	memset(&it, 0, sizeof(it));
+	it.it_interval.tv_sec = 1;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_REAL, &it, NULL) != 0)
+		err(1, "setitimer");
+
+	cands = xmalloc(sizeof(*cands));
+	cands[0].mc_lo = 0;
+	cands[0].mc_hi = n;
+	cands[0].mc_compl = false;
+	(void)min_round(&ms, cands, 1, &ms.ms_ref);
+	free(cands);
+	min_describe(&ms.ms_ref, desc, sizeof(desc));
+	if (ms.ms_ref.mo_kind == MIN_PASS)
+		errx(1, "%s: replaying %u calls caused no failure", path, n);
+	printf("%s: minimizing %u calls ending in %s, with %u workers\n",
+	    getprogname(), n, desc, ms.ms_nworkers);
+
+	gran = 2;
+	while (ms.ms_ncur >= 2) {
+		gran = min(gran, ms.ms_ncur);
+		cands = xmalloc(2 * gran * sizeof(*cands));
+		ncands = 0;
+		for (u_int i = 0; i < gran; i++) {
+			cands[ncands].mc_lo = (uint64_t)ms.ms_ncur * i / gran;
+			cands[ncands].mc_hi =
+			    (uint64_t)ms.ms_ncur * (i + 1) / gran;
+			cands[ncands++].mc_compl = false;
+		}
+		/* With two chunks, each one's complement is the other. */
+		for (u_int i = 0; gran > 2 && i < gran; i++) {
+			cands[ncands] = cands[i];
+			cands[ncands++].mc_compl = true;
+		}
+
+		best = min_round(&ms, cands, ncands, NULL);
+		if (best == -1) {
+			free(cands);
+			if (gran == ms.ms_ncur)
+				break;
+			gran *= 2;
+			continue;
+		}
+		if (!cands[best].mc_compl) {
+			memmove(ms.ms_cur, &ms.ms_cur[cands[best].mc_lo],
+			    (cands[best].mc_hi - cands[best].mc_lo) *
+			    sizeof(*ms.ms_cur));
+			ms.ms_ncur = cands[best].mc_hi - cands[best].mc_lo;
+			gran = 2;
+		} else {
+			memmove(&ms.ms_cur[cands[best].mc_lo],
+			    &ms.ms_cur[cands[best].mc_hi],
+			    (ms.ms_ncur - cands[best].mc_hi) *
+			    sizeof(*ms.ms_cur));
+			ms.ms_ncur -= cands[best].mc_hi - cands[best].mc_lo;
+			gran = max(gran - 1, 2);
+		}
+		free(cands);
+		printf("%s: %u calls left\n", getprogname(), ms.ms_ncur);
+	}
+
+	memset(&it, 0, sizeof(it));
+	(void)setitimer(ITIMER_REAL, &it, NULL);
+
+	if (asprintf(&out, "%s.min", path) < 0)
+		err(1, "asprintf");
+	printf("%s: %u calls still fail with %s, written to %s:\n",
+	    getprogname(), ms.ms_ncur, desc, out);
+	min_write(&ms, out, seed);
+	free(out);
+	free(ms.ms_cur);
+	free(ms.ms_workers);
+}
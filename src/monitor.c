@@ -0,0 +1,350 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coverage.h"
+#include "monitor.h"
+#include "params.h"
+#include "stats.h"
+#include "syscall.h"
+#include "util.h"
+
+/*
+ * A view of the fuzzers' progress, computed by the parent from the shared
+ * statistics every monitor-interval milliseconds. "top" redraws a screenful
+ * each time, and "log" prints a single line suitable for log files.
+ */
+enum monitor_mode {
+	MONITOR_NONE,
+	MONITOR_TOP,
+	MONITOR_LOG,
+};
+
+struct monitor_fuzzer {
+	uint64_t	mf_calls;	/* calls issued so far */
+	uint64_t	mf_rate;	/* calls per second, last interval */
+	uint64_t	mf_progress;	/* time of the last progress */
+};
+
+struct monitor_sc {
+	const char	*ms_name;
+	uint64_t	ms_calls;	/* calls issued so far */
+	uint64_t	ms_prev;	/* calls as of the last interval */
+	uint64_t	ms_rate;	/* calls per second, last interval */
+	uint64_t	ms_edges;	/* new coverage edges found so far */
+};
+
+/* Resource pool lookups of one kind, over all fuzzers. */
+struct monitor_pool {
+	uint64_t	mp_lookups;	/* lookups so far */
+	uint64_t	mp_misses;	/* lookups that found the pool empty */
+	double		mp_missed;	/* fraction missed, last interval */
+};
+
+/* The number of system calls listed as the busiest. */
+#define	MONITOR_TOPSC	10
+
+static void	monitor_print_log(const pid_t *, const struct monitor_sc *,
+		    uint64_t, uint64_t);
+static void	monitor_print_top(const pid_t *, const struct monitor_sc *,
+		    uint64_t, uint64_t);
+static int	monitor_sc_cmp(const void *, const void *);
+static void	monitor_update_pools(uint64_t);
+
+static const char * const monitor_modes[] = {
+	[MONITOR_NONE] =	"none",
+	[MONITOR_TOP] =		"top",
+	[MONITOR_LOG] =		"log",
+};
+
+static enum monitor_mode monitor_mode;
+static struct scdesc * const *monitor_scds;
+static u_int monitor_nsc, monitor_nfuzzers, monitor_nthreads;
+static struct monitor_fuzzer *monitor_fuzzers;
+static struct monitor_sc *monitor_scs;
+static uint64_t monitor_start, monitor_last;
+static uint64_t monitor_edges, monitor_edgerate;
+static struct monitor_pool monitor_pools[AP_RES_NTYPES];
+static uint64_t monitor_stale, monitor_stalerate;
+
+/*
+ * Set up the monitor for nfuzzers fuzzers of nthreads threads each, issuing the
+ * nsc system calls in scds. Returns false if monitoring is disabled.
+ */
+bool
+monitor_init(struct scdesc * const *scds, u_int nsc, u_int nfuzzers,
+    u_int nthreads)
+{
+
+	monitor_mode = param_choice("monitor", monitor_modes,
+	    nitems(monitor_modes));
+	if (monitor_mode == MONITOR_NONE)
+		return (false);
+
+	monitor_scds = scds;
+	monitor_nsc = nsc;
+	monitor_nfuzzers = nfuzzers;
+	monitor_nthreads = nthreads;
+	monitor_fuzzers = xmalloc(nfuzzers * sizeof(*monitor_fuzzers));
+	memset(monitor_fuzzers, 0, nfuzzers * sizeof(*monitor_fuzzers));
+	monitor_scs = xmalloc(nsc * sizeof(*monitor_scs));
+	memset(monitor_scs, 0, nsc * sizeof(*monitor_scs));
+	monitor_start = monitor_last = nsecs();
+	for (u_int f = 0; f < nfuzzers; f++)
+		monitor_fuzzers[f].mf_progress = monitor_start;
+	return (true);
+}
+
+void
+monitor_fini(void)
+{
+
+	free(monitor_fuzzers);
+	free(monitor_scs);
+	monitor_fuzzers = NULL;
+	monitor_scs = NULL;
+}
+
+static int
+monitor_sc_cmp(const void *a, const void *b)
+{
+	const struct monitor_sc *ma, *mb;
+
+	ma = a;
+	mb = b;
+	if (ma->ms_rate != mb->ms_rate)
+		return (ma->ms_rate < mb->ms_rate ? 1 : -1);
+	return (strcmp(ma->ms_name, mb->ms_name));
+}
+
+/*
+ * Work out how often each kind of resource pool was empty when asked, and how
+ * often pipelined calls had to be regenerated because a pool they drew from
+ * had shrunk.
+ */
+static void
+monitor_update_pools(uint64_t elapsed)
+{
+	const struct respool_stats *rs;
+	struct monitor_pool *mp;
+	uint64_t lookups, misses, stale;
+
+	for (int i = 0; i < AP_RES_NTYPES; i++) {
+		mp = &monitor_pools[i];
+		lookups = misses = 0;
+		for (u_int f = 0; f < monitor_nfuzzers; f++) {
+			rs = &stats_pools(f)->ps_res[i];
+			misses += atomic_load_explicit(&rs->rs_misses,
+			    memory_order_relaxed);
+			lookups += atomic_load_explicit(&rs->rs_hits,
+			    memory_order_relaxed);
+		}
+		lookups += misses;
+		mp->mp_missed = lookups == mp->mp_lookups ? 0 :
+		    (double)(misses - mp->mp_misses) /
+		    (lookups - mp->mp_lookups);
+		mp->mp_lookups = lookups;
+		mp->mp_misses = misses;
+	}
+	stale = 0;
+	for (u_int f = 0; f < monitor_nfuzzers; f++)
+		stale += atomic_load_explicit(&stats_pools(f)->ps_stale,
+		    memory_order_relaxed);
+	monitor_stalerate = (stale - monitor_stale) * 1000000000 / elapsed;
+	monitor_stale = stale;
+}
+
+/*
+ * Sample the counters and print the fuzzers' progress since the last update.
+ * pids holds each fuzzer's PID, or -1 once it has exited. A fuzzer which hasn't
+ * issued a call during the last interval is reported as stalled: it is stuck
+ * in a system call, or has been stopped.
+ */
+void
+monitor_update(const pid_t *pids)
+{
+	struct monitor_fuzzer *mf;
+	struct monitor_sc *busiest;
+	const struct scstats *ss;
+	uint64_t calls, edges, elapsed, now, total;
+
+	if (monitor_mode == MONITOR_NONE)
+		return;
+
+	now = nsecs();
+	elapsed = max(now - monitor_last, 1);
+	monitor_last = now;
+
+	for (u_int i = 0; i < monitor_nsc; i++) {
+		monitor_scs[i].ms_name = monitor_scds[i]->sd_name;
+		monitor_scs[i].ms_prev = monitor_scs[i].ms_calls;
+		monitor_scs[i].ms_calls = 0;
+		monitor_scs[i].ms_edges = 0;
+	}
+	edges = total = 0;
+	for (u_int f = 0; f < monitor_nfuzzers; f++) {
+		mf = &monitor_fuzzers[f];
+		calls = 0;
+		for (u_int t = 0; t < monitor_nthreads; t++) {
+			ss = stats_thread(f, t);
+			for (u_int i = 0; i < monitor_nsc; i++) {
+				calls += ss[i].ss_calls;
+				monitor_scs[i].ms_calls += ss[i].ss_calls;
+				monitor_scs[i].ms_edges += ss[i].ss_edges;
+				edges += ss[i].ss_edges;
+			}
+		}
+		mf->mf_rate = (calls - mf->mf_calls) * 1000000000 / elapsed;
+		if (calls != mf->mf_calls)
+			mf->mf_progress = now;
+		mf->mf_calls = calls;
+		total += mf->mf_rate;
+	}
+	monitor_edgerate = (edges - monitor_edges) * 1000000000 / elapsed;
+	monitor_edges = edges;
+	monitor_update_pools(elapsed);
+	for (u_int i = 0; i < monitor_nsc; i++)
+		monitor_scs[i].ms_rate = (monitor_scs[i].ms_calls -
+		    monitor_scs[i].ms_prev) * 1000000000 / elapsed;
+
+	busiest = xmalloc(monitor_nsc * sizeof(*busiest));
+	memcpy(busiest, monitor_scs, monitor_nsc * sizeof(*busiest));
+	qsort(busiest, monitor_nsc, sizeof(*busiest), monitor_sc_cmp);
+	if (monitor_mode == MONITOR_TOP)
+		monitor_print_top(pids, busiest, now, total);
+	else
+		monitor_print_log(pids, busiest, now, total);
+	fflush(stdout);
+	free(busiest);
+}
+
+static void
+monitor_print_top(const pid_t *pids, const struct monitor_sc *busiest,
+    uint64_t now, uint64_t total)
+{
+	struct monitor_fuzzer *mf;
+	uint64_t calls;
+
+	calls = 0;
+	for (u_int f = 0; f < monitor_nfuzzers; f++)
+		calls += monitor_fuzzers[f].mf_calls;
+
+	/* Home the cursor and clear the screen. */
+	printf("\033[H\033[2J");
+	printf("%s: %jus elapsed, %u fuzzers of %u thread%s, %ju calls/s, "
+	    "%ju calls\n", getprogname(),
+	    (uintmax_t)(now - monitor_start) / 1000000000, monitor_nfuzzers,
+	    monitor_nthreads, monitor_nthreads == 1 ? "" : "s",
+	    (uintmax_t)total, (uintmax_t)calls);
+	if (cov_enabled())
+		printf("%ju new edges/s, %ju edges\n",
+		    (uintmax_t)monitor_edgerate, (uintmax_t)monitor_edges);
+	printf("\n");
+
+	printf("%6s %7s %12s %14s  %s\n", "fuzzer", "pid", "calls/s", "calls",
+	    "state");
+	for (u_int f = 0; f < monitor_nfuzzers; f++) {
+		mf = &monitor_fuzzers[f];
+		if (pids[f] == -1) {
+			printf("%6u %7s %12s %14ju  exited\n", f, "-", "-",
+			    (uintmax_t)mf->mf_calls);
+			continue;
+		}
+		printf("%6u %7d %12ju %14ju  ", f, pids[f],
+		    (uintmax_t)mf->mf_rate, (uintmax_t)mf->mf_calls);
+		if (mf->mf_progress != now)
+			printf("stalled for %jus\n",
+			    (uintmax_t)(now - mf->mf_progress) / 1000000000);
+		else
+			printf("running\n");
+	}
+
+	printf("\nresource pool misses:");
+	for (int i = 0; i < AP_RES_NTYPES; i++)
+		printf(" %s %.1f%%", ap_res_name(i),
+		    100 * monitor_pools[i].mp_missed);
+	printf("\n");
+	if (monitor_stale != 0)
+		printf("%ju stale calls regenerated/s, %ju stale calls\n",
+		    (uintmax_t)monitor_stalerate, (uintmax_t)monitor_stale);
+
+	printf("\n%-20s %12s %7s", "syscall", "calls/s", "share");
+	if (cov_enabled())
+		printf(" %12s", "edges");
+	printf("\n");
+	for (u_int i = 0; i < min(monitor_nsc, MONITOR_TOPSC); i++) {
+		if (busiest[i].ms_rate == 0)
+			break;
+		printf("%-20s %12ju %6.1f%%", busiest[i].ms_name,
+		    (uintmax_t)busiest[i].ms_rate,
+		    100.0 * busiest[i].ms_rate / total);
+		if (cov_enabled())
+			printf(" %12ju", (uintmax_t)busiest[i].ms_edges);
+		printf("\n");
+	}
+}
+
+static void
+monitor_print_log(const pid_t *pids, const struct monitor_sc *busiest,
+    uint64_t now, uint64_t total)
+{
+	u_int missed, stalled;
+
+	printf("%s: %jus: ", getprogname(),
+	    (uintmax_t)(now - monitor_start) / 1000000000);
+	if (cov_enabled())
+		printf("%ju new edges/s; ", (uintmax_t)monitor_edgerate);
+	printf("%ju calls/s;", (uintmax_t)total);
+	for (u_int f = 0; f < monitor_nfuzzers; f++)
+		printf(" %ju", (uintmax_t)monitor_fuzzers[f].mf_rate);
+
+	stalled = 0;
+	for (u_int f = 0; f < monitor_nfuzzers; f++)
+		if (pids[f] != -1 && monitor_fuzzers[f].mf_progress != now)
+			printf(stalled++ == 0 ? "; stalled %u" : ",%u", f);
+	for (u_int i = 0; i < min(monitor_nsc, 3); i++) {
+		if (busiest[i].ms_rate == 0)
+			break;
+		printf("%s %s %.1f%%", i == 0 ? "; busiest" : "",
+		    busiest[i].ms_name,
+		    100.0 * busiest[i].ms_rate / total);
+	}
+	missed = 0;
+	for (int i = 0; i < AP_RES_NTYPES; i++) {
+		if (monitor_pools[i].mp_missed == 0)
+			continue;
+		printf("%s %s %.1f%%", missed++ == 0 ? "; pool misses" : "",
+		    ap_res_name(i), 100 * monitor_pools[i].mp_missed);
+	}
+	if (monitor_stalerate != 0)
+		printf("; %ju stale calls/s", (uintmax_t)monitor_stalerate);
+	printf("\n");
+}
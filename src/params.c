@@ -42,6 +42,7 @@ static void	init_defaults(void);
 
 static nvlist_t *g_params;
 static nvlist_t *g_descriptions;
+static nvlist_t *g_explicit;	/* parameters set on the command line */
 
 void
 params_init(char **args)
@@ -53,7 +54,8 @@ params_init(char **args)
 
 	g_params = nvlist_create(NV_FLAG_IGNORE_CASE);
 	g_descriptions = nvlist_create(NV_FLAG_IGNORE_CASE);
-	if (g_params == NULL || g_descriptions == NULL)
+	g_explicit = nvlist_create(NV_FLAG_IGNORE_CASE);
+	if (g_params == NULL || g_descriptions == NULL || g_explicit == NULL)
 		err(1, "nvlist_create failed");
 
 	init_defaults();
@@ -99,6 +101,8 @@ params_init(char **args)
 		if (nvlist_error(g_params) != 0)
 			errx(1, "couldn't set option '%s': %s", name,
 			    strerror(nvlist_error(g_params)));
+		if (!nvlist_exists_null(g_explicit, name))
+			nvlist_add_null(g_explicit, name);
 		free(*args);
 		args++;
 	}
@@ -133,13 +137,74 @@ params_dump()
 	}
 }
 
+/*
+ * Serialize the parameters in effect, so that a later run can pick them up with
+ * params_unpack(). The caller frees the returned buffer.
+ */
+void *
+params_pack(size_t *lenp)
+{
+	void *buf;
+
+	buf = nvlist_pack(g_params, lenp);
+	if (buf == NULL)
+		err(1, "nvlist_pack");
+	return (buf);
+}
+
+/*
+ * Override the parameters with those packed by params_pack(), except for ones
+ * given on the command line. Parameters that no longer exist, or have changed
+ * type, are ignored.
+ */
+void
+params_unpack(const void *buf, size_t len)
+{
+	nvlist_t *nvl;
+	const char *name;
+	void *cookie;
+	int type;
+
+	nvl = nvlist_unpack(buf, len, NV_FLAG_IGNORE_CASE);
+	if (nvl == NULL)
+		errx(1, "invalid packed parameters");
+
+	cookie = NULL;
+	while ((name = nvlist_next(nvl, &type, &cookie)) != NULL) {
+		if (!nvlist_exists_type(g_params, name, type) ||
+		    nvlist_exists_null(g_explicit, name))
+			continue;
+		switch (type) {
+		case NV_TYPE_BOOL:
+			nvlist_free_bool(g_params, name);
+			nvlist_add_bool(g_params, name,
+			    nvlist_get_bool(nvl, name));
+			break;
+		case NV_TYPE_NUMBER:
+			nvlist_free_number(g_params, name);
+			nvlist_add_number(g_params, name,
+			    nvlist_get_number(nvl, name));
+			break;
+		case NV_TYPE_STRING:
+			nvlist_free_string(g_params, name);
+			nvlist_add_string(g_params, name,
+			    nvlist_get_string(nvl, name));
+			break;
+		}
+	}
+	if (nvlist_error(g_params) != 0)
+		errx(1, "couldn't set options: %s",
+		    strerror(nvlist_error(g_params)));
+	nvlist_destroy(nvl);
+}
+
 bool
 param_flag(const char *name)
 {
 
 	if (!nvlist_exists_bool(g_params, name))
 		errx(1, "invalid option '%s'", name);
-	return (nvlist_get_string(g_params, name));
+	return (nvlist_get_bool(g_params, name));
 }
 
 uint64_t
@@ -160,15 +225,25 @@ param_string(const char *name)
 	return (nvlist_get_string(g_params, name));
 }
 
-static void
-init_defaults()
+/*
+ * Look up a string parameter that must be one of nchoices values, and return
+ * the index of the matching value.
+ */
+u_int
+param_choice(const char *name, const char * const *choices, u_int nchoices)
 {
-	char tmppath[PATH_MAX];
+	const char *val;
 
-	snprintf(tmppath, sizeof(tmppath), "%s", "/tmp/sysfuzz.XXXXXX");
-	if (mkdtemp(tmppath) == NULL)
-		err(1, "mkdtemp");
+	val = param_string(name);
+	for (u_int i = 0; i < nchoices; i++)
+		if (strcasecmp(val, choices[i]) == 0)
+			return (i);
+	errx(1, "invalid value '%s' for option '%s'", val, name);
+}
 
+static void
+init_defaults()
+{
 	struct {
 		const char *name;
 		const char *descr;
@@ -179,6 +254,85 @@ init_defaults()
 			bool flag;
 		};
 	} params[] = {
+	{
+		.name = "call-log",
+		.descr = "If set, each fuzzer thread logs the system calls it "
+		    "issues, with their arguments and return values, to a file "
+		    "named <call-log>.<pid>.<thread>. The log can be replayed "
+		    "with -r.",
+		.type = NV_TYPE_STRING,
+		.string = "",
+	},
+	{
+		.name = "call-log-sync",
+		.descr = "The number of calls between synchronous flushes of "
+		    "the call log to disk, so that it survives a panic. With "
+		    "0, the log is flushed asynchronously as it grows.",
+		.type = NV_TYPE_NUMBER,
+		.number = 0,
+	},
+	{
+		.name = "corpus",
+		.descr = "If set, a directory holding a corpus of short call "
+		    "sequences that did something new: found new coverage, "
+		    "failed with a new errno or took unusually long. Fuzzers "
+		    "add to it as they run, and replay it when they start.",
+		.type = NV_TYPE_STRING,
+		.string = "",
+	},
+	{
+		.name = "coverage",
+		.descr = "The source of kernel coverage used to guide call "
+		    "selection: \"none\", \"kcov\", which traces the kernel "
+		    "with kcov(4) and needs a kernel built with it, or "
+		    "\"synthetic\", a deterministic stand-in derived from each "
+		    "call's arguments and outcome, for testing the guidance "
+		    "without kcov.",
+		.type = NV_TYPE_STRING,
+		.string = "none",
+	},
+	{
+		.name = "executor",
+		.descr = "How system calls are issued: \"kernel\" issues them, "
+		    "\"null\" returns a plausible result without entering the "
+		    "kernel, to measure the cost of generating calls, and "
+		    "\"record\" does the same while logging the calls to "
+		    "call-log, for replay later.",
+		.type = NV_TYPE_STRING,
+		.string = "kernel",
+	},
+	{
+		.name = "fuzzer-respawn",
+		.descr = "Whether to replace fuzzers that die, other than by "
+		    "finishing their calls. A replacement is seeded with a "
+		    "fresh seed drawn from the original one. Use call-log to "
+		    "be able to reproduce its calls.",
+		.type = NV_TYPE_BOOL,
+		.flag = true,
+	},
+	{
+		.name = "fuzzer-timeout",
+		.descr = "The number of seconds a fuzzer may go without "
+		    "issuing a system call before it is considered stuck. A "
+		    "value of 0 disables the check.",
+		.type = NV_TYPE_NUMBER,
+		.number = 60,
+	},
+	{
+		.name = "fuzzer-timeout-action",
+		.descr = "What to do with a stuck fuzzer: \"warn\" only "
+		    "reports it, and \"kill\" also kills it with SIGKILL so "
+		    "that it can be respawned.",
+		.type = NV_TYPE_STRING,
+		.string = "kill",
+	},
+	{
+		.name = "hier-cache-size",
+		.descr = "The number of random file hierarchies to keep under "
+		    "hier-root for reuse by later runs.",
+		.type = NV_TYPE_NUMBER,
+		.number = 4,
+	},
 	{
 		.name = "hier-depth",
 		.descr = "Maximum file hierarchy depth.",
@@ -186,10 +340,20 @@ init_defaults()
 		.number = 4,
 	},
 	{
-		.name = "hier-max-fsize",
-		.descr = "Maximum file size for random file creation.",
+		.name = "hier-fill-mode",
+		.descr = "How to give files in the random file hierarchy their "
+		    "contents: \"sparse\" extends them with ftruncate(2), "
+		    "\"prealloc\" allocates blocks with posix_fallocate(2), "
+		    "and \"write\" writes zeroes.",
+		.type = NV_TYPE_STRING,
+		.string = "sparse",
+	},
+	{
+		.name = "hier-fill-threads",
+		.descr = "The number of threads used to fill in file contents "
+		    "when creating the random file hierarchy.",
 		.type = NV_TYPE_NUMBER,
-		.number = (1024 * 1024),
+		.number = ncpu(),
 	},
 	{
 		.name = "hier-max-files-per-dir",
@@ -197,6 +361,12 @@ init_defaults()
 		.type = NV_TYPE_NUMBER,
 		.number = 10,
 	},
+	{
+		.name = "hier-max-fsize",
+		.descr = "Maximum file size for random file creation.",
+		.type = NV_TYPE_NUMBER,
+		.number = (1024 * 1024),
+	},
 	{
 		.name = "hier-max-subdirs-per-dir",
 		.descr = "Maximum number of subdirectories per directory.",
@@ -205,9 +375,41 @@ init_defaults()
 	},
 	{
 		.name = "hier-root",
-		.descr = "The root directory for a random file hierarchy.",
+		.descr = "The directory under which random file hierarchies "
+		    "are created. Each is keyed by the seed and the hier-* "
+		    "parameters, and is reused by later runs with the same "
+		    "key.",
+		.type = NV_TYPE_STRING,
+		.string = "/tmp/sysfuzz",
+	},
+	{
+		.name = "latency-clock",
+		.descr = "The clock used to time system calls: \"tsc\" reads "
+		    "the CPU's timestamp counter, \"coarse\" uses "
+		    "CLOCK_MONOTONIC_FAST, which only advances once per tick, "
+		    "\"monotonic\" uses CLOCK_MONOTONIC, and \"none\" disables "
+		    "timing.",
 		.type = NV_TYPE_STRING,
-		.string = tmppath,
+#if defined(__amd64__) || defined(__i386__)
+		.string = "tsc",
+#else
+		.string = "monotonic",
+#endif
+	},
+	{
+		.name = "memblk-init-policy",
+		.descr = "How to construct the memblk pool: \"map\" maps each "
+		    "block separately, and \"carve\" maps a single region and "
+		    "carves blocks out of it, with a guard page between "
+		    "blocks.",
+		.type = NV_TYPE_STRING,
+		.string = "map",
+	},
+	{
+		.name = "memblk-max-size",
+		.descr = "The maximum number of pages in a memblk.",
+		.type = NV_TYPE_NUMBER,
+		.number = 16 * 1024,
 	},
 	{
 		.name = "memblk-page-count",
@@ -216,10 +418,54 @@ init_defaults()
 		.number = pagecnt() / (ncpu() * 4),
 	},
 	{
-		.name = "memblk-max-size",
-		.descr = "The maximum number of pages in a memblk.",
+		.name = "memblk-prefault",
+		.descr = "How to fault in memblks when constructing the pool: "
+		    "\"none\" leaves them untouched, \"touch\" writes to every "
+		    "page of about half of the blocks, \"populate\" writes to "
+		    "every page of every block, and \"willneed\" applies "
+		    "MADV_WILLNEED.",
+		.type = NV_TYPE_STRING,
+		.string = "touch",
+	},
+	{
+		.name = "minimize-check",
+		.descr = "A shell command run by -M after replaying each "
+		    "candidate sequence; a non-zero exit status counts as a "
+		    "failure.",
+		.type = NV_TYPE_STRING,
+		.string = "",
+	},
+	{
+		.name = "minimize-timeout",
+		.descr = "The number of seconds after which -M considers the "
+		    "replay of a candidate sequence to have hung, or 0 to wait "
+		    "forever. It must be longer than replaying the whole log "
+		    "takes.",
 		.type = NV_TYPE_NUMBER,
-		.number = 16 * 1024,
+		.number = 60,
+	},
+	{
+		.name = "minimize-workers",
+		.descr = "The number of candidate sequences -M replays at "
+		    "once.",
+		.type = NV_TYPE_NUMBER,
+		.number = ncpu(),
+	},
+	{
+		.name = "monitor",
+		.descr = "How to report the fuzzers' progress while they run: "
+		    "\"top\" redraws a live view of each fuzzer's throughput, "
+		    "the busiest system calls and any stalled fuzzers, \"log\" "
+		    "prints the same as a single line, and \"none\" disables "
+		    "monitoring.",
+		.type = NV_TYPE_STRING,
+		.string = "none",
+	},
+	{
+		.name = "monitor-interval",
+		.descr = "The number of milliseconds between monitor updates.",
+		.type = NV_TYPE_NUMBER,
+		.number = 1000,
 	},
 	{
 		.name = "num-fuzzers",
@@ -227,6 +473,68 @@ init_defaults()
 		.type = NV_TYPE_NUMBER,
 		.number = ncpu(),
 	},
+	{
+		.name = "pipeline-depth",
+		.descr = "The number of system calls each fuzzer generates "
+		    "ahead of issuing them. With a depth of 1, each call is "
+		    "issued as soon as its arguments have been generated.",
+		.type = NV_TYPE_NUMBER,
+		.number = 1,
+	},
+	{
+		.name = "placement",
+		.descr = "How to place fuzzers on CPUs: \"pin\" binds each "
+		    "fuzzer thread to its own CPU in order, \"spread\" binds "
+		    "fuzzers to CPUs in each memory domain in turn, \"pack\" "
+		    "binds them all to the CPUs of a single domain, and "
+		    "\"none\" leaves them to the scheduler. Each thread of a "
+		    "fuzzer gets its own CPU while there are enough. On NUMA "
+		    "systems, bound fuzzers allocate memory from their "
+		    "domain and rebuild their memblks there, and throughput "
+		    "is reported per domain.",
+		.type = NV_TYPE_STRING,
+		.string = "none",
+	},
+	{
+		.name = "respool-size",
+		.descr = "The number of sockets, pipe ends, kqueues, child "
+		    "processes and process descriptors kept ready for use as "
+		    "system call arguments by each fuzzer. A background thread "
+		    "refills each pool once it drops below half of this size.",
+		.type = NV_TYPE_NUMBER,
+		.number = 16,
+	},
+	{
+		.name = "rman-validate-interval",
+		.descr = "The number of resource pool operations between full "
+		    "consistency checks of the pool when built with "
+		    "INVARIANTS. Other operations only check the ranges they "
+		    "modify. A value of 0 disables periodic full checks; "
+		    "SIGUSR1 requests one at the next operation.",
+		.type = NV_TYPE_NUMBER,
+		.number = 10000,
+	},
+	{
+		.name = "sc-weights",
+		.descr = "Relative weights for picking system calls, as a "
+		    "comma-separated list of <name>:<weight> pairs, where each "
+		    "name is a system call or a system call group. A call's "
+		    "own weight overrides that of its groups, and unlisted "
+		    "calls have a weight of 1. A weight of 0 disables a call.",
+		.type = NV_TYPE_STRING,
+		.string = "",
+	},
+	{
+		.name = "threads-per-fuzzer",
+		.descr = "The number of threads issuing system calls in each "
+		    "fuzzer process. The threads share their process's address "
+		    "space and argument pools, so one may unmap or close what "
+		    "another is using; the memblk pool may briefly hold blocks "
+		    "that no longer exist. The call count given to -n applies "
+		    "to each thread.",
+		.type = NV_TYPE_NUMBER,
+		.number = 1,
+	},
 	};
 
 	for (u_int i = 0; i < nitems(params); i++) {
@@ -31,9 +31,12 @@
 
 void		params_init(char **);
 void		params_dump(void);
+void		*params_pack(size_t *);
+void		params_unpack(const void *, size_t);
 
 bool		param_flag(const char *);
 uint64_t	param_number(const char *);
 const char	*param_string(const char *);
+u_int		param_choice(const char *, const char * const *, u_int);
 
 #endif
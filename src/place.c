@@ -0,0 +1,250 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#include <sys/domainset.h>
+#include <sys/sysctl.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "params.h"
+#include "place.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * Policies for placing fuzzers on CPUs; see the placement parameter. Each
+ * thread of each fuzzer slot is assigned a CPU up front. After being forked, a
+ * fuzzer confines itself to its threads' CPUs and its slot's memory domain,
+ * and each of its threads then binds itself to its own CPU.
+ */
+enum place_policy {
+	PLACE_NONE,
+	PLACE_PIN,
+	PLACE_SPREAD,
+	PLACE_PACK,
+};
+
+static int	place_cpu_domain(int);
+
+static const char * const place_policies[] = {
+	[PLACE_NONE] =		"none",
+	[PLACE_PIN] =		"pin",
+	[PLACE_SPREAD] =	"spread",
+	[PLACE_PACK] =		"pack",
+};
+
+static enum place_policy place_policy;
+static int *place_cpus;		/* CPU of each thread of each fuzzer slot */
+static int *place_domains;	/* memory domain of each fuzzer slot */
+static u_int place_nfuzzers, place_nthreads;
+static int place_ndomains;	/* highest domain in use, plus one */
+static uint64_t place_start;
+
+/* Look up the memory domain of a CPU. Kernels without NUMA support have one. */
+static int
+place_cpu_domain(int cpu)
+{
+	char name[32];
+	size_t sz;
+	int domain;
+
+	(void)snprintf(name, sizeof(name), "dev.cpu.%d.%%domain", cpu);
+	sz = sizeof(domain);
+	if (sysctlbyname(name, &domain, &sz, NULL, 0) != 0)
+		return (0);
+	return (domain);
+}
+
+/*
+ * Assign CPUs to the nthreads threads of nfuzzers fuzzer slots from those we
+ * may run on. "pin" hands them out in order, "spread" takes each slot from
+ * each domain in turn, and "pack" uses only the CPUs in the first CPU's domain.
+ * A slot's threads get consecutive CPUs, and assignments wrap around once the
+ * CPUs run out.
+ */
+void
+place_init(u_int nfuzzers, u_int nthreads)
+{
+	cpuset_t mask;
+	int *dcpus[MAXMEMDOM], dncpus[MAXMEMDOM], used[MAXMEMDOM];
+	int *cpus, *domains, *tcpus, cpu, d, ncpus, nused;
+
+	place_policy = param_choice("placement", place_policies,
+	    nitems(place_policies));
+	place_start = nsecs();
+	if (place_policy == PLACE_NONE)
+		return;
+
+	/* Sort the CPUs available to us by domain. */
+	CPU_ZERO(&mask);
+	if (cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+	    sizeof(mask), &mask) != 0)
+		err(1, "cpuset_getaffinity");
+	memset(dncpus, 0, sizeof(dncpus));
+	for (d = 0; d < MAXMEMDOM; d++)
+		dcpus[d] = xmalloc(CPU_SETSIZE * sizeof(**dcpus));
+	cpus = xmalloc(CPU_SETSIZE * sizeof(*cpus));
+	domains = xmalloc(CPU_SETSIZE * sizeof(*domains));
+	ncpus = nused = 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &mask))
+			continue;
+		d = place_cpu_domain(cpu);
+		if (d < 0 || d >= MAXMEMDOM)
+			errx(1, "CPU %d has invalid domain %d", cpu, d);
+		if (dncpus[d] == 0)
+			used[nused++] = d;
+		dcpus[d][dncpus[d]++] = cpu;
+		cpus[ncpus] = cpu;
+		domains[ncpus++] = d;
+		place_ndomains = max(place_ndomains, d + 1);
+	}
+	if (ncpus == 0)
+		errx(1, "no CPUs available for placement");
+
+	place_nfuzzers = nfuzzers;
+	place_nthreads = nthreads;
+	place_cpus = xmalloc(nfuzzers * nthreads * sizeof(*place_cpus));
+	place_domains = xmalloc(nfuzzers * sizeof(*place_domains));
+	for (u_int i = 0; i < nfuzzers; i++) {
+		tcpus = &place_cpus[i * nthreads];
+		for (u_int t = 0; t < nthreads; t++) {
+			switch (place_policy) {
+			case PLACE_PIN:
+				d = domains[(i * nthreads) % ncpus];
+				tcpus[t] = cpus[(i * nthreads + t) % ncpus];
+				break;
+			case PLACE_SPREAD:
+				d = used[i % nused];
+				tcpus[t] = dcpus[d][((i / nused) * nthreads +
+				    t) % dncpus[d]];
+				break;
+			case PLACE_PACK:
+				d = used[0];
+				tcpus[t] = dcpus[d][(i * nthreads + t) %
+				    dncpus[d]];
+				break;
+			default:
+				errx(1, "unhandled placement policy %d",
+				    place_policy);
+			}
+		}
+		place_domains[i] = d;
+	}
+	for (d = 0; d < MAXMEMDOM; d++)
+		free(dcpus[d]);
+	free(cpus);
+	free(domains);
+
+	printf("%s: placing %u fuzzers with policy %s over %d CPUs in %d "
+	    "domain%s\n", getprogname(), nfuzzers,
+	    place_policies[place_policy], ncpus, nused,
+	    nused == 1 ? "" : "s");
+}
+
+/*
+ * Confine the calling fuzzer to its threads' CPUs, and have its memory
+ * allocated from its slot's domain when there is more than one. Returns true in
+ * the latter case, meaning that memory the parent allocated is likely to be
+ * remote. Threads inherit the process's mask, so each fuzzer thread must still
+ * call place_thread() to bind itself to its own CPU.
+ */
+bool
+place_fuzzer(u_int idx)
+{
+	cpuset_t mask;
+	domainset_t domains;
+
+	if (place_policy == PLACE_NONE)
+		return (false);
+
+	CPU_ZERO(&mask);
+	for (u_int t = 0; t < place_nthreads; t++)
+		CPU_SET(place_cpus[idx * place_nthreads + t], &mask);
+	if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+	    sizeof(mask), &mask) != 0)
+		err(1, "cpuset_setaffinity");
+	if (place_ndomains == 1)
+		return (false);
+
+	DOMAINSET_ZERO(&domains);
+	DOMAINSET_SET(place_domains[idx], &domains);
+	if (cpuset_setdomain(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+	    sizeof(domains), &domains, DOMAINSET_POLICY_PREFER) != 0)
+		err(1, "cpuset_setdomain");
+	return (true);
+}
+
+/* Bind the calling thread, thread tidx of fuzzer idx, to its own CPU. */
+void
+place_thread(u_int idx, u_int tidx)
+{
+	cpuset_t mask;
+
+	if (place_policy == PLACE_NONE)
+		return;
+
+	CPU_ZERO(&mask);
+	CPU_SET(place_cpus[idx * place_nthreads + tidx], &mask);
+	if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+	    sizeof(mask), &mask) != 0)
+		err(1, "cpuset_setaffinity");
+}
+
+/* Print the number of calls issued and the throughput of each domain. */
+void
+place_report(void)
+{
+	uint64_t *calls, elapsed;
+	u_int *nfuzzers;
+
+	if (place_policy == PLACE_NONE)
+		return;
+
+	calls = xmalloc(place_ndomains * sizeof(*calls));
+	memset(calls, 0, place_ndomains * sizeof(*calls));
+	nfuzzers = xmalloc(place_ndomains * sizeof(*nfuzzers));
+	memset(nfuzzers, 0, place_ndomains * sizeof(*nfuzzers));
+	for (u_int i = 0; i < place_nfuzzers; i++) {
+		calls[place_domains[i]] += stats_fuzzer_calls(i);
+		nfuzzers[place_domains[i]]++;
+	}
+	elapsed = max(nsecs() - place_start, 1);
+	for (int d = 0; d < place_ndomains; d++) {
+		if (nfuzzers[d] == 0)
+			continue;
+		printf("%s: domain %d: %u fuzzers, %ju calls, %.0f calls/s\n",
+		    getprogname(), d, nfuzzers[d], (uintmax_t)calls[d],
+		    calls[d] * 1e9 / elapsed);
+	}
+	free(nfuzzers);
+	free(calls);
+}
@@ -0,0 +1,93 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <string.h>
+
+#include "prng.h"
+
+__thread struct prng prng_thr;
+
+/*
+ * Expand a 64-bit seed into a full state using splitmix64, as recommended by
+ * the authors of xoshiro, so that similar seeds give unrelated states.
+ */
+void
+prng_seed(struct prng *p, uint64_t seed)
+{
+	uint64_t z;
+
+	for (int i = 0; i < 4; i++) {
+		z = (seed += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		p->s[i] = z ^ (z >> 31);
+	}
+}
+
+/*
+ * Advance the state by 2^128 steps.
+ */
+void
+prng_jump(struct prng *p)
+{
+	static const uint64_t jump[] = {
+		0x180ec6d33cfd0abaull, 0xd5a61266f0c9392cull,
+		0xa9582618e03fc9aaull, 0x39abdc4529b1661cull,
+	};
+	uint64_t s[4];
+
+	memset(s, 0, sizeof(s));
+	for (int i = 0; i < 4; i++)
+		for (int b = 0; b < 64; b++) {
+			if ((jump[i] & (1ull << b)) != 0)
+				for (int j = 0; j < 4; j++)
+					s[j] ^= p->s[j];
+			(void)prng_next(p);
+		}
+	memcpy(p->s, s, sizeof(s));
+}
+
+/*
+ * Fill a buffer with random bytes.
+ */
+void
+prng_fill(struct prng *p, void *buf, size_t len)
+{
+	uint64_t r;
+	char *cp;
+
+	cp = buf;
+	for (; len >= sizeof(r); len -= sizeof(r), cp += sizeof(r)) {
+		r = prng_next(p);
+		memcpy(cp, &r, sizeof(r));
+	}
+	if (len > 0) {
+		r = prng_next(p);
+		memcpy(cp, &r, len);
+	}
+}
@@ -0,0 +1,131 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PRNG_H_
+#define	_PRNG_H_
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/*
+ * xoshiro256**, a small, fast generator with 256 bits of explicit state.
+ * prng_jump() advances a state by 2^128 steps, so streams derived from one
+ * seed by successive jumps never overlap.
+ *
+ * Each thread has its own default state, prng_thr, which rnd() and
+ * rnd_range() use. A thread must seed it before use; an all-zero state only
+ * ever produces zeroes.
+ */
+struct prng {
+	uint64_t	s[4];
+};
+
+extern __thread struct prng prng_thr;
+
+void	prng_seed(struct prng *, uint64_t);
+void	prng_jump(struct prng *);
+void	prng_fill(struct prng *, void *, size_t);
+
+static inline uint64_t
+prng_rotl(uint64_t x, int k)
+{
+
+	return ((x << k) | (x >> (64 - k)));
+}
+
+static inline uint64_t
+prng_next(struct prng *p)
+{
+	uint64_t *s, res, t;
+
+	s = p->s;
+	res = prng_rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = prng_rotl(s[3], 45);
+	return (res);
+}
+
+/*
+ * Return a uniformly distributed value in [0, n), or 0 if n is 0. This uses
+ * Lemire's multiply-and-shift method, which needs a division only in the rare
+ * case that a draw must be rejected to avoid bias.
+ */
+static inline uint64_t
+prng_range(struct prng *p, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 m;
+	uint64_t l, t;
+
+	if (n == 0)
+		return (0);
+	m = (unsigned __int128)prng_next(p) * n;
+	l = (uint64_t)m;
+	if (l < n) {
+		t = -n % n;
+		while (l < t) {
+			m = (unsigned __int128)prng_next(p) * n;
+			l = (uint64_t)m;
+		}
+	}
+	return (m >> 64);
+#else
+	uint64_t r, t;
+
+	if (n == 0)
+		return (0);
+	/* Reject the draws that would make the low residues more likely. */
+	t = -n % n;
+	do {
+		r = prng_next(p);
+	} while (r < t);
+	return (r % n);
+#endif
+}
+
+/* Return a random 64-bit value from the calling thread's stream. */
+static inline uint64_t
+rnd(void)
+{
+
+	return (prng_next(&prng_thr));
+}
+
+/* Return a uniformly distributed value in [0, n) from the thread's stream. */
+static inline uint64_t
+rnd_range(uint64_t n)
+{
+
+	return (prng_range(&prng_thr, n));
+}
+
+#endif /* _PRNG_H_ */
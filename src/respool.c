@@ -0,0 +1,256 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "prng.h"
+#include "respool.h"
+#include "util.h"
+
+#define	RESPOOL_MAX	8
+
+/* Milliseconds the refill thread sleeps between passes if not woken up. */
+#define	RESPOOL_PERIOD	100
+
+static struct respool *respools[RESPOOL_MAX];
+static u_int nrespools;
+
+static pthread_t respool_thread;
+static pthread_mutex_t respool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t respool_cv = PTHREAD_COND_INITIALIZER;
+static bool respool_stopping;
+static atomic_bool respool_kicked;	/* a pool needs refilling */
+
+static void	respool_refill(struct respool *);
+static void	*respool_worker(void *);
+static void	respool_wakeup(struct respool *);
+
+/*
+ * Initialize an empty pool with "size" slots. fill is called from the refill
+ * thread to create resources and add them with respool_put(), and returns false
+ * if it couldn't create any; destroy is used to get rid of those still in the
+ * pool when it is torn down. Hits and misses are counted in stats, or in the
+ * pool itself if stats is NULL.
+ */
+void
+respool_init(struct respool *rp, const char *name, u_int size,
+    bool (*fill)(struct respool *), void (*destroy)(int),
+    struct respool_stats *stats)
+{
+
+	if (nrespools == RESPOOL_MAX)
+		errx(1, "too many resource pools");
+
+	rp->rp_name = name;
+	rp->rp_fill = fill;
+	rp->rp_destroy = destroy;
+	rp->rp_size = max(size, 1);
+	rp->rp_lowat = max(rp->rp_size / 2, 1);
+	rp->rp_slots = xmalloc(rp->rp_size * sizeof(*rp->rp_slots));
+	for (u_int i = 0; i < rp->rp_size; i++)
+		atomic_init(&rp->rp_slots[i], -1);
+	atomic_init(&rp->rp_count, 0);
+	if (stats == NULL) {
+		stats = &rp->rp_ownstats;
+		atomic_init(&stats->rs_hits, 0);
+		atomic_init(&stats->rs_misses, 0);
+	}
+	rp->rp_stats = stats;
+	respools[nrespools++] = rp;
+}
+
+/*
+ * Destroy the resources left in a pool. The refill thread must be stopped.
+ */
+void
+respool_fini(struct respool *rp)
+{
+	int val;
+
+	for (u_int i = 0; i < rp->rp_size; i++) {
+		val = atomic_load(&rp->rp_slots[i]);
+		if (val >= 0)
+			rp->rp_destroy(val);
+	}
+	free(rp->rp_slots);
+	rp->rp_slots = NULL;
+	for (u_int i = 0; i < nrespools; i++)
+		if (respools[i] == rp) {
+			respools[i] = respools[--nrespools];
+			break;
+		}
+}
+
+/*
+ * Add a resource to the pool. Returns false if the pool is full, in which case
+ * the caller still owns the resource.
+ */
+bool
+respool_put(struct respool *rp, int val)
+{
+	int empty;
+
+	for (u_int i = 0; i < rp->rp_size; i++) {
+		empty = -1;
+		if (atomic_compare_exchange_strong(&rp->rp_slots[i], &empty,
+		    val)) {
+			atomic_fetch_add(&rp->rp_count, 1);
+			return (true);
+		}
+	}
+	return (false);
+}
+
+/*
+ * Pick a resource from the pool without removing it, or return -1 if the pool
+ * is empty.
+ */
+int
+respool_select(struct respool *rp)
+{
+	u_int i;
+	int val;
+
+	i = rnd_range(rp->rp_size);
+	for (u_int n = 0; n < rp->rp_size; n++) {
+		val = atomic_load(&rp->rp_slots[i]);
+		if (val >= 0) {
+			atomic_fetch_add_explicit(&rp->rp_stats->rs_hits, 1,
+			    memory_order_relaxed);
+			return (val);
+		}
+		if (++i == rp->rp_size)
+			i = 0;
+	}
+	atomic_fetch_add_explicit(&rp->rp_stats->rs_misses, 1,
+	    memory_order_relaxed);
+	respool_wakeup(rp);
+	return (-1);
+}
+
+/*
+ * Forget about a resource that the fuzzer has destroyed. Returns false if it
+ * wasn't in the pool.
+ */
+bool
+respool_release(struct respool *rp, int val)
+{
+	int cur;
+
+	for (u_int i = 0; i < rp->rp_size; i++) {
+		cur = val;
+		if (atomic_compare_exchange_strong(&rp->rp_slots[i], &cur,
+		    -1)) {
+			atomic_fetch_sub(&rp->rp_count, 1);
+			respool_wakeup(rp);
+			return (true);
+		}
+	}
+	return (false);
+}
+
+/*
+ * Wake up the refill thread if the pool is running low. The flag keeps the
+ * fuzzer from taking the lock more than once per refill pass.
+ */
+static void
+respool_wakeup(struct respool *rp)
+{
+
+	if (atomic_load(&rp->rp_count) >= rp->rp_lowat ||
+	    atomic_exchange(&respool_kicked, true))
+		return;
+	pthread_mutex_lock(&respool_lock);
+	pthread_cond_signal(&respool_cv);
+	pthread_mutex_unlock(&respool_lock);
+}
+
+static void
+respool_refill(struct respool *rp)
+{
+
+	/* Give up until the next pass if we can't create any more. */
+	while (atomic_load(&rp->rp_count) < rp->rp_size && rp->rp_fill(rp))
+		;
+}
+
+static void *
+respool_worker(void *arg __unused)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&respool_lock);
+	while (!respool_stopping) {
+		pthread_mutex_unlock(&respool_lock);
+		atomic_store(&respool_kicked, false);
+		for (u_int i = 0; i < nrespools; i++)
+			respool_refill(respools[i]);
+		pthread_mutex_lock(&respool_lock);
+		if (respool_stopping || atomic_load(&respool_kicked))
+			continue;
+
+		(void)clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += RESPOOL_PERIOD * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		(void)pthread_cond_timedwait(&respool_cv, &respool_lock, &ts);
+	}
+	pthread_mutex_unlock(&respool_lock);
+	return (NULL);
+}
+
+/*
+ * Start the refill thread. Pools start out empty and are filled in the
+ * background, so this returns immediately.
+ */
+void
+respool_start(void)
+{
+	int error;
+
+	respool_stopping = false;
+	error = pthread_create(&respool_thread, NULL, respool_worker, NULL);
+	if (error != 0)
+		errc(1, error, "pthread_create");
+}
+
+void
+respool_stop(void)
+{
+
+	pthread_mutex_lock(&respool_lock);
+	respool_stopping = true;
+	pthread_cond_signal(&respool_cv);
+	pthread_mutex_unlock(&respool_lock);
+	(void)pthread_join(respool_thread, NULL);
+}
@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _RESPOOL_H_
+#define	_RESPOOL_H_
+
+#include <sys/types.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/*
+ * A pool of kernel resources, such as descriptors or child processes, that is
+ * kept topped up by a background thread. Fuzzer threads pick resources with
+ * respool_select() and give back the ones they destroy with respool_release();
+ * neither call ever creates a resource, so the fuzzer doesn't stall when the
+ * pool runs low. A select that finds the pool empty counts as a miss.
+ *
+ * Each resource occupies a slot holding its value, or -1 if the slot is free.
+ * Only the refill thread fills slots, and only fuzzer threads empty them.
+ */
+
+/* A pool's counters, which may live in memory shared with other processes. */
+struct respool_stats {
+	atomic_ulong	rs_hits;
+	atomic_ulong	rs_misses;
+};
+
+struct respool {
+	const char	*rp_name;
+	bool		(*rp_fill)(struct respool *); /* create resources */
+	void		(*rp_destroy)(int);	/* destroy a resource */
+	atomic_int	*rp_slots;
+	u_int		rp_size;	/* number of slots */
+	u_int		rp_lowat;	/* wake the refill thread below this */
+	atomic_uint	rp_count;	/* number of full slots */
+	struct respool_stats *rp_stats;
+	struct respool_stats rp_ownstats; /* unless given others */
+};
+
+void	respool_init(struct respool *, const char *, u_int,
+	    bool (*)(struct respool *), void (*)(int), struct respool_stats *);
+void	respool_fini(struct respool *);
+bool	respool_put(struct respool *, int);
+int	respool_select(struct respool *);
+bool	respool_release(struct respool *, int);
+
+void	respool_start(void);
+void	respool_stop(void);
+
+#endif /* _RESPOOL_H_ */
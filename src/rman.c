@@ -25,21 +25,76 @@
  */
 
 #include <sys/param.h>
+#include <sys/mman.h>
 
 #include <assert.h>
+#include <err.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <strings.h>
 
+#include "prng.h"
 #include "rman.h"
 #include "util.h"
 
+/*
+ * Resource nodes are allocated from slabs mapped directly with mmap(2). This
+ * keeps the hot add/release paths out of malloc(3), and keeps rman metadata
+ * in mappings of its own rather than interleaved with the heap.
+ */
+#define	RMAN_SLAB_SIZE	(64 * 1024)
+
+struct rman_slab {
+	struct rman_slab *rs_next;
+	struct resource	rs_nodes[];
+};
+
+#define	RMAN_SLAB_NODES							\
+	((RMAN_SLAB_SIZE - sizeof(struct rman_slab)) / sizeof(struct resource))
+
+/*
+ * The block size is widened before computing masks, since ~(blksz - 1) as a
+ * u_int would clear the upper half of 64-bit addresses.
+ */
 #define	rman_adjust(start, len) do {				\
-	len += start - (start & ~(rman->rm_blksz - 1));		\
-	start = start & ~(rman->rm_blksz - 1);			\
-	len = roundup2(len, rman->rm_blksz);			\
+	u_long _blksz = rman->rm_blksz;				\
+								\
+	len += start - rounddown2(start, _blksz);		\
+	start = rounddown2(start, _blksz);			\
+	len = roundup2(len, _blksz);				\
 } while (0)
 
-static void	rman_validate(struct rman *rman);
+#define	res_end(res)	((res)->r_start + (res)->r_len)
+#define	res_height(res)	((res) != NULL ? (res)->r_height : 0)
+#define	res_nodes(res)	((res) != NULL ? (res)->r_nodes : 0)
+#define	res_sublen(res)	((res) != NULL ? (res)->r_sublen : 0)
+
+static struct resource *res_alloc(struct rman *);
+static void	res_free(struct rman *, struct resource *);
+static struct resource *res_first(struct rman *);
+static struct resource *res_lookup(struct rman *, u_long);
+static struct resource *res_next(struct resource *);
+static struct resource *res_select(struct rman *, int);
+static struct resource *res_select_chunk(struct rman *, int, u_long *);
+static struct resource *res_select_off(struct rman *, u_long *);
+static void	res_insert(struct rman *, struct resource *);
+static void	res_rebalance(struct rman *, struct resource *);
+static void	res_remove(struct rman *, struct resource *);
+static void	res_replace(struct rman *, struct resource *,
+		    struct resource *, struct resource *);
+static struct resource *res_rotate_left(struct rman *, struct resource *);
+static struct resource *res_rotate_right(struct rman *, struct resource *);
+static u_long	res_chunks(struct rman *, struct resource *, int);
+static void	res_update(struct rman *, struct resource *);
+static void	rman_validate(struct rman *, u_long);
+
+#ifdef INVARIANTS
+/*
+ * Bumped to request a full validation of every rman at its next operation.
+ */
+static volatile sig_atomic_t rman_validate_gen;
+#endif
 
 int
 rman_init(struct rman *rman, u_int blksz, rman_pool_init initcb)
@@ -48,23 +103,53 @@ rman_init(struct rman *rman, u_int blksz, rman_pool_init initcb)
 	if (__bitcount(blksz) != 1)
 		/* blksz must be a power of two. */
 		return (1);
-	TAILQ_INIT(&rman->rm_res);
+	rman->rm_root = NULL;
 	rman->rm_blksz = blksz;
 	rman->rm_entries = 0;
+	rman->rm_policy = RMAN_SELECT_BLOCK;
+	rman->rm_nalign = 0;
+	rman->rm_slabs = NULL;
+	rman->rm_free = NULL;
+	rman->rm_nslabs = rman->rm_nodes = rman->rm_nodes_hwm = 0;
+	rman->rm_vinterval = 1;
+	rman->rm_vops = 0;
+#ifdef INVARIANTS
+	rman->rm_vgen = rman_validate_gen;
+#endif
 	if (initcb != NULL)
 		return (initcb(rman));
 	return (0);
 }
 
 /*
- * Insert the resource range [start, start+len) into the list, coalescing
+ * Release all ranges and the memory backing them.
+ */
+void
+rman_fini(struct rman *rman)
+{
+	struct rman_slab *slab;
+
+	while ((slab = rman->rm_slabs) != NULL) {
+		rman->rm_slabs = slab->rs_next;
+		if (munmap(slab, RMAN_SLAB_SIZE) != 0)
+			err(1, "munmap");
+	}
+	rman->rm_root = NULL;
+	rman->rm_free = NULL;
+	rman->rm_entries = 0;
+	rman->rm_nslabs = rman->rm_nodes = 0;
+}
+
+/*
+ * Insert the resource range [start, start+len) into the tree, coalescing
  * entries if needed. start+len must be at most ULONG_MAX; in particular, a
  * range cannot contain ULONG_MAX.
  */
 void
 rman_add(struct rman *rman, u_long start, u_long len)
 {
-	struct resource *nres, *res, *next;
+	struct resource *res, *next;
+	u_long end;
 
 	assert(ULONG_MAX - start >= len);
 
@@ -72,55 +157,54 @@ rman_add(struct rman *rman, u_long start, u_long len)
 		return;
 
 	rman_adjust(start, len);
+	end = start + len;
 
-	TAILQ_FOREACH(res, &rman->rm_res, r_next) {
-		if (start > res->r_start + res->r_len)
-			continue;
-
-		/* We need to add a new resource record. */
-		if (start + len < res->r_start)
-			break;
-
-		/* The new range and the current range overlap. */
-		res->r_start = min(start, res->r_start);
-		if (start <= res->r_start)
-			res->r_len += res->r_start - start;
-		else
-			len += start - res->r_start;
-		res->r_len = max(res->r_len, len);
-		assert(res->r_len > 0);
-
-		/* Coalesce adjacent overlapping ranges. */
-		while ((next = TAILQ_NEXT(res, r_next)) != NULL &&
-		    next->r_start <= res->r_start + res->r_len) {
-			next->r_len += next->r_start - res->r_start;
-			res->r_len = max(next->r_len, res->r_len);
-			TAILQ_REMOVE(&rman->rm_res, next, r_next);
-			free(next);
-			rman->rm_entries--;
+	/*
+	 * Find the range that the new one overlaps or abuts, if any. Only the
+	 * last range starting at or before start and the one following it are
+	 * candidates; anything further right is handled by the coalescing loop
+	 * below.
+	 */
+	res = res_lookup(rman, start);
+	if (res != NULL && res_end(res) >= start) {
+		res->r_len = max(res_end(res), end) - res->r_start;
+		res_rebalance(rman, res);
+	} else {
+		res = res != NULL ? res_next(res) : res_first(rman);
+		if (res != NULL && res->r_start <= end) {
+			/* Extending the range downwards preserves ordering. */
+			res->r_len = max(res_end(res), end) - start;
+			res->r_start = start;
+			res_rebalance(rman, res);
+		} else {
+			res = res_alloc(rman);
+			res->r_start = start;
+			res->r_len = len;
+			res_insert(rman, res);
+			rman->rm_entries++;
 		}
-		assert(res->r_len > 0);
-		goto done;
 	}
+	assert(res->r_len > 0);
 
-	nres = xmalloc(sizeof(*nres));
-	nres->r_start = start;
-	nres->r_len = len;
-	rman->rm_entries++;
-	if (res != NULL)
-		TAILQ_INSERT_BEFORE(res, nres, r_next);
-	else
-		TAILQ_INSERT_TAIL(&rman->rm_res, nres, r_next);
+	/* Coalesce adjacent overlapping ranges. */
+	while ((next = res_next(res)) != NULL &&
+	    next->r_start <= res_end(res)) {
+		res->r_len = max(res_end(res), res_end(next)) - res->r_start;
+		res_remove(rman, next);
+		res_free(rman, next);
+		rman->rm_entries--;
+		res_rebalance(rman, res);
+	}
+	assert(res->r_len > 0);
 
-	assert(nres->r_len > 0);
-done:
-	rman_validate(rman);
+	rman_validate(rman, res->r_start);
 }
 
 /*
  * Return a random resource range from the pool without removing it. The range
  * length must be a multiple of the rman blksz and must be at most
- * blksz * maxblks if maxblks is greater than 0.
+ * blksz * maxblks if maxblks is greater than 0. The way the starting block is
+ * chosen depends on the rman's selection policy.
  *
  * The return value is non-zero if no resources are available.
  */
@@ -128,34 +212,81 @@ int
 rman_select(struct rman *rman, u_long *start, u_long *len, u_int maxblks)
 {
 	struct resource *res;
-	u_int blks;
-	int interval;
+	u_long blks, off;
 
 	if (rman->rm_entries == 0) {
 		*start = *len = 0;
 		return (1);
 	}
 
-	interval = (random() % rman->rm_entries);
-	TAILQ_FOREACH(res, &rman->rm_res, r_next) {
-		if (interval-- > 0)
-			continue;
+	switch (rman->rm_policy) {
+	case RMAN_SELECT_BLOCK:
+		off = rnd_range(rman->rm_root->r_sublen / rman->rm_blksz) *
+		    rman->rm_blksz;
+		res = res_select_off(rman, &off);
+		*start = res->r_start + off;
+		break;
+	case RMAN_SELECT_RANGE:
+		res = res_select(rman, rnd_range(rman->rm_entries));
 		blks = res->r_len / rman->rm_blksz;
-
 		assert(blks > 0);
-		*start = (random() % blks) * rman->rm_blksz + res->r_start;
-		blks -= (*start - res->r_start) / rman->rm_blksz;
-		if (maxblks > 0 && blks > maxblks)
-			blks = maxblks;
-		*len = ((random() % blks) + 1) * rman->rm_blksz;
+		*start = rnd_range(blks) * rman->rm_blksz + res->r_start;
 		break;
+	default:
+		abort();
 	}
-	assert(interval == -1);
+
+	blks = (res_end(res) - *start) / rman->rm_blksz;
+	assert(blks > 0);
+	if (maxblks > 0 && blks > maxblks)
+		blks = maxblks;
+	*len = (rnd_range(blks) + 1) * rman->rm_blksz;
+
 	assert(*len % rman->rm_blksz == 0);
 	assert(ULONG_MAX - *start >= *len);
 	return (0);
 }
 
+/*
+ * Return a random range from the pool whose start address and length are both
+ * multiples of blksz << order. The range is made up of between 1 and maxchunks
+ * such chunks, or any number of them if maxchunks is 0, and its first chunk
+ * is picked uniformly from all aligned chunks in the pool. The order must have
+ * been registered with rman_track_align().
+ *
+ * The return value is non-zero if no aligned chunks are available.
+ */
+int
+rman_select_aligned(struct rman *rman, u_int order, u_long *start, u_long *len,
+    u_int maxchunks)
+{
+	struct resource *res;
+	u_long chunks, csz, idx;
+	int i;
+
+	*start = *len = 0;
+	for (i = 0; i < rman->rm_nalign; i++)
+		if (rman->rm_align[i] == order)
+			break;
+	if (i == rman->rm_nalign || rman->rm_root == NULL ||
+	    rman->rm_root->r_subchunks[i] == 0)
+		return (1);
+
+	csz = (u_long)rman->rm_blksz << order;
+	idx = rnd_range(rman->rm_root->r_subchunks[i]);
+	res = res_select_chunk(rman, i, &idx);
+	*start = roundup2(res->r_start, csz) + idx * csz;
+
+	chunks = res_chunks(rman, res, i) - idx;
+	assert(chunks > 0);
+	if (maxchunks > 0 && chunks > maxchunks)
+		chunks = maxchunks;
+	*len = (rnd_range(chunks) + 1) * csz;
+
+	assert(*start >= res->r_start && *start + *len <= res_end(res));
+	return (0);
+}
+
 /*
  * Remove the specified resource range. The range must be present.
  */
@@ -168,64 +299,567 @@ rman_release(struct rman *rman, u_long start, u_long len)
 
 	rman_adjust(start, len);
 
-	TAILQ_FOREACH(res, &rman->rm_res, r_next) {
-		assert(start >= res->r_start);
-		if (start > res->r_start + res->r_len)
-			continue;
-
-		assert(res->r_len >= len);
-		if (start == res->r_start ||
-		    start + len == res->r_start + res->r_len) {
-			/* We just need to trim an existing range. */
-			if (start == res->r_start)
-				res->r_start = start + len;
-			res->r_len -= len;
-			if (res->r_len == 0) {
-				TAILQ_REMOVE(&rman->rm_res, res, r_next);
-				free(res);
-				rman->rm_entries--;
-			}
+	res = res_lookup(rman, start);
+	assert(res != NULL);
+	assert(start + len <= res_end(res));
+
+	if (start == res->r_start || start + len == res_end(res)) {
+		/* We just need to trim an existing range. */
+		if (start == res->r_start)
+			res->r_start = start + len;
+		res->r_len -= len;
+		if (res->r_len == 0) {
+			res_remove(rman, res);
+			res_free(rman, res);
+			rman->rm_entries--;
+		} else
+			res_rebalance(rman, res);
+	} else {
+		/* An existing range is getting split into two. */
+		nres = res_alloc(rman);
+		nres->r_start = start + len;
+		nres->r_len = res_end(res) - nres->r_start;
+		assert(nres->r_len > 0);
+		res->r_len = start - res->r_start;
+		res_rebalance(rman, res);
+		res_insert(rman, nres);
+		rman->rm_entries++;
+	}
+	rman_validate(rman, start);
+}
+
+/*
+ * Remove whichever parts of the specified range are present, and return their
+ * total length. Unlike with rman_release(), the range may be only partially
+ * present, or span several ranges.
+ */
+u_long
+rman_release_overlap(struct rman *rman, u_long start, u_long len)
+{
+	struct resource *res;
+	u_long end, released, rend, rstart;
+
+	assert(ULONG_MAX - start >= len);
+
+	released = 0;
+	if (len == 0)
+		return (released);
+	rman_adjust(start, len);
+	end = start + len;
+
+	while (start < end) {
+		res = res_lookup(rman, start);
+		if (res == NULL || res_end(res) <= start)
+			res = res != NULL ? res_next(res) : res_first(rman);
+		if (res == NULL || res->r_start >= end)
+			break;
+		rstart = max(start, res->r_start);
+		rend = min(end, res_end(res));
+		rman_release(rman, rstart, rend - rstart);
+		released += rend - rstart;
+		start = rend;
+	}
+	return (released);
+}
+
+void
+rman_set_policy(struct rman *rman, enum rman_policy policy)
+{
+
+	rman->rm_policy = policy;
+}
+
+/*
+ * Start tracking the number of available chunks of blksz << order bytes
+ * aligned to their size, so that they can be picked with
+ * rman_select_aligned(). This must be done while the pool is empty, and at
+ * most RMAN_MAXALIGN orders can be tracked. Returns non-zero on failure.
+ */
+int
+rman_track_align(struct rman *rman, u_int order)
+{
+
+	if (rman->rm_entries != 0 || rman->rm_nalign == RMAN_MAXALIGN ||
+	    order >= sizeof(u_long) * NBBY - (u_int)ffs(rman->rm_blksz))
+		return (1);
+	rman->rm_align[rman->rm_nalign++] = order;
+	return (0);
+}
+
+/*
+ * Set how often a full consistency check of the pool is performed when the
+ * rman is compiled with INVARIANTS: every interval operations, or never if
+ * interval is 0. Operations in between only check the ranges they touched.
+ */
+void
+rman_set_validate(struct rman *rman, u_int interval)
+{
+
+	rman->rm_vinterval = interval;
+}
+
+void
+rman_stats(struct rman *rman, struct rman_stats *stats)
+{
+
+	stats->rs_entries = rman->rm_entries;
+	stats->rs_length = res_sublen(rman->rm_root);
+	stats->rs_nodes = rman->rm_nodes;
+	stats->rs_nodes_hwm = rman->rm_nodes_hwm;
+	stats->rs_slabs = rman->rm_nslabs;
+	stats->rs_slabmem = (size_t)rman->rm_nslabs * RMAN_SLAB_SIZE;
+}
+
+/*
+ * Take a node from the rman's freelist, mapping a new slab if it is empty.
+ */
+static struct resource *
+res_alloc(struct rman *rman)
+{
+	struct rman_slab *slab;
+	struct resource *res;
+
+	if (rman->rm_free == NULL) {
+		slab = mmap(NULL, RMAN_SLAB_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE, -1, 0);
+		if (slab == MAP_FAILED)
+			err(1, "mmap");
+		slab->rs_next = rman->rm_slabs;
+		rman->rm_slabs = slab;
+		rman->rm_nslabs++;
+		for (size_t i = RMAN_SLAB_NODES; i > 0; i--) {
+			res = &slab->rs_nodes[i - 1];
+			res->r_right = rman->rm_free;
+			rman->rm_free = res;
+		}
+	}
+
+	res = rman->rm_free;
+	rman->rm_free = res->r_right;
+	if (++rman->rm_nodes > rman->rm_nodes_hwm)
+		rman->rm_nodes_hwm = rman->rm_nodes;
+	return (res);
+}
+
+static void
+res_free(struct rman *rman, struct resource *res)
+{
+
+	assert(rman->rm_nodes > 0);
+	res->r_right = rman->rm_free;
+	rman->rm_free = res;
+	rman->rm_nodes--;
+}
+
+/*
+ * Return the number of naturally aligned chunks of the ith tracked order
+ * contained in a range.
+ */
+static u_long
+res_chunks(struct rman *rman, struct resource *res, int i)
+{
+	u_long csz, end, start;
+
+	csz = (u_long)rman->rm_blksz << rman->rm_align[i];
+	if (res->r_start > ULONG_MAX - csz)
+		return (0);
+	start = roundup2(res->r_start, csz);
+	end = rounddown2(res_end(res), csz);
+	return (end > start ? (end - start) / csz : 0);
+}
+
+#define	res_subchunks(res, i)	((res) != NULL ? (res)->r_subchunks[i] : 0)
+
+/*
+ * Recompute the cached subtree fields of a node from those of its children.
+ */
+static void
+res_update(struct rman *rman, struct resource *res)
+{
+
+	res->r_height = max(res_height(res->r_left),
+	    res_height(res->r_right)) + 1;
+	res->r_nodes = res_nodes(res->r_left) + res_nodes(res->r_right) + 1;
+	res->r_sublen = res_sublen(res->r_left) + res_sublen(res->r_right) +
+	    res->r_len;
+	for (int i = 0; i < rman->rm_nalign; i++)
+		res->r_subchunks[i] = res_subchunks(res->r_left, i) +
+		    res_subchunks(res->r_right, i) + res_chunks(rman, res, i);
+}
+
+static struct resource *
+res_first(struct rman *rman)
+{
+	struct resource *res;
+
+	if ((res = rman->rm_root) == NULL)
+		return (NULL);
+	while (res->r_left != NULL)
+		res = res->r_left;
+	return (res);
+}
+
+static struct resource *
+res_next(struct resource *res)
+{
+	struct resource *parent;
+
+	if (res->r_right != NULL) {
+		res = res->r_right;
+		while (res->r_left != NULL)
+			res = res->r_left;
+		return (res);
+	}
+	while ((parent = res->r_parent) != NULL && parent->r_right == res)
+		res = parent;
+	return (parent);
+}
+
+/*
+ * Return the range with the largest start address not exceeding addr, or NULL
+ * if there is no such range.
+ */
+static struct resource *
+res_lookup(struct rman *rman, u_long addr)
+{
+	struct resource *res, *best;
+
+	best = NULL;
+	res = rman->rm_root;
+	while (res != NULL) {
+		if (res->r_start <= addr) {
+			best = res;
+			res = res->r_right;
+		} else
+			res = res->r_left;
+	}
+	return (best);
+}
+
+/*
+ * Return the range with the given index, counting from zero in address order.
+ */
+static struct resource *
+res_select(struct rman *rman, int idx)
+{
+	struct resource *res;
+	int lnodes;
+
+	assert(idx >= 0 && idx < rman->rm_entries);
+
+	res = rman->rm_root;
+	for (;;) {
+		lnodes = res_nodes(res->r_left);
+		if (idx < lnodes)
+			res = res->r_left;
+		else if (idx > lnodes) {
+			idx -= lnodes + 1;
+			res = res->r_right;
+		} else
+			return (res);
+	}
+}
+
+/*
+ * Return the range containing the byte at offset *off, where offsets are
+ * counted across all ranges in address order as if they were contiguous. On
+ * return *off is the offset of that byte within the range.
+ */
+static struct resource *
+res_select_off(struct rman *rman, u_long *off)
+{
+	struct resource *res;
+	u_long llen;
+
+	assert(*off < res_sublen(rman->rm_root));
+
+	res = rman->rm_root;
+	for (;;) {
+		llen = res_sublen(res->r_left);
+		if (*off < llen)
+			res = res->r_left;
+		else if (*off - llen < res->r_len) {
+			*off -= llen;
+			return (res);
 		} else {
-			/* An existing range is getting split into two. */
-			nres = xmalloc(sizeof(*nres));
-			nres->r_start = start + len;
-			nres->r_len = res->r_len - len - (start - res->r_start);
-			assert(nres->r_len > 0);
-			rman->rm_entries++;
-			TAILQ_INSERT_AFTER(&rman->rm_res, res, nres, r_next);
+			*off -= llen + res->r_len;
+			res = res->r_right;
+		}
+	}
+}
+
+/*
+ * Like res_select_off(), but counting aligned chunks of the ith tracked order
+ * rather than bytes.
+ */
+static struct resource *
+res_select_chunk(struct rman *rman, int i, u_long *idx)
+{
+	struct resource *res;
+	u_long lchunks, nchunks;
+
+	assert(*idx < res_subchunks(rman->rm_root, i));
 
-			res->r_len = start - res->r_start;
+	res = rman->rm_root;
+	for (;;) {
+		lchunks = res_subchunks(res->r_left, i);
+		nchunks = res_chunks(rman, res, i);
+		if (*idx < lchunks)
+			res = res->r_left;
+		else if (*idx - lchunks < nchunks) {
+			*idx -= lchunks;
+			return (res);
+		} else {
+			*idx -= lchunks + nchunks;
+			res = res->r_right;
 		}
-		break;
 	}
-	assert(res != NULL);
-	rman_validate(rman);
+}
+
+/*
+ * Make new take the place of old as a child of parent.
+ */
+static void
+res_replace(struct rman *rman, struct resource *parent, struct resource *old,
+    struct resource *new)
+{
+
+	if (parent == NULL)
+		rman->rm_root = new;
+	else if (parent->r_left == old)
+		parent->r_left = new;
+	else
+		parent->r_right = new;
+	if (new != NULL)
+		new->r_parent = parent;
+}
+
+static struct resource *
+res_rotate_left(struct rman *rman, struct resource *res)
+{
+	struct resource *pivot;
+
+	pivot = res->r_right;
+	res_replace(rman, res->r_parent, res, pivot);
+	res->r_right = pivot->r_left;
+	if (res->r_right != NULL)
+		res->r_right->r_parent = res;
+	pivot->r_left = res;
+	res->r_parent = pivot;
+	res_update(rman, res);
+	res_update(rman, pivot);
+	return (pivot);
+}
+
+static struct resource *
+res_rotate_right(struct rman *rman, struct resource *res)
+{
+	struct resource *pivot;
+
+	pivot = res->r_left;
+	res_replace(rman, res->r_parent, res, pivot);
+	res->r_left = pivot->r_right;
+	if (res->r_left != NULL)
+		res->r_left->r_parent = res;
+	pivot->r_right = res;
+	res->r_parent = pivot;
+	res_update(rman, res);
+	res_update(rman, pivot);
+	return (pivot);
+}
+
+/*
+ * Walk from res to the root, refreshing subtree fields and restoring the AVL
+ * balance invariant along the way. This must also be called after modifying a
+ * range in place, since the subtree lengths above it change.
+ */
+static void
+res_rebalance(struct rman *rman, struct resource *res)
+{
+	int balance;
+
+	for (; res != NULL; res = res->r_parent) {
+		res_update(rman, res);
+		balance = res_height(res->r_left) - res_height(res->r_right);
+		if (balance > 1) {
+			if (res_height(res->r_left->r_left) <
+			    res_height(res->r_left->r_right))
+				(void)res_rotate_left(rman, res->r_left);
+			res = res_rotate_right(rman, res);
+		} else if (balance < -1) {
+			if (res_height(res->r_right->r_right) <
+			    res_height(res->r_right->r_left))
+				(void)res_rotate_right(rman, res->r_right);
+			res = res_rotate_left(rman, res);
+		}
+	}
+}
+
+/*
+ * Link a new range into the tree. The range must not overlap any existing
+ * range.
+ */
+static void
+res_insert(struct rman *rman, struct resource *nres)
+{
+	struct resource *parent, **link;
+
+	parent = NULL;
+	link = &rman->rm_root;
+	while (*link != NULL) {
+		parent = *link;
+		if (nres->r_start < parent->r_start)
+			link = &parent->r_left;
+		else
+			link = &parent->r_right;
+	}
+	nres->r_left = nres->r_right = NULL;
+	nres->r_parent = parent;
+	*link = nres;
+	res_rebalance(rman, nres);
+}
+
+/*
+ * Unlink a range from the tree. The caller is responsible for freeing it.
+ */
+static void
+res_remove(struct rman *rman, struct resource *res)
+{
+	struct resource *child, *fix, *succ;
+
+	if (res->r_left != NULL && res->r_right != NULL) {
+		/* Move res's in-order successor into its place. */
+		succ = res->r_right;
+		while (succ->r_left != NULL)
+			succ = succ->r_left;
+		if (succ->r_parent != res) {
+			fix = succ->r_parent;
+			res_replace(rman, fix, succ, succ->r_right);
+			succ->r_right = res->r_right;
+			succ->r_right->r_parent = succ;
+		} else
+			fix = succ;
+		succ->r_left = res->r_left;
+		succ->r_left->r_parent = succ;
+		res_replace(rman, res->r_parent, res, succ);
+	} else {
+		child = res->r_left != NULL ? res->r_left : res->r_right;
+		fix = res->r_parent;
+		res_replace(rman, fix, res, child);
+	}
+	res_rebalance(rman, fix);
 }
 
 #ifdef INVARIANTS
+/*
+ * Check the cached fields and balance of a single node.
+ */
+static void
+res_check(struct rman *rman, struct resource *res)
+{
+
+	assert(res->r_len > 0);
+	assert(res->r_left == NULL || res->r_left->r_parent == res);
+	assert(res->r_right == NULL || res->r_right->r_parent == res);
+	assert(res->r_height == max(res_height(res->r_left),
+	    res_height(res->r_right)) + 1);
+	assert(abs(res_height(res->r_left) - res_height(res->r_right)) <= 1);
+	assert(res->r_nodes == res_nodes(res->r_left) +
+	    res_nodes(res->r_right) + 1);
+	assert(res->r_sublen == res_sublen(res->r_left) +
+	    res_sublen(res->r_right) + res->r_len);
+	for (int i = 0; i < rman->rm_nalign; i++)
+		assert(res->r_subchunks[i] == res_subchunks(res->r_left, i) +
+		    res_subchunks(res->r_right, i) + res_chunks(rman, res, i));
+}
+
 /*
  * Ensure that the resource pool is well-formed.
  */
 static void
-rman_validate(struct rman *rman)
+rman_validate_full(struct rman *rman)
 {
 	struct resource *res, *next;
 	int count;
 
-	assert(rman->rm_entries >= 0);
-
 	count = 0;
-	TAILQ_FOREACH(res, &rman->rm_res, r_next) {
-		assert(res->r_len > 0);
-		if ((next = TAILQ_NEXT(res, r_next)) != NULL)
-			assert(res->r_start + res->r_len < next->r_start);
+	for (res = res_first(rman); res != NULL; res = next) {
+		res_check(rman, res);
+		if ((next = res_next(res)) != NULL)
+			assert(res_end(res) < next->r_start);
 		count++;
 	}
 	assert(count == rman->rm_entries);
+	assert(res_nodes(rman->rm_root) == rman->rm_entries);
+}
+
+/*
+ * Check the ranges on either side of addr, and every node on the paths from
+ * them to the root. These are the only nodes that an add or release at addr
+ * can have modified or rotated.
+ */
+static void
+rman_validate_local(struct rman *rman, u_long addr)
+{
+	struct resource *next, *prev, *res;
+
+	if ((prev = res_lookup(rman, addr)) != NULL) {
+		next = res_next(prev);
+		for (res = prev; res != NULL; res = res->r_parent)
+			res_check(rman, res);
+	} else
+		next = res_first(rman);
+	if (next != NULL) {
+		if (prev != NULL)
+			assert(res_end(prev) < next->r_start);
+		for (res = next; res != NULL; res = res->r_parent)
+			res_check(rman, res);
+	}
+}
+
+/*
+ * Validate the pool after an operation at addr. A full check of the pool is
+ * done every rm_vinterval operations and whenever one has been requested with
+ * rman_validate_request(); otherwise only the neighbourhood of addr is checked,
+ * so the cost doesn't grow with the size of the pool.
+ */
+static void
+rman_validate(struct rman *rman, u_long addr)
+{
+
+	assert(rman->rm_entries >= 0);
+	assert(rman->rm_root == NULL || rman->rm_root->r_parent == NULL);
+	assert(res_nodes(rman->rm_root) == rman->rm_entries);
+	assert(rman->rm_nodes == (u_int)rman->rm_entries);
+	assert(rman->rm_nodes <= rman->rm_nslabs * RMAN_SLAB_NODES);
+
+	if (rman->rm_vgen != rman_validate_gen ||
+	    (rman->rm_vinterval > 0 &&
+	    ++rman->rm_vops % rman->rm_vinterval == 0)) {
+		rman->rm_vgen = rman_validate_gen;
+		rman_validate_full(rman);
+	} else
+		rman_validate_local(rman, addr);
+}
+
+/*
+ * Ask for a full validation of each rman at its next operation. This is safe
+ * to call from a signal handler.
+ */
+void
+rman_validate_request(void)
+{
+
+	rman_validate_gen++;
 }
 #else
 static void
-rman_validate(struct rman *rman __unused)
+rman_validate(struct rman *rman __unused, u_long addr __unused)
+{
+}
+
+void
+rman_validate_request(void)
 {
 }
 #endif
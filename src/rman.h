@@ -25,23 +25,87 @@
  */
 
 #include <sys/types.h>
-#include <sys/queue.h>
 
+/*
+ * The maximum number of alignments for which an rman can track the available
+ * aligned chunks, see rman_track_align().
+ */
+#define	RMAN_MAXALIGN	2
+
+/*
+ * A resource range. Ranges are kept in an AVL tree ordered by r_start; each
+ * node also records the number of nodes and the total length of the ranges in
+ * its subtree so that a range or a block can be picked in logarithmic time.
+ */
 struct resource {
-	TAILQ_ENTRY(resource) r_next;
+	struct resource	*r_left;
+	struct resource	*r_right;
+	struct resource	*r_parent;
 	u_long	r_start;
 	u_long	r_len;
+	int	r_height;	/* height of the subtree rooted here */
+	int	r_nodes;	/* number of nodes in the subtree */
+	u_long	r_sublen;	/* total length of ranges in the subtree */
+	u_long	r_subchunks[RMAN_MAXALIGN]; /* aligned chunks in the subtree */
+};
+
+/*
+ * Policies for rman_select(). RMAN_SELECT_BLOCK picks the starting block
+ * uniformly from all blocks in the pool, so large ranges are chosen in
+ * proportion to their size. RMAN_SELECT_RANGE first picks one of the ranges
+ * uniformly and then a block within it.
+ */
+enum rman_policy {
+	RMAN_SELECT_BLOCK,
+	RMAN_SELECT_RANGE,
 };
 
+struct rman_slab;
+
 struct rman {
-	TAILQ_HEAD(, resource)	rm_res;
+	struct resource	*rm_root;
 	u_int	rm_blksz;
 	int	rm_entries;
+	enum rman_policy rm_policy;
+	u_int	rm_align[RMAN_MAXALIGN]; /* tracked alignment orders */
+	int	rm_nalign;
+
+	/*
+	 * Nodes are carved out of privately mapped slabs and recycled through
+	 * a freelist, so that pool operations don't go through malloc(3).
+	 */
+	struct rman_slab *rm_slabs;
+	struct resource	*rm_free;
+	u_int	rm_nslabs;
+	u_int	rm_nodes;	/* nodes currently allocated */
+	u_int	rm_nodes_hwm;	/* high-water mark of rm_nodes */
+
+	/* Consistency checking state, see rman_set_validate(). */
+	u_int	rm_vinterval;	/* operations between full checks */
+	u_int	rm_vops;	/* operations since initialization */
+	int	rm_vgen;	/* last full check request handled */
+};
+
+struct rman_stats {
+	int	rs_entries;	/* number of ranges */
+	u_long	rs_length;	/* total length of all ranges */
+	u_int	rs_nodes;	/* nodes in use */
+	u_int	rs_nodes_hwm;	/* maximum number of nodes ever in use */
+	u_int	rs_slabs;	/* number of node slabs */
+	size_t	rs_slabmem;	/* memory used by node slabs */
 };
 
 typedef int (*rman_pool_init)(struct rman *);
 
 int	rman_init(struct rman *, u_int blksz, rman_pool_init);
+void	rman_fini(struct rman *);
 void	rman_add(struct rman *, u_long, u_long);
 int	rman_select(struct rman *, u_long *, u_long *, u_int);
+int	rman_select_aligned(struct rman *, u_int, u_long *, u_long *, u_int);
 void	rman_release(struct rman *, u_long, u_long);
+u_long	rman_release_overlap(struct rman *, u_long, u_long);
+void	rman_set_policy(struct rman *, enum rman_policy);
+void	rman_set_validate(struct rman *, u_int);
+void	rman_validate_request(void);
+void	rman_stats(struct rman *, struct rman_stats *);
+int	rman_track_align(struct rman *, u_int);
@@ -0,0 +1,432 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coverage.h"
+#include "params.h"
+#include "stats.h"
+#include "syscall.h"
+#include "util.h"
+
+/* The number of most frequent errors listed for each system call. */
+#define	STATS_TOPERRS	3
+
+/* The number of back-to-back clock readings used to estimate their cost. */
+#define	STATS_OVERHEAD_READS	100000
+
+static void	stats_clock_init(void);
+static double	stats_lat_quantile(const struct scstats *, double);
+static void	stats_report_pools(void);
+static void	stats_report_threads(void);
+static uint64_t	stats_thread_calls(u_int, u_int);
+
+enum stats_clock stats_clock;
+clockid_t stats_clockid;
+
+static const char * const stats_clocks[] = {
+	[STATS_CLOCK_NONE] =		"none",
+	[STATS_CLOCK_TSC] =		"tsc",
+	[STATS_CLOCK_COARSE] =		"coarse",
+	[STATS_CLOCK_MONOTONIC] =	"monotonic",
+};
+
+static struct scstats *stats;
+static struct fzheartbeat *stats_hb;
+static struct fzpoolstats *stats_ps;
+static struct scdesc * const *stats_scds;
+static u_int stats_nsc, stats_nfuzzers, stats_nthreads;
+static uint64_t stats_start;		/* time of stats_init() */
+static double stats_tick_ns;		/* nanoseconds per clock tick */
+static double stats_overhead_ns;	/* cost of a clock reading */
+
+/*
+ * Select the clock named by latency-clock, work out how long its ticks are,
+ * and estimate how much a reading costs. Each latency includes roughly one
+ * reading's worth of overhead.
+ */
+static void
+stats_clock_init(void)
+{
+#if defined(__amd64__) || defined(__i386__)
+	uint64_t freq, now, start;
+	size_t sz;
+#endif
+	uint64_t t0, t1;
+
+	stats_clock = param_choice("latency-clock", stats_clocks,
+	    nitems(stats_clocks));
+	switch (stats_clock) {
+	case STATS_CLOCK_NONE:
+		return;
+	case STATS_CLOCK_TSC:
+#if defined(__amd64__) || defined(__i386__)
+		sz = sizeof(freq);
+		if (sysctlbyname("machdep.tsc_freq", &freq, &sz, NULL,
+		    0) != 0 || freq == 0) {
+			/* Calibrate against the monotonic clock. */
+			t0 = rdtsc();
+			start = nsecs();
+			while ((now = nsecs()) - start < 10000000)
+				;
+			freq = (rdtsc() - t0) * 1000000000.0 / (now - start);
+		}
+		stats_tick_ns = 1000000000.0 / freq;
+#else
+		errx(1, "the TSC clock isn't supported on this platform");
+#endif
+		break;
+	case STATS_CLOCK_COARSE:
+		stats_clockid = CLOCK_MONOTONIC_FAST;
+		stats_tick_ns = 1;
+		break;
+	case STATS_CLOCK_MONOTONIC:
+		stats_clockid = CLOCK_MONOTONIC;
+		stats_tick_ns = 1;
+		break;
+	}
+
+	t0 = stats_now();
+	for (int i = 0; i < STATS_OVERHEAD_READS; i++)
+		(void)stats_now();
+	t1 = stats_now();
+	stats_overhead_ns = (t1 - t0) * stats_tick_ns /
+	    (STATS_OVERHEAD_READS + 1);
+	printf("%s: timing syscalls with the %s clock, %.1f ns per reading\n",
+	    getprogname(), stats_clocks[stats_clock], stats_overhead_ns);
+}
+
+/*
+ * Map zeroed counters and heartbeats for nfuzzers fuzzers of nthreads threads
+ * each, issuing the nsc system calls in scds, and resource pool counters for
+ * each fuzzer. This must happen before the fuzzers are forked.
+ */
+void
+stats_init(struct scdesc * const *scds, u_int nsc, u_int nfuzzers,
+    u_int nthreads)
+{
+	size_t len, nslots;
+
+	nslots = (size_t)nfuzzers * nthreads;
+	len = nslots * nsc * sizeof(*stats);
+	stats = mmap(NULL, max(len + nslots * sizeof(*stats_hb) +
+	    nfuzzers * sizeof(*stats_ps), 1), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (stats == MAP_FAILED)
+		err(1, "mmap");
+	stats_hb = (struct fzheartbeat *)(void *)((char *)stats + len);
+	stats_ps = (struct fzpoolstats *)(void *)(stats_hb + nslots);
+	stats_scds = scds;
+	stats_nsc = nsc;
+	stats_nfuzzers = nfuzzers;
+	stats_nthreads = nthreads;
+	stats_start = nsecs();
+	stats_clock_init();
+}
+
+/*
+ * Return the counters of thread t of fuzzer f, indexed by the system call's
+ * position in the table passed to stats_init().
+ */
+struct scstats *
+stats_thread(u_int f, u_int t)
+{
+
+	return (&stats[((size_t)f * stats_nthreads + t) * stats_nsc]);
+}
+
+static uint64_t
+stats_thread_calls(u_int f, u_int t)
+{
+	const struct scstats *ss;
+	uint64_t calls;
+
+	ss = stats_thread(f, t);
+	calls = 0;
+	for (u_int i = 0; i < stats_nsc; i++)
+		calls += ss[i].ss_calls;
+	return (calls);
+}
+
+/* Return the number of calls fuzzer f has issued. */
+uint64_t
+stats_fuzzer_calls(u_int f)
+{
+	uint64_t calls;
+
+	calls = 0;
+	for (u_int t = 0; t < stats_nthreads; t++)
+		calls += stats_thread_calls(f, t);
+	return (calls);
+}
+
+struct fzheartbeat *
+stats_heartbeat(u_int f, u_int t)
+{
+
+	return (&stats_hb[(size_t)f * stats_nthreads + t]);
+}
+
+/* Return the resource pool counters of fuzzer f. */
+struct fzpoolstats *
+stats_pools(u_int f)
+{
+
+	return (&stats_ps[f]);
+}
+
+/* Convert a latency in clock ticks to nanoseconds. */
+uint64_t
+stats_ns(uint64_t lat)
+{
+
+	return (lat * stats_tick_ns);
+}
+
+/*
+ * Print how often each kind of resource pool had something to offer when asked,
+ * summed over all fuzzers. A miss means a call went without the resource.
+ */
+static void
+stats_report_pools(void)
+{
+	const struct respool_stats *rs;
+	uint64_t hits, misses, stale;
+
+	printf("  %-20s %12s %12s %7s\n", "resource pool", "hits", "misses",
+	    "missed");
+	for (int i = 0; i < AP_RES_NTYPES; i++) {
+		hits = misses = 0;
+		for (u_int f = 0; f < stats_nfuzzers; f++) {
+			rs = &stats_ps[f].ps_res[i];
+			hits += atomic_load_explicit(&rs->rs_hits,
+			    memory_order_relaxed);
+			misses += atomic_load_explicit(&rs->rs_misses,
+			    memory_order_relaxed);
+		}
+		if (hits + misses == 0)
+			continue;
+		printf("  %-20s %12ju %12ju %6.1f%%\n", ap_res_name(i),
+		    (uintmax_t)hits, (uintmax_t)misses,
+		    100.0 * misses / (hits + misses));
+	}
+	stale = 0;
+	for (u_int f = 0; f < stats_nfuzzers; f++)
+		stale += atomic_load_explicit(&stats_ps[f].ps_stale,
+		    memory_order_relaxed);
+	if (stale != 0)
+		printf("  %ju pipelined calls regenerated after their "
+		    "arguments went stale\n", (uintmax_t)stale);
+}
+
+/*
+ * Estimate the latency in nanoseconds within which the fraction q of the calls
+ * counted in ss completed. The estimate is the midpoint of the bucket holding
+ * the call of that rank, clamped to the observed extremes.
+ */
+static double
+stats_lat_quantile(const struct scstats *ss, double q)
+{
+	uint64_t lat, lower, rank, seen, width;
+	u_int b;
+	int e;
+
+	rank = q * ss->ss_calls;
+	if (rank < q * ss->ss_calls || rank == 0)
+		rank++;
+	seen = 0;
+	for (b = 0; b < LAT_NBUCKETS - 1; b++) {
+		seen += ss->ss_lat[b];
+		if (seen >= rank)
+			break;
+	}
+	if (b < (1u << LAT_SUBBITS)) {
+		lower = b;
+		width = 1;
+	} else {
+		e = (b >> LAT_SUBBITS) + LAT_SUBBITS - 1;
+		width = 1ull << (e - LAT_SUBBITS);
+		lower = ((1ull << LAT_SUBBITS) |
+		    (b & ((1u << LAT_SUBBITS) - 1))) * width;
+	}
+	lat = lower + (width - 1) / 2;
+	lat = max(lat, ~ss->ss_latmin_c);
+	lat = min(lat, ss->ss_latmax);
+	return (lat * stats_tick_ns);
+}
+
+struct stats_line {
+	const char	*name;
+	struct scstats	sum;
+};
+
+static int
+stats_line_cmp(const void *a, const void *b)
+{
+	const struct stats_line *la, *lb;
+
+	la = a;
+	lb = b;
+	if (la->sum.ss_calls != lb->sum.ss_calls)
+		return (la->sum.ss_calls < lb->sum.ss_calls ? 1 : -1);
+	return (strcmp(la->name, lb->name));
+}
+
+/*
+ * Print the average throughput of each fuzzer thread over the run, so that
+ * scaling with the number of threads sharing an address space can be seen.
+ */
+static void
+stats_report_threads(void)
+{
+	uint64_t calls;
+	double elapsed;
+
+	elapsed = max(nsecs() - stats_start, 1) / 1e9;
+	printf("  %-8s %12s  %s\n", "fuzzer", "calls/s", "calls/s by thread");
+	for (u_int f = 0; f < stats_nfuzzers; f++) {
+		printf("  %-8u %12.0f ", f, stats_fuzzer_calls(f) / elapsed);
+		for (u_int t = 0; t < stats_nthreads; t++) {
+			calls = stats_thread_calls(f, t);
+			printf(" %.0f", calls / elapsed);
+		}
+		printf("\n");
+	}
+}
+
+/*
+ * Sum the counters over all fuzzer threads and print them, busiest system call
+ * first, with the most frequent errors of each. The fuzzers keep running, so
+ * the totals are only approximately consistent with each other.
+ */
+void
+stats_report(void)
+{
+	struct stats_line *lines, *l;
+	const struct scstats *ss;
+	uint64_t calls, edges, ok, top;
+	int error, printed;
+
+	/* struct scstats is cache-line aligned, which malloc() doesn't honour. */
+	error = posix_memalign((void **)&lines, CACHE_LINE_SIZE,
+	    stats_nsc * sizeof(*lines));
+	if (error != 0)
+		errc(1, error, "posix_memalign");
+	memset(lines, 0, stats_nsc * sizeof(*lines));
+	calls = edges = ok = 0;
+	for (u_int i = 0; i < stats_nsc; i++) {
+		l = &lines[i];
+		l->name = stats_scds[i]->sd_name;
+		for (u_int s = 0; s < stats_nfuzzers * stats_nthreads; s++) {
+			ss = &stats[(size_t)s * stats_nsc + i];
+			l->sum.ss_calls += ss->ss_calls;
+			l->sum.ss_successes += ss->ss_successes;
+			for (int e = 0; e <= ELAST; e++)
+				l->sum.ss_errors[e] += ss->ss_errors[e];
+			for (int b = 0; b < LAT_NBUCKETS; b++)
+				l->sum.ss_lat[b] += ss->ss_lat[b];
+			l->sum.ss_latmax = max(l->sum.ss_latmax,
+			    ss->ss_latmax);
+			l->sum.ss_latmin_c = max(l->sum.ss_latmin_c,
+			    ss->ss_latmin_c);
+			l->sum.ss_edges += ss->ss_edges;
+		}
+		calls += l->sum.ss_calls;
+		edges += l->sum.ss_edges;
+		ok += l->sum.ss_successes;
+	}
+	qsort(lines, stats_nsc, sizeof(*lines), stats_line_cmp);
+
+	printf("%s: %ju calls, %.1f%% successful\n", getprogname(),
+	    (uintmax_t)calls, calls == 0 ? 0 : 100.0 * ok / calls);
+	printf("  %-20s %12s %7s  %s\n", "syscall", "calls", "ok", "errors");
+	for (u_int i = 0; i < stats_nsc; i++) {
+		l = &lines[i];
+		if (l->sum.ss_calls == 0)
+			continue;
+		printf("  %-20s %12ju %6.1f%% ", l->name,
+		    (uintmax_t)l->sum.ss_calls,
+		    100.0 * l->sum.ss_successes / l->sum.ss_calls);
+
+		/* Pick out the most frequent errors, zeroing each in turn. */
+		for (printed = 0; printed < STATS_TOPERRS; printed++) {
+			top = 0;
+			error = 0;
+			for (int e = 0; e <= ELAST; e++)
+				if (l->sum.ss_errors[e] > top) {
+					top = l->sum.ss_errors[e];
+					error = e;
+				}
+			if (top == 0)
+				break;
+			printf(" %s %.1f%%", strerror(error),
+			    100.0 * top / l->sum.ss_calls);
+			l->sum.ss_errors[error] = 0;
+		}
+		printf("\n");
+	}
+
+	if (cov_enabled()) {
+		printf("  %ju edges, %.1f new edges/s\n", (uintmax_t)edges,
+		    edges / (max(nsecs() - stats_start, 1) / 1e9));
+		printf("  %-20s %12s\n", "syscall", "edges");
+		for (u_int i = 0; i < stats_nsc; i++) {
+			l = &lines[i];
+			if (l->sum.ss_edges == 0)
+				continue;
+			printf("  %-20s %12ju\n", l->name,
+			    (uintmax_t)l->sum.ss_edges);
+		}
+	}
+
+	if (stats_clock != STATS_CLOCK_NONE) {
+		printf("  %-20s %10s %10s %10s %10s %10s  (ns, %.1f ns "
+		    "timing overhead)\n", "syscall", "min", "p50", "p99",
+		    "p99.9", "max", stats_overhead_ns);
+		for (u_int i = 0; i < stats_nsc; i++) {
+			l = &lines[i];
+			if (l->sum.ss_calls == 0)
+				continue;
+			printf("  %-20s %10.0f %10.0f %10.0f %10.0f %10.0f\n",
+			    l->name, ~l->sum.ss_latmin_c * stats_tick_ns,
+			    stats_lat_quantile(&l->sum, 0.5),
+			    stats_lat_quantile(&l->sum, 0.99),
+			    stats_lat_quantile(&l->sum, 0.999),
+			    l->sum.ss_latmax * stats_tick_ns);
+		}
+	}
+	stats_report_pools();
+	if (stats_nthreads > 1)
+		stats_report_threads();
+	free(lines);
+}
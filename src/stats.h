@@ -0,0 +1,159 @@
+/*-
+ * Copyright (c) 2015 Mark Johnston <markj@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _STATS_H_
+#define	_STATS_H_
+
+#include <sys/param.h>
+#if defined(__amd64__) || defined(__i386__)
+#include <machine/cpufunc.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+
+#include "argpool.h"
+#include "respool.h"
+
+struct scdesc;
+
+/* Clocks for timing system calls, selected by the latency-clock parameter. */
+enum stats_clock {
+	STATS_CLOCK_NONE,
+	STATS_CLOCK_TSC,	/* the CPU's timestamp counter */
+	STATS_CLOCK_COARSE,	/* CLOCK_MONOTONIC_FAST */
+	STATS_CLOCK_MONOTONIC,	/* CLOCK_MONOTONIC */
+};
+
+/*
+ * Latencies are kept in log-linear histograms: values below 2^LAT_SUBBITS
+ * ticks get a bucket each, and every power of two above that is split into
+ * 2^LAT_SUBBITS buckets, bounding the relative error at about 6%. Latencies
+ * of 2^LAT_MAXEXP ticks or more all land in the last bucket.
+ */
+#define	LAT_SUBBITS	4
+#define	LAT_MAXEXP	40
+#define	LAT_NBUCKETS	((LAT_MAXEXP - LAT_SUBBITS + 1) << LAT_SUBBITS)
+
+/*
+ * Counters for one system call in one fuzzer thread. They live in a shared
+ * mapping created before the fuzzers are forked, so the parent can read them.
+ * Each thread only writes its own counters, so updates are plain increments,
+ * and the padding keeps threads from sharing cache lines.
+ */
+struct scstats {
+	uint64_t	ss_calls;
+	uint64_t	ss_successes;
+	uint64_t	ss_errors[ELAST + 1];	/* failures by errno */
+	uint64_t	ss_latmax;		/* in ticks */
+	uint64_t	ss_latmin_c;		/* complement of the minimum */
+	uint64_t	ss_lat[LAT_NBUCKETS];
+	uint64_t	ss_edges;		/* new coverage edges found */
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * A fuzzer thread's heartbeat, shared with the parent so that it can tell when
+ * the thread has stopped making progress, and in which system call.
+ */
+struct fzheartbeat {
+	uint64_t	hb_seq;		/* bumped before each call */
+	int		hb_sc;		/* index of the latest call */
+} __aligned(CACHE_LINE_SIZE);
+
+/* A fuzzer's argument pool counters, shared like the rest. */
+struct fzpoolstats {
+	struct respool_stats ps_res[AP_RES_NTYPES];
+	atomic_ulong	ps_stale;	/* pipelined calls regenerated */
+} __aligned(CACHE_LINE_SIZE);
+
+extern enum stats_clock stats_clock;
+extern clockid_t stats_clockid;
+
+void	stats_init(struct scdesc * const *, u_int, u_int, u_int);
+struct scstats *stats_thread(u_int, u_int);
+uint64_t stats_fuzzer_calls(u_int);
+struct fzheartbeat *stats_heartbeat(u_int, u_int);
+struct fzpoolstats *stats_pools(u_int);
+uint64_t stats_ns(uint64_t);
+void	stats_report(void);
+
+/* Read the clock selected by stats_init(). */
+static inline uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+#if defined(__amd64__) || defined(__i386__)
+	if (stats_clock == STATS_CLOCK_TSC)
+		return (rdtsc());
+#endif
+	if (stats_clock == STATS_CLOCK_NONE)
+		return (0);
+	(void)clock_gettime(stats_clockid, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static inline u_int
+stats_lat_bucket(uint64_t lat)
+{
+	int e;
+
+	if (lat < (1u << LAT_SUBBITS))
+		return (lat);
+	e = flsll(lat) - 1;
+	if (e >= LAT_MAXEXP)
+		return (LAT_NBUCKETS - 1);
+	return (((e - LAT_SUBBITS + 1) << LAT_SUBBITS) |
+	    ((lat >> (e - LAT_SUBBITS)) & ((1u << LAT_SUBBITS) - 1)));
+}
+
+/*
+ * Count a system call's outcome and latency. __syscall(2) returns -1 and sets
+ * errno on failure.
+ */
+static inline void
+stats_record(struct scstats *ss, u_long ret, int error, uint64_t lat)
+{
+
+	ss->ss_calls++;
+	if (ret != (u_long)-1)
+		ss->ss_successes++;
+	else
+		ss->ss_errors[error >= 0 && error <= ELAST ? error : 0]++;
+
+	if (stats_clock != STATS_CLOCK_NONE) {
+		ss->ss_lat[stats_lat_bucket(lat)]++;
+		if (lat > ss->ss_latmax)
+			ss->ss_latmax = lat;
+		/* Complemented, so that the zero-filled initial value works. */
+		if (~lat > ss->ss_latmin_c)
+			ss->ss_latmin_c = ~lat;
+	}
+}
+
+#endif /* _STATS_H_ */
@@ -63,6 +63,19 @@ sc_filter(const struct scdesc *desc, const char *sclist, size_t scs,
 	return (sclist != NULL || scgrplist != NULL);
 }
 
+/* Look up a system call descriptor by system call number. */
+struct scdesc *
+sc_desc(int num)
+{
+	struct scdesc **desc;
+
+	SET_FOREACH(desc, syscalls)
+		if ((*desc)->sd_num == num)
+			return (*desc);
+
+	return (NULL);
+}
+
 /* Look up a system call by name. */
 bool
 sc_lookup(const char *name, int *sc)
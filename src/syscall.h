@@ -43,7 +43,9 @@ enum scargtype {
 	ARG_DIRFD,
 	ARG_PATH,
 	ARG_SOCKET,
+	ARG_PIPE,
 	ARG_MEMADDR,
+	ARG_MEMADDR_SUPER,	/* superpage-aligned if possible */
 	ARG_MEMLEN,
 	ARG_MODE,
 	ARG_PID,
@@ -79,6 +81,13 @@ enum scgroup {
 
 #define	SYSCALL_MAXARGS	8
 
+/*
+ * Flags for system call descriptors. SD_REPLAY_FIXUP marks calls whose fixup
+ * only supplies pointers to buffers in the fuzzer's own memory, and so must
+ * run again when the call is replayed from a call log.
+ */
+#define	SD_REPLAY_FIXUP	0x01
+
 /*
  * A system call descriptor. This contains all the static information needed
  * to test a given system call.
@@ -88,13 +97,16 @@ struct scdesc {
 	const char	*sd_name;	/* system call name */
 	int		sd_nargs;	/* number of arguments */
 	u_int		sd_groups;	/* system call groups */
+	u_int		sd_flags;	/* SD_* */
 	void (*sd_fixup)(u_long *);	/* pre-syscall hook */
 	void (*sd_cleanup)(u_long *, u_long); /* post-syscall hook */
+	u_long (*sd_fake)(u_long *, int *); /* null executor result */
 	struct scargdesc sd_args[];	/* argument descriptors */
 };
 
 bool	sc_filter(const struct scdesc *, const char *, size_t, const char *,
 	    size_t);
+struct scdesc *sc_desc(int);
 bool	sc_lookup(const char *, int *);
 bool	scgroup_lookup(const char *, enum scgroup *);
 
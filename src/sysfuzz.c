@@ -26,36 +26,223 @@
 
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
 #include <err.h>
+#include <math.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "argpool.h"
+#include "calllog.h"
+#include "corpus.h"
+#include "coverage.h"
+#include "exec.h"
+#include "minimize.h"
+#include "monitor.h"
 #include "params.h"
+#include "place.h"
+#include "prng.h"
+#include "stats.h"
 #include "syscall.h"
 #include "util.h"
 
+/*
+ * The system calls being fuzzed, with a Walker alias table for picking them
+ * according to their weights: a call is chosen by picking a slot uniformly and
+ * then either taking the slot's own call or its alias.
+ */
 struct sctable {
 	int		cnt;
+	double		*weights;	/* relative weight of each call */
+	uint64_t	*prob;		/* keep-own threshold, out of 2^32 */
+	int		*alias;		/* the slot's alternative */
 	struct scdesc	*scds[1];
 };
 
+/*
+ * Compute a system call's weight from sc-weights, a comma-separated list of
+ * <name>:<weight> pairs naming system calls or groups. A weight given for the
+ * call itself takes precedence; otherwise the last matching group's weight
+ * applies. Calls not mentioned have a weight of 1.
+ */
+static double
+scdesc_weight(const struct scdesc *sd, const char *weights)
+{
+	enum scgroup group;
+	char *end, *list, *name, *spec, *val;
+	double grpw, scw, w;
+	bool grpmatch, scmatch;
+
+	grpmatch = scmatch = false;
+	grpw = scw = 1;
+	list = spec = xstrdup(weights);
+	while ((name = strsep(&spec, ",")) != NULL) {
+		if (*name == '\0')
+			continue;
+		val = name;
+		(void)strsep(&val, ":");
+		if (val == NULL)
+			errx(1, "invalid syscall weight '%s'", name);
+		errno = 0;
+		w = strtod(val, &end);
+		if (*val == '\0' || *end != '\0' || errno != 0 || !(w >= 0) ||
+		    isinf(w))
+			errx(1, "invalid weight '%s' for '%s'", val, name);
+
+		group = 0;
+		if (strcasecmp(name, sd->sd_name) == 0) {
+			scw = w;
+			scmatch = true;
+		} else if (scgroup_lookup(name, &group)) {
+			if ((group & sd->sd_groups) != 0) {
+				grpw = w;
+				grpmatch = true;
+			}
+		} else if (!sc_lookup(name, NULL))
+			errx(1, "unknown syscall or group '%s' in weights",
+			    name);
+	}
+	free(list);
+	return (scmatch ? scw : grpmatch ? grpw : 1);
+}
+
+/*
+ * Build the alias table using Vose's method. Each slot starts with probability
+ * cnt * weight / total; slots below 1 are topped up with the excess of a slot
+ * above 1, which becomes their alias.
+ */
+static void
+sctable_alias(struct sctable *table)
+{
+	double *p, total;
+	int *large, *small, l, nl, ns, s;
+
+	table->prob = xmalloc(table->cnt * sizeof(*table->prob));
+	table->alias = xmalloc(table->cnt * sizeof(*table->alias));
+	p = xmalloc(table->cnt * sizeof(*p));
+	small = xmalloc(table->cnt * sizeof(*small));
+	large = xmalloc(table->cnt * sizeof(*large));
+
+	total = 0;
+	for (int i = 0; i < table->cnt; i++)
+		total += table->weights[i];
+	ns = nl = 0;
+	for (int i = 0; i < table->cnt; i++) {
+		p[i] = table->weights[i] * table->cnt / total;
+		if (p[i] < 1)
+			small[ns++] = i;
+		else
+			large[nl++] = i;
+	}
+	while (ns > 0 && nl > 0) {
+		s = small[--ns];
+		l = large[--nl];
+		table->prob[s] = p[s] * 4294967296.0;
+		table->alias[s] = l;
+		p[l] -= 1 - p[s];
+		if (p[l] < 1)
+			small[ns++] = l;
+		else
+			large[nl++] = l;
+	}
+	/* Whatever is left is within rounding error of 1. */
+	while (nl > 0) {
+		l = large[--nl];
+		table->prob[l] = 1ull << 32;
+		table->alias[l] = l;
+	}
+	while (ns > 0) {
+		s = small[--ns];
+		table->prob[s] = 1ull << 32;
+		table->alias[s] = s;
+	}
+
+	free(large);
+	free(small);
+	free(p);
+}
+
+/*
+ * Pick a system call and return its index. The high half of a single draw
+ * selects the slot and the low half decides between the slot and its alias.
+ */
+static int
+sctable_pick(const struct sctable *table)
+{
+	uint64_t r;
+	int i;
+
+	r = rnd();
+	i = ((r >> 32) * table->cnt) >> 32;
+	if ((r & 0xffffffff) >= table->prob[i])
+		i = table->alias[i];
+	return (i);
+}
+
+struct scmix {
+	const char	*name;
+	double		weight;
+};
+
+static int
+scmix_cmp(const void *a, const void *b)
+{
+	const struct scmix *ma, *mb;
+
+	ma = a;
+	mb = b;
+	if (ma->weight != mb->weight)
+		return (ma->weight < mb->weight ? 1 : -1);
+	return (strcmp(ma->name, mb->name));
+}
+
+/* Print the effective mix of system calls, most frequent first. */
+static void
+sctable_report(const struct sctable *table)
+{
+	struct scmix *mix;
+	double total;
+
+	if (*param_string("sc-weights") == '\0') {
+		printf("%s: picking uniformly from %d syscalls\n",
+		    getprogname(), table->cnt);
+		return;
+	}
+
+	mix = xmalloc(table->cnt * sizeof(*mix));
+	total = 0;
+	for (int i = 0; i < table->cnt; i++) {
+		mix[i].name = table->scds[i]->sd_name;
+		mix[i].weight = table->weights[i];
+		total += table->weights[i];
+	}
+	qsort(mix, table->cnt, sizeof(*mix), scmix_cmp);
+	printf("%s: syscall mix:\n", getprogname());
+	for (int i = 0; i < table->cnt; i++)
+		printf("\t%-24s %6.2f%%\n", mix[i].name,
+		    100 * mix[i].weight / total);
+	free(mix);
+}
+
 /* Allocate a table of system call descriptors. */
 static struct sctable *
 sctable_alloc(char *sclist, char *scgrplist)
 {
 	struct sctable *table;
 	struct scdesc **desc;
-	const char *sc, *scgrp;
+	const char *sc, *scgrp, *weights;
 	char *list;
+	double w;
 	size_t scs, scgrps;
 	int sccnt;
 
@@ -66,6 +253,7 @@ sctable_alloc(char *sclist, char *scgrplist)
 	table = malloc(sizeof(*table) + sccnt * sizeof(struct scdesc *));
 	if (table == NULL)
 		err(1, "malloc");
+	table->weights = xmalloc(sccnt * sizeof(*table->weights));
 
 	/* Validate the list of syscall and syscall group filters. */
 	scs = scgrps = 0;
@@ -82,16 +270,52 @@ sctable_alloc(char *sclist, char *scgrplist)
 		scgrps++;
 	}
 
+	/* Calls with a weight of 0 are left out altogether. */
+	weights = param_string("sc-weights");
 	sccnt = 0;
 	SET_FOREACH(desc, syscalls) {
-		if (!sc_filter(*desc, sclist, scs, scgrplist, scgrps))
-			table->scds[sccnt++] = *desc;
+		if (sc_filter(*desc, sclist, scs, scgrplist, scgrps))
+			continue;
+		w = scdesc_weight(*desc, weights);
+		if (w == 0)
+			continue;
+		table->weights[sccnt] = w;
+		table->scds[sccnt++] = *desc;
 	}
 	table->cnt = sccnt;
+	if (sccnt == 0)
+		errx(1, "no syscalls left to fuzz");
+	sctable_alias(table);
+
+	return (table);
+}
+
+/* Copy a table, so that its weights can be changed. */
+static struct sctable *
+sctable_copy(const struct sctable *orig)
+{
+	struct sctable *table;
 
+	table = xmalloc(sizeof(*table) + orig->cnt * sizeof(struct scdesc *));
+	table->cnt = orig->cnt;
+	memcpy(table->scds, orig->scds, orig->cnt * sizeof(struct scdesc *));
+	table->weights = xmalloc(orig->cnt * sizeof(*table->weights));
+	memcpy(table->weights, orig->weights,
+	    orig->cnt * sizeof(*table->weights));
+	sctable_alias(table);
 	return (table);
 }
 
+static void
+sctable_free(struct sctable *table)
+{
+
+	free(table->weights);
+	free(table->prob);
+	free(table->alias);
+	free(table);
+}
+
 /* List the members of the given system call group. */
 static void
 scgroup_list(const char *scgrp)
@@ -113,15 +337,19 @@ static void
 scargs_alloc(u_long *args, struct scdesc *sd)
 {
 	struct arg_memblk memblk;
+	pid_t pid;
 	int argcnt, ci;
 
 	for (int i = 0; i < sd->sd_nargs; i++) {
 		switch (sd->sd_args[i].sa_type) {
 		case ARG_UNSPEC:
-			args[i] = random();
+			args[i] = rnd();
 			break;
 		case ARG_MEMADDR:
-			ap_memblk_random(&memblk);
+		case ARG_MEMADDR_SUPER:
+			if (sd->sd_args[i].sa_type != ARG_MEMADDR_SUPER ||
+			    ap_memblk_random_super(&memblk) != 0)
+				ap_memblk_random(&memblk);
 			args[i] = (uintptr_t)memblk.addr;
 			if (i + 1 < sd->sd_nargs &&
 			    sd->sd_args[i + 1].sa_type == ARG_MEMLEN)
@@ -132,18 +360,35 @@ scargs_alloc(u_long *args, struct scdesc *sd)
 			args[i] = memblk.len;
 			break;
 		case ARG_CMD:
-			ci = random() % sd->sd_args[i].sa_argcnt;
+			ci = rnd_range(sd->sd_args[i].sa_argcnt);
 			args[i] = sd->sd_args[i].sa_cmds[ci];
 			break;
 		case ARG_IFLAGMASK:
 			argcnt = sd->sd_args[i].sa_argcnt;
-			for (int fi = random() % (argcnt + 1); fi > 0; fi--)
+			for (int fi = rnd_range(argcnt + 1); fi > 0; fi--)
 				args[i] |=
-				    sd->sd_args[i].sa_iflags[random() % argcnt];
+				    sd->sd_args[i].sa_iflags[rnd_range(argcnt)];
 			break;
 		case ARG_FD:
 			args[i] = ap_fd_random();
 			break;
+		case ARG_SOCKET:
+			args[i] = ap_res_random(AP_RES_SOCKET);
+			break;
+		case ARG_PIPE:
+			args[i] = ap_res_random(AP_RES_PIPE);
+			break;
+		case ARG_KQUEUE:
+			args[i] = ap_res_random(AP_RES_KQUEUE);
+			break;
+		case ARG_PROCDESC:
+			args[i] = ap_res_random(AP_RES_PROCDESC);
+			break;
+		case ARG_PID:
+			/* Fall back to ourselves if no child is available. */
+			pid = ap_res_random(AP_RES_PID);
+			args[i] = pid > 0 ? pid : 0;
+			break;
 		default:
 			args[i] = 0;
 			break;
@@ -151,48 +396,736 @@ scargs_alloc(u_long *args, struct scdesc *sd)
 	}
 }
 
+/*
+ * A fully materialized system call, ready to be issued. Records are generated
+ * in batches when pipelining; sr_gen lets the executor notice that one of the
+ * argument pools the record drew from has since had something removed from it.
+ */
+struct screc {
+	struct scdesc	*sr_sd;
+	int		sr_idx;		/* index into the table */
+	uint64_t	sr_pools;	/* pools drawn from, see ap_drawn() */
+	u_long		sr_gen;		/* generation of those pools */
+	u_long		sr_args[SYSCALL_MAXARGS];
+};
+
+/*
+ * Coverage guidance for a fuzzer thread. A call that reaches new edges has its
+ * weight boosted in the thread's own copy of the call table, and its command,
+ * flag and unspecified arguments are kept as a hint, reused by half of the
+ * later calls of that system call. Boosts halve every SCGUIDE_PERIOD calls, so
+ * that a call falls back to its base weight once it stops finding edges.
+ */
+#define	SCGUIDE_PERIOD		4096
+#define	SCGUIDE_MAXBOOST	16
+
+struct scguide {
+	struct covthread *sg_cov;
+	const struct sctable *sg_base;
+	struct sctable	*sg_table;	/* reweighted copy of sg_base */
+	double		*sg_boost;	/* recent new edges, by call */
+	u_long		(*sg_hints)[SYSCALL_MAXARGS];
+	bool		*sg_hinted;
+	u_long		sg_calls;
+	bool		sg_boosted;	/* some boost is not yet negligible */
+};
+
+/* Set up coverage guidance, or return NULL if coverage is disabled. */
+static struct scguide *
+scguide_init(const struct sctable *table)
+{
+	struct scguide *sg;
+	int cnt;
+
+	if (!cov_enabled())
+		return (NULL);
+	cnt = table->cnt;
+	sg = xmalloc(sizeof(*sg));
+	sg->sg_cov = cov_thread_init();
+	sg->sg_base = table;
+	sg->sg_table = sctable_copy(table);
+	sg->sg_boost = xmalloc(cnt * sizeof(*sg->sg_boost));
+	memset(sg->sg_boost, 0, cnt * sizeof(*sg->sg_boost));
+	sg->sg_hints = xmalloc(cnt * sizeof(*sg->sg_hints));
+	sg->sg_hinted = xmalloc(cnt * sizeof(*sg->sg_hinted));
+	memset(sg->sg_hinted, 0, cnt * sizeof(*sg->sg_hinted));
+	sg->sg_calls = 0;
+	sg->sg_boosted = false;
+	return (sg);
+}
+
+static void
+scguide_fini(struct scguide *sg)
+{
+
+	cov_thread_fini(sg->sg_cov);
+	sctable_free(sg->sg_table);
+	free(sg->sg_boost);
+	free(sg->sg_hints);
+	free(sg->sg_hinted);
+	free(sg);
+}
+
+/* Take the new edges found by a call into account. */
+static void
+scguide_update(struct scguide *sg, const struct screc *rec, u_int edges)
+{
+	struct sctable *table;
+
+	if (edges > 0) {
+		sg->sg_boost[rec->sr_idx] += edges;
+		memcpy(sg->sg_hints[rec->sr_idx], rec->sr_args,
+		    sizeof(rec->sr_args));
+		sg->sg_hinted[rec->sr_idx] = true;
+		sg->sg_boosted = true;
+	}
+	if (++sg->sg_calls % SCGUIDE_PERIOD != 0 || !sg->sg_boosted)
+		return;
+
+	table = sg->sg_table;
+	sg->sg_boosted = false;
+	for (int i = 0; i < table->cnt; i++) {
+		table->weights[i] = sg->sg_base->weights[i] *
+		    min(1 + sg->sg_boost[i], SCGUIDE_MAXBOOST);
+		sg->sg_boost[i] /= 2;
+		if (sg->sg_boost[i] >= 0.01)
+			sg->sg_boosted = true;
+		else
+			sg->sg_boost[i] = 0;
+	}
+	free(table->prob);
+	free(table->alias);
+	sctable_alias(table);
+}
+
+/*
+ * Copy the arguments that mean the same thing in any fuzzer: commands, flags
+ * and unspecified values, but not descriptors or addresses. They are what is
+ * worth reusing from a call that found something new.
+ */
+static void
+scargs_reuse(u_long *args, const struct scdesc *sd, const u_long *from)
+{
+
+	for (int i = 0; i < sd->sd_nargs; i++) {
+		switch (sd->sd_args[i].sa_type) {
+		case ARG_UNSPEC:
+		case ARG_IFLAGMASK:
+		case ARG_LFLAGMASK:
+		case ARG_CMD:
+			args[i] = from[i];
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Find a system call in a table, or return -1 if it isn't being fuzzed. */
+static int
+sctable_find(const struct sctable *table, int num)
+{
+
+	for (int i = 0; i < table->cnt; i++)
+		if (table->scds[i]->sd_num == num)
+			return (i);
+	return (-1);
+}
+
+/*
+ * Generate a call to the idx'th system call of the table, reusing the arguments
+ * in reuse if it isn't NULL.
+ */
 static void
-scloop(u_long ncalls, u_long seed, struct sctable *table)
+screc_fill(struct screc *rec, const struct sctable *table, int idx,
+    const u_long *reuse)
 {
-	u_long args[SYSCALL_MAXARGS], ret, sofar;
 	struct scdesc *sd;
-	u_int n;
-	int status, toreap;
 
-	printf("%s: seeding with %lu\n", getprogname(), seed);
+	rec->sr_idx = idx;
+	sd = rec->sr_sd = table->scds[idx];
+	memset(rec->sr_args, 0, sizeof(rec->sr_args));
+	(void)ap_drawn();
+	scargs_alloc(rec->sr_args, sd);
+	if (reuse != NULL)
+		scargs_reuse(rec->sr_args, sd, reuse);
+	if (sd->sd_fixup != NULL)
+		(sd->sd_fixup)(rec->sr_args);
+	rec->sr_pools = ap_drawn();
+	rec->sr_gen = ap_generation(rec->sr_pools);
+}
 
-	for (n = param_number("num-fuzzers"); n > 0; n--) {
-		pid_t pid = fork();
-		if (pid == -1)
-			err(1, "fork");
-		else if (pid == 0)
-			break;
+static void
+screc_gen(struct screc *rec, struct sctable *table, struct scguide *sg)
+{
+	int idx;
+
+	if (sg == NULL) {
+		screc_fill(rec, table, sctable_pick(table), NULL);
+		return;
+	}
+	idx = sctable_pick(sg->sg_table);
+	screc_fill(rec, sg->sg_table, idx,
+	    sg->sg_hinted[idx] && rnd_range(2) == 0 ? sg->sg_hints[idx] : NULL);
+}
+
+/* A thread of a fuzzer process. */
+struct fzthread {
+	pthread_t	ft_thread;
+	u_int		ft_idx;		/* fuzzer index */
+	u_int		ft_tidx;	/* thread index within the fuzzer */
+	const struct fuzzer *ft_fz;
+	u_long		ft_ncalls;
+	struct sctable	*ft_table;
+	struct scstats	*ft_stats;
+	struct fzheartbeat *ft_hb;
+	struct calllog	*ft_log;	/* NULL unless logging */
+	struct scguide	*ft_guide;	/* NULL without coverage */
+	struct corpusthread *ft_corpus;	/* NULL unless adding to a corpus */
+};
+
+/* Calls a thread issues before its latencies are compared with the corpus'. */
+#define	SCNOVEL_LATCALLS	1000
+
+/*
+ * Determine whether a call did something no call of its system call known to
+ * the corpus has done: succeed, fail with some errno, or take longer, once the
+ * thread has issued enough of them for its caches to be warm.
+ */
+static bool
+screc_novel(const struct scstats *ss, const struct scdesc *sd, u_long ret,
+    int error, uint64_t lat)
+{
+	bool novel;
+
+	novel = corpus_result(sd->sd_num, ret, error);
+	if (ss->ss_calls >= SCNOVEL_LATCALLS &&
+	    corpus_latency(sd->sd_num, stats_ns(lat)))
+		novel = true;
+	return (novel);
+}
+
+/*
+ * Issue a call through the executor, and count its outcome, latency and new
+ * coverage in the fuzzer's statistics. The cleanup hook runs first, since a
+ * forked child exits from there and mustn't count or log anything; coverage
+ * therefore includes that of the cleanup's own system calls. The heartbeat is
+ * bumped beforehand so that the parent can tell which call a stuck fuzzer is
+ * in. A call that did something new is added to the corpus along with the
+ * calls before it.
+ */
+static void
+screc_exec(struct fzthread *ft, struct screc *rec)
+{
+	struct scdesc *sd;
+	struct scguide *sg;
+	struct scstats *ss;
+	uint64_t start, end;
+	u_long *args, kept[SYSCALL_MAXARGS], ret;
+	u_int edges;
+	int error;
+	bool novel;
+
+	sd = rec->sr_sd;
+	args = rec->sr_args;
+	sg = ft->ft_guide;
+	ss = &ft->ft_stats[rec->sr_idx];
+	ft->ft_hb->hb_sc = rec->sr_idx;
+	ft->ft_hb->hb_seq++;
+	if (ft->ft_log != NULL)
+		calllog_call(ft->ft_log, sd, args);
+	if (ft->ft_corpus != NULL) {
+		memset(kept, 0, sizeof(kept));
+		scargs_reuse(kept, sd, args);
+		corpus_call(ft->ft_corpus, sd, kept);
+	}
+	if (sg != NULL)
+		cov_start(sg->sg_cov);
+	start = stats_now();
+	ret = executor->ex_call(sd, args, &error);
+	end = stats_now();
+	if (sd->sd_cleanup != NULL)
+		(sd->sd_cleanup)(args, ret);
+	if (ft->ft_log != NULL)
+		calllog_ret(ft->ft_log, sd, ret, error);
+	novel = ft->ft_corpus != NULL && screc_novel(ss, sd, ret, error,
+	    end - start);
+	stats_record(ss, ret, error, end - start);
+	if (sg != NULL) {
+		edges = cov_collect(sg->sg_cov, sd, args, ret, error);
+		ss->ss_edges += edges;
+		scguide_update(sg, rec, edges);
+		if (edges > 0)
+			novel = ft->ft_corpus != NULL;
 	}
+	if (novel)
+		(void)corpus_save(ft->ft_corpus);
+}
+
+/*
+ * Throw away a record that was never issued, giving its cleanup hook a chance
+ * to release anything the fixup allocated.
+ */
+static void
+screc_discard(struct screc *rec)
+{
 
-	if (n == 0) {
-		toreap = param_number("num-fuzzers");
-		while (toreap > 0) {
-			if (wait(&status) != -1)
-				toreap--;
+	if (rec->sr_sd->sd_cleanup != NULL)
+		(rec->sr_sd->sd_cleanup)(rec->sr_args, (u_long)-1);
+}
+
+static volatile sig_atomic_t sigalrm, siginfo;
+
+/* The number of times in a row a fuzzer may die before issuing a call. */
+#define	FUZZER_MAXFAILURES	5
+
+/* A fuzzer thread's progress, as seen by the supervising parent. */
+struct fzwatch {
+	uint64_t	fw_spawnseq;	/* heartbeat when spawned */
+	uint64_t	fw_seq;		/* heartbeat when last checked */
+	uint64_t	fw_seen;	/* time the heartbeat last changed */
+	bool		fw_stuck;	/* reported as stuck */
+};
+
+/* A fuzzer slot, as seen by the supervising parent. */
+struct fuzzer {
+	pid_t		fz_pid;		/* -1 if not running */
+	u_long		fz_seed;
+	u_int		fz_jumps;	/* jumps to thread 0's stream */
+	u_int		fz_stride;	/* jumps between its threads' streams */
+	u_int		fz_failures;	/* deaths in a row without progress */
+	uint64_t	fz_spawnseq;	/* heartbeats when spawned */
+	struct fzwatch	*fz_watch;	/* one per thread */
+};
+
+static u_int fuzzer_nfuzzers, fuzzer_nthreads;
+static u_long fuzzer_apseed;	/* seed of the argument pools */
+
+/*
+ * Replay this thread's share of the corpus, so that coverage guidance starts
+ * from what earlier runs found. Arguments not kept in the corpus are drawn from
+ * the pools as usual, and calls not being fuzzed in this run are skipped. The
+ * replayed calls aren't added to the corpus again.
+ */
+static void
+scfuzz_seed(struct fzthread *ft)
+{
+	struct corpuscall calls[CORPUS_SEQLEN];
+	struct corpusthread *ct;
+	struct screc rec;
+	u_int n, nthreads;
+	int idx;
+
+	ct = ft->ft_corpus;
+	ft->ft_corpus = NULL;
+	nthreads = fuzzer_nfuzzers * fuzzer_nthreads;
+	for (u_int i = ft->ft_idx * fuzzer_nthreads + ft->ft_tidx;
+	    i < corpus_count(); i += nthreads) {
+		n = corpus_get(i, calls);
+		for (u_int c = 0; c < n; c++) {
+			idx = sctable_find(ft->ft_table, calls[c].cc_num);
+			if (idx < 0)
+				continue;
+			screc_fill(&rec, ft->ft_table, idx, calls[c].cc_args);
+			screc_exec(ft, &rec);
 		}
+	}
+	ft->ft_corpus = ct;
+}
+
+/*
+ * The body of a fuzzer thread: issue ncalls calls, or run forever if ncalls is
+ * 0. The thread's stream is found by jumping from the seed, so that threads
+ * sharing a seed never issue the same sequence.
+ */
+static void *
+scfuzz_thread(void *arg)
+{
+	struct fzthread *ft;
+	struct screc *ring, *rec;
+	const char *logpfx;
+	char *path;
+	u_long batch, ncalls, sofar;
+	u_int depth, jumps;
+
+	ft = arg;
+	ncalls = ft->ft_ncalls;
+	place_thread(ft->ft_idx, ft->ft_tidx);
+	ap_thread_init(ft->ft_tidx);
+	ft->ft_stats = stats_thread(ft->ft_idx, ft->ft_tidx);
+	ft->ft_hb = stats_heartbeat(ft->ft_idx, ft->ft_tidx);
+
+	logpfx = param_string("call-log");
+	if (*logpfx != '\0') {
+		if (asprintf(&path, "%s.%d.%u", logpfx, getpid(),
+		    ft->ft_tidx) < 0)
+			err(1, "asprintf");
+		ft->ft_log = calllog_create(path, fuzzer_apseed, ft->ft_idx,
+		    ft->ft_tidx);
+		free(path);
+	}
+
+	prng_seed(&prng_thr, ft->ft_fz->fz_seed);
+	jumps = ft->ft_fz->fz_jumps + ft->ft_tidx * ft->ft_fz->fz_stride;
+	for (u_int i = 0; i < jumps; i++)
+		prng_jump(&prng_thr);
+	ft->ft_guide = scguide_init(ft->ft_table);
+	if (corpus_enabled()) {
+		ft->ft_corpus = corpus_thread_init();
+		scfuzz_seed(ft);
+	}
+
+	/*
+	 * Generate up to pipeline-depth calls at a time, then issue them
+	 * back-to-back. A record whose arguments came from a pool that has
+	 * since shrunk may refer to something that no longer exists, so it is
+	 * regenerated just before being issued.
+	 */
+	depth = max(param_number("pipeline-depth"), 1);
+	ring = xmalloc(depth * sizeof(*ring));
+	for (sofar = 0; ncalls == 0 || sofar < ncalls; sofar += batch) {
+		batch = ncalls == 0 ? depth : min(depth, ncalls - sofar);
+		for (u_int i = 0; i < batch; i++)
+			screc_gen(&ring[i], ft->ft_table, ft->ft_guide);
+		for (u_int i = 0; i < batch; i++) {
+			rec = &ring[i];
+			if (rec->sr_pools != 0 &&
+			    rec->sr_gen != ap_generation(rec->sr_pools)) {
+				screc_discard(rec);
+				screc_gen(rec, ft->ft_table, ft->ft_guide);
+				atomic_fetch_add_explicit(
+				    &stats_pools(ft->ft_idx)->ps_stale, 1,
+				    memory_order_relaxed);
+			}
+			screc_exec(ft, rec);
+		}
+	}
+	free(ring);
+	if (ft->ft_corpus != NULL)
+		corpus_thread_fini(ft->ft_corpus);
+	if (ft->ft_guide != NULL)
+		scguide_fini(ft->ft_guide);
+	if (ft->ft_log != NULL)
+		calllog_close(ft->ft_log);
+	return (NULL);
+}
+
+/*
+ * The body of a fuzzer process: run threads-per-fuzzer fuzzer threads sharing
+ * the argument pools, the first of them on the process's initial thread.
+ * Thread t of fuzzer i uses the stream of fuzzer i + t * num-fuzzers, so a run
+ * with a single thread per fuzzer issues the same calls as before.
+ */
+static void __dead2
+scfuzz(u_int idx, const struct fuzzer *fz, u_long ncalls,
+    struct sctable *table)
+{
+	struct fzthread *fts;
+	int error;
+
+	(void)signal(SIGALRM, SIG_DFL);
+	(void)signal(SIGINFO, SIG_DFL);
+
+	if (place_fuzzer(idx))
+		ap_memblk_rebuild();
+	ap_res_start(stats_pools(idx)->ps_res);
+
+	fts = xmalloc(fuzzer_nthreads * sizeof(*fts));
+	memset(fts, 0, fuzzer_nthreads * sizeof(*fts));
+	for (u_int t = 0; t < fuzzer_nthreads; t++) {
+		fts[t].ft_idx = idx;
+		fts[t].ft_tidx = t;
+		fts[t].ft_fz = fz;
+		fts[t].ft_ncalls = ncalls;
+		fts[t].ft_table = table;
+	}
+	for (u_int t = 1; t < fuzzer_nthreads; t++) {
+		error = pthread_create(&fts[t].ft_thread, NULL, scfuzz_thread,
+		    &fts[t]);
+		if (error != 0)
+			errc(1, error, "pthread_create");
+	}
+	(void)scfuzz_thread(&fts[0]);
+	for (u_int t = 1; t < fuzzer_nthreads; t++)
+		(void)pthread_join(fts[t].ft_thread, NULL);
+	free(fts);
+
+	ap_res_stop();
+	exit(0);
+}
+
+/* Sum the heartbeats of a fuzzer's threads. */
+static uint64_t
+fzheartbeats(u_int idx)
+{
+	uint64_t seq;
+
+	seq = 0;
+	for (u_int t = 0; t < fuzzer_nthreads; t++)
+		seq += stats_heartbeat(idx, t)->hb_seq;
+	return (seq);
+}
+
+static void
+scspawn(struct fuzzer *fzs, u_int idx, u_long ncalls, struct sctable *table)
+{
+	struct fuzzer *fz;
+	uint64_t now;
+	pid_t pid;
+
+	fz = &fzs[idx];
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1)
+		err(1, "fork");
+	else if (pid == 0)
+		scfuzz(idx, fz, ncalls, table);
+	fz->fz_pid = pid;
+	fz->fz_spawnseq = fzheartbeats(idx);
+	now = nsecs();
+	for (u_int t = 0; t < fuzzer_nthreads; t++) {
+		fz->fz_watch[t].fw_spawnseq = fz->fz_watch[t].fw_seq =
+		    stats_heartbeat(idx, t)->hb_seq;
+		fz->fz_watch[t].fw_seen = now;
+		fz->fz_watch[t].fw_stuck = false;
+	}
+}
+
+/*
+ * Handle the death of a fuzzer: log why it went away and, unless it finished
+ * its calls, start a replacement. The replacement gets a fresh seed drawn from
+ * the parent's stream, so that it doesn't repeat the calls that killed its
+ * predecessor. Its argument pools still come from the run's seed, so the seed
+ * alone doesn't reproduce it; call-log does. A fuzzer that keeps dying before
+ * issuing a single call isn't replaced.
+ */
+static void
+scexited(struct fuzzer *fzs, u_int idx, int status, u_long ncalls,
+    struct sctable *table)
+{
+	struct fuzzer *fz;
+
+	fz = &fzs[idx];
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		fz->fz_pid = -1;
 		return;
+	}
+	if (WIFSIGNALED(status))
+		warnx("fuzzer %u (pid %d) killed by signal %d (%s)%s", idx,
+		    fz->fz_pid, WTERMSIG(status), strsignal(WTERMSIG(status)),
+		    WCOREDUMP(status) ? ", core dumped" : "");
+	else
+		warnx("fuzzer %u (pid %d) exited with status %d", idx,
+		    fz->fz_pid, WEXITSTATUS(status));
+	fz->fz_pid = -1;
+
+	if (!param_flag("fuzzer-respawn"))
+		return;
+	if (fzheartbeats(idx) == fz->fz_spawnseq) {
+		if (++fz->fz_failures >= FUZZER_MAXFAILURES) {
+			warnx("fuzzer %u died %u times without issuing a "
+			    "call, not respawning it", idx, fz->fz_failures);
+			return;
+		}
 	} else
-		srandom(seed + n);
+		fz->fz_failures = 0;
 
-	for (sofar = 0; ncalls == 0 || sofar < ncalls; sofar++) {
-		sd = table->scds[random() % table->cnt];
-		memset(args, 0, sizeof(args));
-		scargs_alloc(args, sd);
+	fz->fz_seed = rnd();
+	fz->fz_jumps = 1;
+	fz->fz_stride = 1;
+	scspawn(fzs, idx, ncalls, table);
+	warnx("fuzzer %u respawned as pid %d with seed %lu", idx, fz->fz_pid,
+	    fz->fz_seed);
+}
 
-		if (sd->sd_fixup != NULL)
-			(sd->sd_fixup)(args);
-		ret = __syscall(sd->sd_num, args[0], args[1], args[2], args[3],
-		    args[4], args[5], args[6], args[7]);
-		if (sd->sd_cleanup != NULL)
-			(sd->sd_cleanup)(args, ret);
+/*
+ * Look for fuzzer threads whose heartbeat hasn't changed for fuzzer-timeout
+ * seconds. They're most likely stuck in the kernel. Each is reported once, and
+ * its fuzzer is killed if so configured; one in an uninterruptible sleep won't
+ * die until it returns from the kernel, if ever.
+ */
+static void
+scwatchdog(struct fuzzer *fzs, u_int nfuzzers, struct sctable *table)
+{
+	static const char * const actions[] = { "warn", "kill" };
+	struct fzheartbeat *hb;
+	struct fzwatch *fw;
+	struct fuzzer *fz;
+	uint64_t now, timeout;
+	bool kill_stuck;
+
+	timeout = param_number("fuzzer-timeout") * 1000000000;
+	if (timeout == 0)
+		return;
+	kill_stuck = param_choice("fuzzer-timeout-action", actions,
+	    nitems(actions)) == 1;
+
+	now = nsecs();
+	for (u_int i = 0; i < nfuzzers; i++) {
+		fz = &fzs[i];
+		if (fz->fz_pid == -1)
+			continue;
+		for (u_int t = 0; t < fuzzer_nthreads; t++) {
+			fw = &fz->fz_watch[t];
+			hb = stats_heartbeat(i, t);
+			if (hb->hb_seq != fw->fw_seq) {
+				fw->fw_seq = hb->hb_seq;
+				fw->fw_seen = now;
+				fw->fw_stuck = false;
+				continue;
+			}
+			if (fw->fw_stuck || now - fw->fw_seen < timeout)
+				continue;
+			fw->fw_stuck = true;
+			warnx("fuzzer %u (pid %d) thread %u stuck for %jus, "
+			    "last in %s%s", i, fz->fz_pid, t,
+			    (uintmax_t)(now - fw->fw_seen) / 1000000000,
+			    fw->fw_seq == fw->fw_spawnseq ? "startup" :
+			    table->scds[hb->hb_sc]->sd_name,
+			    kill_stuck ? "; killing it" : "");
+			if (kill_stuck) {
+				(void)kill(fz->fz_pid, SIGKILL);
+				break;
+			}
+		}
 	}
 }
 
+static void
+scloop_handler(int sig)
+{
+
+	if (sig == SIGALRM)
+		sigalrm = 1;
+	else
+		siginfo = 1;
+}
+
+/*
+ * Start num-fuzzers fuzzers and supervise them until they have all finished.
+ * Fuzzers that die are respawned, and SIGALRM wakes the supervisor up every
+ * second, or every monitor-interval milliseconds when the monitor is enabled,
+ * to check for stuck fuzzers and update the monitor. SIGINFO prints the
+ * statistics gathered so far.
+ */
+static void
+scloop(u_long ncalls, u_long seed, struct sctable *table)
+{
+	struct fuzzer *fzs;
+	struct itimerval it;
+	struct sigaction sa;
+	pid_t *pids, pid;
+	uint64_t ms;
+	u_int live, nfuzzers;
+	int status;
+
+	printf("%s: seeding with %lu\n", getprogname(), seed);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = scloop_handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGINFO, &sa, NULL) != 0 ||
+	    sigaction(SIGALRM, &sa, NULL) != 0)
+		err(1, "sigaction");
+
+	nfuzzers = fuzzer_nfuzzers = param_number("num-fuzzers");
+	fuzzer_apseed = seed;
+	fuzzer_nthreads = max(param_number("threads-per-fuzzer"), 1);
+	stats_init(table->scds, table->cnt, nfuzzers, fuzzer_nthreads);
+	(void)cov_init();
+	(void)corpus_init();
+	place_init(nfuzzers, fuzzer_nthreads);
+	fzs = xmalloc(nfuzzers * sizeof(*fzs));
+	memset(fzs, 0, nfuzzers * sizeof(*fzs));
+	pids = xmalloc(nfuzzers * sizeof(*pids));
+	for (u_int i = 0; i < nfuzzers; i++) {
+		fzs[i].fz_seed = seed;
+		fzs[i].fz_jumps = i + 1;
+		fzs[i].fz_stride = nfuzzers;
+		fzs[i].fz_watch = xmalloc(fuzzer_nthreads *
+		    sizeof(*fzs[i].fz_watch));
+		scspawn(fzs, i, ncalls, table);
+		pids[i] = fzs[i].fz_pid;
+	}
+
+	ms = 1000;
+	if (monitor_init(table->scds, table->cnt, nfuzzers, fuzzer_nthreads))
+		ms = max(param_number("monitor-interval"), 1);
+	memset(&it, 0, sizeof(it));
+	it.it_interval.tv_sec = ms / 1000;
+	it.it_interval.tv_usec = (ms % 1000) * 1000;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_REAL, &it, NULL) != 0)
+		err(1, "setitimer");
+
+	for (live = nfuzzers; live > 0;) {
+		if ((pid = wait(&status)) != -1) {
+			for (u_int i = 0; i < nfuzzers; i++)
+				if (fzs[i].fz_pid == pid)
+					scexited(fzs, i, status, ncalls, table);
+		} else if (errno == ECHILD)
+			break;
+		live = 0;
+		for (u_int i = 0; i < nfuzzers; i++)
+			if ((pids[i] = fzs[i].fz_pid) != -1)
+				live++;
+		if (sigalrm) {
+			sigalrm = 0;
+			scwatchdog(fzs, nfuzzers, table);
+			monitor_update(pids);
+		}
+		if (siginfo) {
+			siginfo = 0;
+			stats_report();
+			place_report();
+		}
+	}
+
+	memset(&it, 0, sizeof(it));
+	(void)setitimer(ITIMER_REAL, &it, NULL);
+	monitor_fini();
+	stats_report();
+	place_report();
+	if (corpus_enabled())
+		corpus_report();
+	free(pids);
+	for (u_int i = 0; i < nfuzzers; i++)
+		free(fzs[i].fz_watch);
+	free(fzs);
+}
+
+/*
+ * Re-issue the first ncalls calls of a call log, or all of them if ncalls is 0,
+ * as fast as possible. The argument pools have been set up as they were for the
+ * logged run, but pooled resources may have been created in a different order
+ * and the address space laid out differently, so calls that had a different
+ * outcome are counted, and the memblk pool tolerates the unmapping of ranges it
+ * doesn't hold. Address space randomization should be disabled both for the
+ * logged run and the replay.
+ */
+static void
+screplay(struct calllog *log, u_long ncalls)
+{
+	struct scdesc *sd;
+	u_long args[SYSCALL_MAXARGS], diverged, lret, n, ret;
+	int error, lerror;
+
+	ap_memblk_inexact();
+	ap_res_start(NULL);
+	diverged = 0;
+	for (n = 0; ncalls == 0 || n < ncalls; n++) {
+		if ((sd = calllog_next(log, args, &lret, &lerror)) == NULL)
+			break;
+		ret = calllog_replay(sd, args, &error);
+		if ((ret == (u_long)-1) != (lret == (u_long)-1) ||
+		    (ret == (u_long)-1 && error != lerror))
+			diverged++;
+	}
+	printf("%s: replayed %lu calls, %lu with a different outcome\n",
+	    getprogname(), n, diverged);
+	ap_res_stop();
+}
+
 /* If we're root, drop privileges. */
 static void
 drop_privs()
@@ -249,7 +1182,9 @@ usage()
 	fprintf(stderr,
 	    "Usage:\t%s [-n count] [-p] [-c <syscall1>[,<syscall2>[,...]]]\n"
 	    "\t    [-g <scgroup1>[,<scgroup2>[,...]]]\n"
-	    "\t    [-s <seed>] [-x <param>[=<value>]]\n", pn);
+	    "\t    [-s <seed>] [-w <name>:<weight>[,...]]\n"
+	    "\t    [-x <param>[=<value>]]\n", pn);
+	fprintf(stderr, "\t%s -r <logfile> [-M] [-n count] [-p]\n", pn);
 	fprintf(stderr, "\t%s -d\n", pn);
 	fprintf(stderr, "\t%s -l <scgroup>\n", pn);
 	exit(1);
@@ -258,11 +1193,14 @@ usage()
 int
 main(int argc, char **argv)
 {
+	struct calllog *log;
 	struct sctable *table;
+	const void *logparams;
 	char **param, **params;
-	char *end, *scgrp, *sclist, *scgrplist;
+	char *end, *replay, *scgrp, *sclist, *scgrplist;
+	size_t logparamlen;
 	u_long ncalls, seed;
-	bool dropprivs = true, dumpparams = false;
+	bool dropprivs = true, dumpparams = false, minimizelog = false;
 	int ch;
 
 	params = calloc(argc + 1, sizeof(*params));
@@ -272,8 +1210,9 @@ main(int argc, char **argv)
 
 	seed = pickseed();
 
-	scgrp = sclist = scgrplist = NULL;
-	while ((ch = getopt(argc, argv, "c:dg:l:n:ps:x:")) != -1)
+	replay = scgrp = sclist = scgrplist = NULL;
+	ncalls = 0;
+	while ((ch = getopt(argc, argv, "c:dg:l:Mn:pr:s:w:x:")) != -1)
 		switch (ch) {
 		case 'c':
 			sclist = xstrdup(optarg);
@@ -287,20 +1226,33 @@ main(int argc, char **argv)
 		case 'l':
 			scgrp = xstrdup(optarg);
 			break;
+		case 'M':
+			minimizelog = true;
+			break;
 		case 'n':
 			errno = 0;
 			ncalls = strtoul(optarg, &end, 10);
 			if (optarg[0] == '\0' || *end != '\0' || errno != 0)
-				errx(1, "invalid parameter '%s' for -n", optarg);
+				errx(1, "invalid parameter '%s' for -n",
+				    optarg);
 			break;
 		case 'p':
 			dropprivs = false;
 			break;
+		case 'r':
+			replay = xstrdup(optarg);
+			break;
 		case 's':
 			errno = 0;
 			seed = strtoul(optarg, &end, 10);
 			if (optarg[0] == '\0' || *end != '\0' || errno != 0)
-				errx(1, "invalid parameter '%s' for -s", optarg);
+				errx(1, "invalid parameter '%s' for -s",
+				    optarg);
+			break;
+		case 'w':
+			/* Shorthand for -x sc-weights=... */
+			if (asprintf(param++, "sc-weights=%s", optarg) < 0)
+				err(1, "asprintf");
 			break;
 		case 'x':
 			*param++ = strdup(optarg);
@@ -329,13 +1281,40 @@ main(int argc, char **argv)
 		return (0);
 	}
 
+	/*
+	 * A replay runs with the logged run's parameters and argument pool
+	 * seed, in this process; -M minimizes the log instead.
+	 */
+	if (minimizelog && replay == NULL)
+		usage();
+	if (replay != NULL) {
+		log = calllog_open(replay, &seed, &logparams, &logparamlen);
+		params_unpack(logparams, logparamlen);
+		printf("%s: replaying %s with seed %lu\n", getprogname(),
+		    replay, seed);
+		prng_seed(&prng_thr, seed);
+		ap_init(seed);
+		if (dropprivs)
+			drop_privs();
+		if (minimizelog)
+			minimize(log, replay, seed, ncalls);
+		else
+			screplay(log, ncalls);
+		calllog_close(log);
+		free(replay);
+		return (0);
+	}
+
 	/* Initialize system call descriptors for the calls we'll be fuzzing. */
 	table = sctable_alloc(sclist, scgrplist);
 	free(sclist);
 	free(scgrplist);
+	sctable_report(table);
+	exec_init();
 
 	/* Create argument pools for system calls. */
-	ap_init();
+	prng_seed(&prng_thr, seed);
+	ap_init(seed);
 
 	/*
 	 * XXX there seems to be a truss/ptrace(2) bug which causes it to stop
@@ -346,7 +1325,7 @@ main(int argc, char **argv)
 
 	scloop(ncalls, seed, table);
 
-	free(table);
+	sctable_free(table);
 
 	return (0);
 }
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Regression test for replaying and minimizing a call log of mmap(2) and
+# munmap(2) calls. A replay may unmap memblks at addresses its own pool doesn't
+# hold, and minimization tries subsequences that keep an munmap(2) call but
+# drop the mmap(2) call that created its mapping; both used to trip an
+# assertion in the memblk pool.
+#
+# Usage: minimize.sh [path to sysfuzz]
+#
+# With a single worker, the check command fails on every other invocation,
+# starting with the replay of the whole log, so that ddmin accepts the second
+# half of the sequence early on, and with it munmap(2) calls of ranges mapped
+# in the first half.
+
+set -e
+
+sysfuzz=$(realpath "${1:-sysfuzz}")
+dir=$(mktemp -d -t sysfuzz)
+trap 'rm -rf "$dir"' EXIT
+
+cd "$dir"
+"$sysfuzz" -p -c mmap,munmap -n 2000 -x num-fuzzers=1 \
+    -x call-log="$dir/calls" > fuzz.out 2>&1
+log=$(ls "$dir"/calls.*.0)
+
+"$sysfuzz" -p -r "$log" > replay.out 2> replay.err
+
+echo 0 > n
+check="n=\$((\$(cat $dir/n) + 1)); echo \$n > $dir/n; [ \$((n % 2)) -eq 0 ]"
+"$sysfuzz" -p -r "$log" -M -x minimize-workers=1 \
+    -x minimize-check="$check" > minimize.out 2> minimize.err
+
+if grep -q "Assertion failed" replay.err minimize.err; then
+	grep "Assertion failed" replay.err minimize.err
+	echo "FAIL: a replay tripped an assertion"
+	exit 1
+fi
+if ! grep -q "still fail with a failed check" minimize.out; then
+	cat minimize.out minimize.err
+	echo "FAIL: minimization didn't finish"
+	exit 1
+fi
+"$sysfuzz" -p -r "$log.min" > /dev/null
+echo "PASS"
@@ -25,29 +25,36 @@
  */
 
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <sys/sysctl.h>
 
 #include <err.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "prng.h"
 #include "util.h"
 
 /*
  * Generate a random filename. buf should be a buffer of size at least NAME_MAX.
+ * The name is drawn from the PRNG state p, so callers can reproduce a sequence
+ * of names.
  */
 void
-randfile(char *buf)
+randfile(char *buf, struct prng *p)
 {
 	size_t len;
 
-	len = (random() % (NAME_MAX - 1)) + 1;
-	arc4random_buf(buf, len);
+	len = prng_range(p, NAME_MAX - 1) + 1;
+	prng_fill(p, buf, len);
 	buf[len] = '\0';
 	/* Hide illegal characters. */
 	for (u_int i = 0; i < len; i++)
 		if (buf[i] == '/' || buf[i] == '\0')
 			buf[i] = 'm';
+	if (strcmp(buf, ".") == 0 || strcmp(buf, "..") == 0)
+		buf[0] = 'm';
 }
 
 u_int
@@ -63,6 +70,20 @@ ncpu()
 	return (ncpu);
 }
 
+/*
+ * Return the current value of the monotonic clock in nanoseconds, for timing
+ * intervals.
+ */
+uint64_t
+nsecs()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		err(1, "clock_gettime");
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
 u_int
 pagecnt()
 {
@@ -77,6 +98,20 @@ pagecnt()
 	return (pgcnt);
 }
 
+/*
+ * Return the smallest superpage size supported by the system, or 0 if there is
+ * none.
+ */
+size_t
+superpagesize()
+{
+	size_t sizes[MAXPAGESIZES];
+
+	if (getpagesizes(sizes, nitems(sizes)) < 2)
+		return (0);
+	return (sizes[1]);
+}
+
 void *
 xmalloc(size_t sz)
 {
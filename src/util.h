@@ -27,12 +27,16 @@
 #ifndef _UTIL_H_
 #define	_UTIL_H_
 
+struct prng;
+
 #define	max(x, y)	((x) > (y) ? (x) : (y))
 #define	min(x, y)	((x) > (y) ? (y) : (x))
 
 u_int	ncpu(void);
+uint64_t nsecs(void);
 u_int	pagecnt(void);
-void	randfile(char *);
+void	randfile(char *, struct prng *);
+size_t	superpagesize(void);
 void *	xmalloc(size_t);
 char *	xstrdup(const char *);
 
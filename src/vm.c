@@ -28,13 +28,16 @@
 #include <sys/mman.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "argpool.h"
+#include "exec.h"
 #include "params.h"
+#include "prng.h"
 #include "syscall.h"
 #include "util.h"
 
@@ -44,6 +47,7 @@
 
 void	mmap_fixup(u_long *);
 void	mmap_cleanup(u_long *, u_long);
+u_long	mmap_fake(u_long *, int *);
 void	mincore_fixup(u_long *);
 void	mincore_cleanup(u_long *, u_long);
 void	munmap_cleanup(u_long *, u_long);
@@ -79,6 +83,7 @@ static struct scdesc mmap_desc = {
 	.sd_groups = SC_GROUP_VM,
 	.sd_fixup = mmap_fixup,
 	.sd_cleanup = mmap_cleanup,
+	.sd_fake = mmap_fake,
 	.sd_args = {
 		{
 			.sa_type = ARG_UNSPEC,
@@ -118,21 +123,28 @@ void
 mmap_fixup(u_long *args)
 {
 	uint64_t fsize;
+	size_t sps;
 
-	if (random() % 2 == 0) {
+	if (rnd_range(2) == 0) {
 		args[0] = (u_long)NULL;
-		args[1] = (random() % param_number("memblk-max-size")) + 1;
+		args[1] = rnd_range(param_number("memblk-max-size")) + 1;
 		args[3] |= MAP_ANON;
 		args[4] = (u_long)-1;
 		args[5] = 0;
+
+		/* Give superpage-aligned mappings a chance to be promoted. */
+		sps = superpagesize();
+		if ((args[3] & MAP_ALIGNMENT_MASK) == MAP_ALIGNED_SUPER &&
+		    sps != 0)
+			args[1] = (rnd_range(4) + 1) * sps;
 	} else {
 		fsize = param_number("hier-max-fsize");
 		args[0] = (u_long)NULL;
-		args[1] = random() % fsize;
+		args[1] = rnd_range(fsize);
 		args[3] = MAP_PRIVATE;
-		args[5] = random() % fsize;
+		args[5] = rnd_range(fsize);
 	}
-	args[3] &= ~(MAP_ALIGNED_SUPER | MAP_STACK | MAP_HASSEMAPHORE); /* XXX why? */
+	args[3] &= ~(MAP_STACK | MAP_HASSEMAPHORE); /* XXX why? */
 }
 
 void
@@ -149,6 +161,29 @@ mmap_cleanup(u_long *args, u_long ret)
 	ap_memblk_map(addr, args[1]);
 }
 
+u_long
+mmap_fake(u_long *args, int *errorp)
+{
+	size_t align;
+	void *addr;
+
+	/* The kernel refuses to map at address 0. */
+	if (args[1] == 0 || ((args[3] & MAP_FIXED) != 0 && args[0] == 0)) {
+		*errorp = EINVAL;
+		return ((u_long)-1);
+	}
+	if ((args[3] & MAP_FIXED) != 0)
+		return (args[0]);
+	align = (args[3] & MAP_ALIGNMENT_MASK) == MAP_ALIGNED_SUPER ?
+	    superpagesize() : 0;
+	addr = exec_fake_addr(args[1], align);
+	if (addr == NULL) {
+		*errorp = ENOMEM;
+		return ((u_long)-1);
+	}
+	return ((uintptr_t)addr);
+}
+
 static int madvise_cmds[] = {
 	MADV_NORMAL,
 	MADV_RANDOM,
@@ -170,7 +205,7 @@ static struct scdesc madvise_desc = {
 	.sd_groups = SC_GROUP_VM,
 	.sd_args = {
 		{
-			.sa_type = ARG_MEMADDR,
+			.sa_type = ARG_MEMADDR_SUPER,
 			.sa_name = "addr",
 		},
 		{
@@ -192,6 +227,7 @@ static struct scdesc mincore_desc = {
 	.sd_name = "mincore",
 	.sd_nargs = 3,
 	.sd_groups = SC_GROUP_VM,
+	.sd_flags = SD_REPLAY_FIXUP,
 	.sd_fixup = mincore_fixup,
 	.sd_cleanup = mincore_cleanup,
 	.sd_args = {
@@ -265,7 +301,7 @@ static struct scdesc mlock_desc = {
 	.sd_groups = SC_GROUP_VM,
 	.sd_args = {
 		{
-			.sa_type = ARG_MEMADDR,
+			.sa_type = ARG_MEMADDR_SUPER,
 			.sa_name = "addr",
 		},
 		{